@@ -0,0 +1,63 @@
+#ifndef BIGNUM_H
+#define BIGNUM_H
+
+#include "eval-tree.h"
+
+#include <stdio.h>
+
+// Larger precisions would make every division and square root take seconds.
+#define BIG_MAX_DIGITS 100000
+
+/**
+ * Decimal floating point numbers of any length, for the arbitrary precision mode (see setBigPrecision):
+ * the value is LIMBS * 10^(9 * EXPONENT), LIMBS being a number in base 10^9, least significant limb first.
+ * Neither the first nor the last limb is 0, zero has no limbs.
+ *
+ * Literals keep all of their digits. The results of operations keep the precision, plus two guard limbs:
+ *  - + - *            : exact when the result fits, truncated otherwise
+ *  - /, sqrt          : Newton iterations, exact when the result fits, within the guard limbs otherwise
+ *  - pow              : integer exponents only, by squaring
+ *  - comparisons, && || !, c ? a : b, abs, min, max, sum, prod and calls: as in double precision
+ * Other builtins signal ERR_BIG_FUNCTION. Results are printed rounded to the precision.
+ *
+ * Products of operands of more than a few dozen limbs use Karatsuba's algorithm, operands much longer than
+ * the other one being split into slices. The digits of intermediate values live in an arena, where the values
+ * of the operands of each node are released once the value of the node is known.
+ */
+typedef struct big {
+    u32* limbs;
+    u32 length;
+    bool negative;
+    i64 exponent;
+} Big;
+
+/**
+ * Reads the decimal literal of LENGTH characters at STR ('1.5e-3'), exactly. Null if memory ran out
+ * (ERR_ALLOC_FAIL is signaled). The value is a single block, to be released with memFree.
+ */
+Big* bigParse(const char* str, u64 length);
+Big* bigClone(const Big* value);
+/**
+ * VALUE rounded to a double, infinite if it is too large for one.
+ */
+double bigToDouble(const Big* value);
+/**
+ * Whether VALUE is an integer which fits in 64 bits, then written to OUT.
+ */
+bool bigToInteger(const Big* value, i64* out);
+/**
+ * Prints VALUE rounded to the precision, like %g does: '0.333333', '1.5e+60'.
+ */
+void bigPrint(FILE* stream, const Big* value);
+
+/**
+ * Evaluates TREE in arbitrary precision. Returns its value, to be released with memFree, null if an error
+ * was signaled. Matrices are not supported: they are evaluated by treeEvalMatrix, in doubles.
+ */
+Big* treeEvalBig(EvalNode* tree);
+/**
+ * Releases the arena.
+ */
+void shutBig();
+
+#endif /* ! BIGNUM_H */
@@ -0,0 +1,37 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "defines.h"
+
+/*
+ * Byte blocks compared a whole register at a time, used to scan text: BLOCK_BYTES is defined
+ * only when the target has vector instructions, callers then fall back to a byte loop.
+ * blockMask gives one bit per byte, set when its most significant bit is.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BLOCK_BYTES 32
+typedef __m256i Block;
+#define blockLoad(p) _mm256_loadu_si256((const __m256i*)(p))
+#define blockSet(c) _mm256_set1_epi8(c)
+#define blockEq(a, b) _mm256_cmpeq_epi8(a, b)
+#define blockOr(a, b) _mm256_or_si256(a, b)
+#define blockSub(a, b) _mm256_sub_epi8(a, b)
+#define blockSubSaturate(a, b) _mm256_subs_epu8(a, b)
+#define blockZero() _mm256_setzero_si256()
+#define blockMask(a) ((u32)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BLOCK_BYTES 16
+typedef __m128i Block;
+#define blockLoad(p) _mm_loadu_si128((const __m128i*)(p))
+#define blockSet(c) _mm_set1_epi8(c)
+#define blockEq(a, b) _mm_cmpeq_epi8(a, b)
+#define blockOr(a, b) _mm_or_si128(a, b)
+#define blockSub(a, b) _mm_sub_epi8(a, b)
+#define blockSubSaturate(a, b) _mm_subs_epu8(a, b)
+#define blockZero() _mm_setzero_si128()
+#define blockMask(a) ((u32)_mm_movemask_epi8(a))
+#endif
+
+#endif /* ! BLOCK_H */
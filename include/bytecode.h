@@ -0,0 +1,122 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "darray.h"
+#include "program.h"
+
+#include <stdio.h>
+
+/**
+ * Compiled modules: the statements of a list of lines, compiled to programs, and their binary format.
+ * A module file is mapped into memory and decoded without lexing nor parsing anything.
+ *
+ * Layout, in the byte order of the host which wrote it, every section padded to a multiple of 8 bytes:
+ *  - ModuleHeader
+ *  - the source the module was compiled from (SOURCE_LENGTH bytes, may be empty)
+ *  - the variable and builtin name tables: u32 lengths, then the characters of all names
+ *  - u32 line ends: index of the first statement after each line
+ *  - every statement: u32 target (index in the variable table, or NO_TARGET), u32 padding, then its program
+ *  - a program: ProgramHeader, its constants (ModuleConstant), its code (ModuleInstruction), then its subprograms
+ * Variables and builtins are referenced by their index in the name tables, and bound by name when loading.
+ * MODULE_VERSION changes whenever the layout or the meaning of an opcode does.
+ */
+#define MODULE_MAGIC "TRTC"
+#define MODULE_VERSION 3
+
+typedef struct module_header {
+    char magic[4];
+    u16 version;
+    u16 byteOrder; // 0x0102 as written by the producing host
+    u8 precision;  // Precision the constants were rounded to
+    u8 reserved[3];
+    u32 sourceLength;
+    u32 variableCount;
+    u32 builtinCount;
+    u32 lineCount;
+    u32 statementCount;
+    u32 reserved2;
+    u64 operators; // hashOperators() of the producing run, sources are parsed according to the operator table
+} ModuleHeader;
+
+typedef struct program_header {
+    u32 params;
+    u32 maxDepth;
+    u32 codeLength;
+    u32 constantCount;
+    u32 subprogramCount;
+    u32 reserved;
+} ProgramHeader;
+
+typedef struct module_constant {
+    double value;
+    i64 integer; // the exact value of integer literals, 0 otherwise
+    u32 exact;
+    u32 reserved;
+} ModuleConstant;
+
+typedef struct module_instruction {
+    u8 opcode;
+    u8 arity;
+    u16 reserved;
+    u32 operand; // OP_CALL: index in the builtin table
+} ModuleInstruction;
+
+typedef struct compiled_statement {
+    // Slot of the variable assigned by the statement, NO_TARGET if it is not an assignment.
+    u32 target;
+    Program* program;
+} CompiledStatement;
+
+typedef struct module {
+    darray statements; // CompiledStatement, of all lines
+    darray lineEnds;   // u32, index of the first statement after each line
+} Module;
+
+void moduleInit(Module* module);
+void moduleDestroy(Module* module);
+u64 moduleLineCount(const Module* module);
+
+/**
+ * Lexes, parses and compiles the statements of LINE, and appends them to MODULE as a new line.
+ * Variables assigned by the line are declared. Returns false, leaving MODULE unchanged, if the line
+ * has errors (they are left pending) or contains a solver, matrices or user functions, which cannot be compiled.
+ * Nothing is compiled in complex mode.
+ */
+bool moduleCompileLine(Module* module, const char* line);
+/**
+ * Whether statements of line LINE of MODULE read variables which now hold matrices: the line was compiled
+ * when they held numbers, it must be evaluated by the interpreter instead.
+ */
+bool moduleReadsMatrices(const Module* module, u64 line);
+
+/**
+ * Runs the statements of line LINE of MODULE in order, appending one StatementResult per statement to RESULTS,
+ * like evaluateStatements. Returns false if any statement failed, e.g. because it reads a matrix.
+ */
+bool moduleEvaluateLine(const Module* module, u64 line, darray* results);
+
+/**
+ * Writes MODULE to OUT, along with the SOURCE it was compiled from (may be null).
+ */
+bool moduleWrite(const Module* module, const char* source, u64 sourceLength, FILE* out);
+/**
+ * Maps the module file at PATH and decodes it into MODULE (initialized), declaring the variables it assigns.
+ * If SOURCE is not null, the module must have been compiled from exactly SOURCE.
+ * Returns false if the file cannot be read, is not a valid module of this version, or was compiled
+ * for another precision or source.
+ */
+bool moduleLoad(const char* path, Module* module, const char* source);
+
+/**
+ * FNV-1a hash of the LENGTH bytes of SOURCE, which keys compiled lines.
+ */
+u64 hashSource(const char* source, u64 length);
+
+/**
+ * Evaluates LINE, like evaluate, through a module cached in DIRECTORY under the hash of LINE:
+ * the module is loaded if it exists, otherwise it is compiled and stored for the next runs.
+ * Lines which cannot be compiled are evaluated normally, and never cached.
+ */
+bool evaluateCached(const char* directory, const char* line, darray* results);
+
+#endif /* ! BYTECODE_H */
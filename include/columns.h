@@ -0,0 +1,50 @@
+#ifndef COLUMNS_H
+#define COLUMNS_H
+
+#include "defines.h"
+
+#include <stdio.h>
+
+#define COLUMNS_MAX 64
+
+typedef enum {
+    COLUMNS_CSV, // a header line naming the columns, then one line of comma-separated numbers per row
+    COLUMNS_RAW, // one file per column, of little-endian doubles (floats under PRECISION_F32), one per row
+} ColumnsFormat;
+
+/**
+ * A table read by the columnar mode. Its files are mapped in memory, not read.
+ */
+typedef struct table {
+    ColumnsFormat format;
+    u32 count;
+    const char* names[COLUMNS_MAX]; // not null-terminated
+    u64 nameLengths[COLUMNS_MAX];
+    // The CSV file, or the file of each raw column.
+    void* maps[COLUMNS_MAX];
+    u64 mapSizes[COLUMNS_MAX];
+    u32 mapCount;
+    // Raw tables only, CSV rows are only counted while they are read.
+    u64 rows;
+    // CSV tables only: the lines after the header.
+    const char* body;
+    u64 bodyLength;
+} Table;
+
+/**
+ * Opens the table described by SPEC: either a CSV file, or a list of raw columns such as "x=x.bin,y=y.bin".
+ * The names point into SPEC or into the mapped file. Errors go to ERRSTREAM.
+ */
+bool tableOpen(const char* spec, Table* outTable, FILE* errStream);
+void tableClose(Table* table);
+
+/**
+ * Compiles EXPRESSION once, with the columns of TABLE as its variables, and evaluates it for every row
+ * on the thread pool, block of rows by block of rows. CSV fields are split a vector at a time and parsed
+ * by the task evaluating their block. The results are written to OUT in the format of the table:
+ * a CSV column named 'value', or raw values. Rows which could not be read or computed are written as NaN.
+ * Errors and warnings go to ERRSTREAM. Returns false if nothing could be written, or if writing to OUT failed.
+ */
+bool columnsRun(const Table* table, const char* expression, FILE* out, FILE* errStream);
+
+#endif /* ! COLUMNS_H */
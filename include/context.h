@@ -2,9 +2,36 @@
 #define CONTEXT_H
 
 #include "defines.h"
+#include "grid.h"
 
 typedef struct ctx {
     bool verbose;
+    bool memStats;
+    // Depth of the rings between pipeline stages, 0 when the REPL runs serially.
+    u64 pipelineDepth;
+    // Size of the thread pool used by reductions, 0 for one thread per processor.
+    u32 threads;
+    // Grid tabulation mode, see gridRun.
+    bool gridMode;
+    Grid grid;
+    GridFormat gridFormat;
+    // Table of the columnar mode, see tableOpen and columnsRun. Null when unused.
+    const char* columns;
+    // Output file of the grid and columnar modes, standard output if null.
+    const char* output;
+    // Module file written by --emit, or run by --load, see bytecode.h. Null when unused.
+    const char* emit;
+    const char* load;
+    // Directory of the compiled line cache, null when disabled.
+    const char* cacheDir;
+    // File evaluated again whenever it is saved, see watchRun. Null when unused.
+    const char* watch;
+    // Size of the table of shared subexpressions, see initShare. 0 when disabled.
+    u64 shareBudget;
+    // Runs after which statements are compiled, see initTier. 0 when tiering is disabled.
+    u32 tierThreshold;
+    // Operator definitions loaded at startup, see loadOperators. Null when unused.
+    const char* operators;
 } Context;
 
 #endif /* ! CONTEXT_H */
@@ -1,5 +1,6 @@
 #pragma once
 #include "defines.h"
+#include "memory.h"
 
 #define DEF_PRINT_ARRAY(type, format, ...)                                  \
     void darrayPrint_##type(void *array, u64 length) {                                                                 \
@@ -15,37 +16,48 @@ typedef struct darray {
     u64 stride;
     u64 length;
     void *a;
+    MemSubsystem subsystem;
 } darray;
 
 darray *darrayCreate(u64 size, u64 stride);
 void darrayInit(darray* array, u64 size, u64 stride);
 
+/**
+ * Same as darrayCreate / darrayInit, but the memory is accounted to SUBSYSTEM instead of MEM_DARRAY.
+ * If the initial allocation fails, the array is left empty with a capacity of 0,
+ * and darrayCreateIn returns null.
+ */
+darray *darrayCreateIn(u64 size, u64 stride, MemSubsystem subsystem);
+void darrayInitIn(darray* array, u64 size, u64 stride, MemSubsystem subsystem);
+
 void darrayDestroy(darray *array);
 void darrayEmpty(darray *array);
 
 /**
  * Adds an element ELEMENT to the end of the ARRAY.
  * It copies the memory pointed to by ELEMENT into the array.
+ * Returns false if the array could not grow, in which case it is left untouched.
  */
-void _darrayAdd(darray *array, void *element);
+bool _darrayAdd(darray *array, void *element);
 
 #define darrayAdd(array, elem)                                                                                         \
-    {                                                                                                                  \
+    ({                                                                                                                 \
         typeof(elem) holder = elem;                                                                                    \
         _darrayAdd(array, &holder);                                                                                    \
-    }
+    })
 
 /**
  * Inserts an element ELEMENT at index INDEX in the array, shifting all elements after INDEX.
  * It copies the memory pointed to by ELEMENT into the array.
+ * Returns false if the array could not grow, in which case it is left untouched.
  */
-void _darrayInsert(darray *array, void *element, u64 index);
+bool _darrayInsert(darray *array, void *element, u64 index);
 
 #define darrayInsert(array, elem, index)                                                                               \
-    {                                                                                                                  \
+    ({                                                                                                                 \
         typeof(elem) holder = elem;                                                                                    \
         _darrayInsert(array, &holder, index);                                                                          \
-    }
+    })
 
 u64 darrayCapacity(darray *darray);
 u64 darrayStride(darray *darray);
@@ -4,6 +4,8 @@
 #include "defines.h"
 #include "token.h"
 
+#include <stdio.h>
+
 #define ERR_SYMBOL_MAX 50
 
 enum errortype {
@@ -16,6 +18,16 @@ enum errortype {
     ERR_UNKNOWN_TOKEN,
     ERR_DIV_BY_ZERO,
     ERR_INVALID_EXPR,
+    ERR_UNKNOWN_VARIABLE,
+    ERR_TOO_MANY_VARS,
+    ERR_INVALID_RANGE,
+    ERR_NOT_BRACKETED,
+    ERR_MATRIX_SHAPE,
+    ERR_MATRIX_OPERAND,
+    ERR_CALL_DEPTH,
+    ERR_COMPLEX_OPERAND,
+    ERR_BIG_FUNCTION,
+    ERR_BIG_RESULT,
 
     _ERR_SIZE
 };
@@ -24,23 +36,50 @@ typedef struct err {
     enum errortype type;
     u64 position;
     bool hasToken;
-    union errtoken {
-        char symbol[ERR_SYMBOL_MAX];
-        Token* token;
-    } value;
+    Identifier tokenKind;
+    // Copied from the source, errors outlive the token streams they were found in.
+    char symbol[ERR_SYMBOL_MAX];
     bool symbolTooLong;
 } Error;
 
+/**
+ * The error system is per-thread: every thread reporting errors must initialize (and shut) its own.
+ */
 void initErrorSystem();
 void shutErrorSystem();
 
-void signalError(enum errortype type, Token* token);
+void signalError(enum errortype type, const TokenStream* tokens, u64 index);
 
-void signalErrorNoToken(enum errortype type, char* symbol, u64 position);
+void signalErrorNoToken(enum errortype type, const char* symbol, u64 position);
 
 u64 getErrorCount();
+bool hasErrorOfType(enum errortype type);
 Error* getNextError();
+/**
+ * Drops all pending errors of the calling thread.
+ */
+void clearErrors();
+
+/**
+ * Moves the pending errors of the calling thread to the end of OUT_ERRORS, a darray of Error.
+ * Tasks of the thread pool report their errors this way: the thread which started them
+ * signals them again with resignalErrors, in the order it chooses.
+ */
+void takeErrors(darray* outErrors);
+/**
+ * Appends TAKEN, errors moved by takeErrors, to the pending errors of the calling thread.
+ */
+void resignalErrors(const darray* taken);
 
+/**
+ * Prints all pending errors of the calling thread to STREAM, then clears them.
+ */
+void printErrorsTo(FILE* stream, const char* expression);
 void printErrors(const char* expression);
+/**
+ * Same as printErrorsTo, but into a newly allocated string (to be released with free()).
+ * Returns null if there are no pending errors.
+ */
+char* formatErrors(const char* expression, u64* outLength);
 
 #endif /* ! ERROR_H */
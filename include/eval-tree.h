@@ -1,19 +1,91 @@
+#pragma once
 #include "defines.h"
 #include "token.h"
 
+struct program;
+struct big;
+
 typedef struct eval_node {
     functionptr function;
+    partialsptr partials;
     u32 arity;
-    Token* token;
+    bool lazy;
+    Identifier kind;
+    // Index of the token this node was built from, for error reporting.
+    u32 token;
+    // Value of NUMBER nodes.
+    Number literal;
+    // Exact value of NUMBER nodes in arbitrary precision mode, null otherwise.
+    struct big* big;
+    // Slot of the variable read by NAME nodes without function, index of the user function called by CALL nodes.
+    u32 variable;
+    // Number of rows of matrix literals ('[' nodes), whose children are the elements, row by row.
+    u32 rows;
     darray* children; // struct eval_node**
+    // Number of nodes of the subtree, and whether it holds reductions, solvers or calls, which write the variables
+    // they bind. Set by treeMeasure once the tree is built.
+    u64 size;
+    bool binds;
+    // Compiled body of reductions, built on their first evaluation.
+    struct program* program;
     struct eval_node* parent;
 } EvalNode;
 
-EvalNode* treeCreate(Token* token);
+EvalNode* treeCreate(const TokenStream* tokens, u32 index);
+/**
+ * Leaf reading the variable in SLOT, built from the NAME token at INDEX.
+ */
+EvalNode* treeCreateVariable(const TokenStream* tokens, u32 index, u32 slot);
+/**
+ * Call of the user function FUNCTION, built from the NAME token at INDEX. Its children are the arguments.
+ */
+EvalNode* treeCreateCall(const TokenStream* tokens, u32 index, u32 function);
+/**
+ * Returns the tree to use in place of CALL, which has its arguments: a copy of the body of small functions,
+ * where parameters are replaced by the arguments and constants are folded, CALL itself otherwise.
+ * CALL is destroyed if it is replaced.
+ */
+EvalNode* treeInlineCall(EvalNode* call);
+
+/**
+ * Returns false if the child could not be attached, in which case the caller still owns it.
+ */
+bool treeAddChild(EvalNode* parent, EvalNode* child);
 
-void treeAddChild(EvalNode* parent, EvalNode* child);
+/**
+ * TOKENS must be the stream the tree was built from.
+ */
+EvalNode* treeChild(EvalNode* tree, u64 index);
 
-void printTree(EvalNode* tree);
+void printTree(EvalNode* tree, const TokenStream* tokens);
+/**
+ * Sets the size and binds fields of the nodes of TREE.
+ */
+void treeMeasure(EvalNode* tree);
 double treeEval(EvalNode* tree);
+/**
+ * Same result and errors as treeEval, but large trees are split into subtrees evaluated as tasks on the thread pool,
+ * TREE having been measured. Subtrees under lazy nodes, and those binding variables, are only walked by the
+ * calling thread.
+ */
+double treeEvalParallel(EvalNode* tree);
+/**
+ * Evaluates TREE in 64-bit integers, into OUT. Returns false, signaling nothing, as soon as a value is not an
+ * exact integer or an operation has no exact integer result (overflow, fractional quotient, division by zero,
+ * any builtin but abs, min, max and pow): TREE is then to be evaluated by treeEval.
+ * Operands are evaluated lazily like with treeEval, so the same operands decide the result.
+ */
+bool treeEvalExact(EvalNode* tree, i64* out);
+/**
+ * Evaluates TREE over dual numbers, in a single pass: OUT[0] receives the value, and OUT[1 + v] the partial
+ * derivative with respect to the variable in slot v, for each of the VARIABLES first slots.
+ * OUT must hold 1 + VARIABLES doubles.
+ */
+void treeEvalDual(EvalNode* tree, u32 variables, double* out);
+/**
+ * Evaluates TREE in complex numbers, see setComplexMode. Functions without a complex version signal
+ * ERR_COMPLEX_OPERAND when one of their arguments has an imaginary part.
+ */
+Complex treeEvalComplex(EvalNode* tree);
 
 void treeDestroy(EvalNode* node);
@@ -4,16 +4,226 @@
 #include "defines.h"
 
 typedef double (*functionptr)(double* arguments);
+/**
+ * Writes the partial derivative of the function with respect to each of its ARGUMENTS into OUT_PARTIALS.
+ * RESULT is the value of the function at ARGUMENTS, some derivatives are cheaper to get from it.
+ */
+typedef void (*partialsptr)(double* arguments, double result, double* outPartials);
 
 typedef struct func_t {
     functionptr ptr;
     u32 arity;
+    // Lazy functions do not always need all of their arguments, the tree walker
+    // evaluates them with short-circuiting instead of calling PTR. PTR still gives the eager result.
+    bool lazy;
+    // Derivative rule used by dual evaluation, null for piecewise constant functions (comparisons...).
+    partialsptr partials;
 } Function;
 
+/**
+ * A function callable by name, e.g. 'if(c, a, b)'.
+ */
+typedef struct builtin_t {
+    const char* name;
+    Function function;
+} Builtin;
+
+#define NO_BUILTIN ((u32)-1)
+
+/**
+ * Precision of the whole evaluation pipeline: literals are parsed, and every function result
+ * is rounded, to the selected format. Statements carry values in doubles in both modes, but in
+ * PRECISION_F32 they always hold exactly representable floats. Grids, columns and the terms of
+ * reductions are computed over float lanes instead, see programRunFloat: grid coordinates are
+ * rounded to floats like any other value, and raw grid and column files hold floats.
+ * Integers computed exactly are the exception, in both modes: they are printed with all of their
+ * digits, see Number. In PRECISION_F32, '16777216+1' prints 16777217, while '16777216+1.0' prints
+ * the float 1.67772e+07.
+ *
+ * Error bounds, relative to the exact result for the (already rounded) operands,
+ * with u = 2^-53 in f64 mode and u = 2^-24 in f32 mode:
+ *  - number literals          : correctly rounded, <= u
+ *  - + - * / abs min max pow  : exact on integer operands while the result is an integer which
+ *                               fits in 64 bits, see Number, and as below otherwise
+ *  - + - * /                  : correctly rounded, <= u (computing in double then rounding to float
+ *                               is exact for these, double has more than 2 * 24 + 2 bits of mantissa)
+ *  - comparisons, && || !     : exact
+ *  - c ? a : b, if(c, a, b)   : exact (returns one of its operands)
+ *  - sqrt, abs, min, max      : correctly rounded, <= u
+ *  - exp log sin cos tan pow  : the libm's, a few u in f64 mode, <= u in f32 mode except in rare
+ *                               double rounding cases
+ *  - sum, prod of n terms     : pairwise, about log2(n) * u on top of the errors of the terms
+ *  - matrix products, dot     : accumulated in double in index order, then rounded: about n * u in
+ *                               f64 mode for n terms per element, <= u in f32 mode unless n is large
+ * Errors compound along the tree: a chain of n operations is within about n * u.
+ * Partial derivatives computed by dual evaluation are rounded the same way as values.
+ */
+typedef enum {
+    PRECISION_F64 = 0,
+    PRECISION_F32,
+} Precision;
+
+/**
+ * A literal or computed value, which may also be an exact 64-bit integer.
+ * VALUE always holds the value at the current precision. If EXACT, INTEGER holds it exactly:
+ * integer literals, and results of integer operations which neither overflowed nor had to round,
+ * keep all of their digits, even beyond 2^53 (2^24 in PRECISION_F32).
+ */
+typedef struct number {
+    double value;
+    i64 integer;
+    bool exact;
+} Number;
+
+void setPrecision(Precision precision);
+Precision getPrecision();
+/**
+ * Rounds X to the current precision.
+ */
+double roundToPrecision(double x);
+
+/**
+ * A value of complex mode. Both parts are rounded to the current precision.
+ */
+typedef struct complex_value {
+    double re;
+    double im;
+} Complex;
+
+typedef Complex (*complexptr)(const Complex* arguments);
+
+/**
+ * Complex mode: the name 'i' is the imaginary unit, and values are complex numbers, see treeEvalComplex.
+ * The operators and builtins which have a complex version take complex arguments, the others (orderings,
+ * min, max...) only real ones. Reductions iterate over real bounds, solvers over real parts.
+ */
+void setComplexMode(bool enabled);
+bool isComplexMode();
+/**
+ * Complex version of FUNCTION, null if it has none.
+ */
+complexptr complexFunction(functionptr function);
+
+/**
+ * Arbitrary precision mode, with DIGITS significant decimal digits, 0 to disable it: literals are read exactly, and
+ * statements are evaluated over decimal numbers of any length, see treeEvalBig.
+ */
+void setBigPrecision(u32 digits);
+u32 getBigPrecision();
+
 extern const Function NONE;
 extern const Function ADD;
 extern const Function SUBTRACT;
 extern const Function MULTIPLY;
 extern const Function DIVIDE;
+// -a
+extern const Function NEGATE;
+
+extern const Function EQUAL;
+extern const Function NOT_EQUAL;
+extern const Function LESS;
+extern const Function LESS_EQUAL;
+extern const Function GREATER;
+extern const Function GREATER_EQUAL;
+
+extern const Function AND;
+extern const Function OR;
+extern const Function NOT;
+// c ? a : b
+extern const Function SELECT;
+// 'x = ...', only valid at the start of a statement. The parser handles it, it is never called.
+extern const Function ASSIGN;
+
+extern const Function SQRT;
+extern const Function EXP;
+extern const Function LOG;
+extern const Function SIN;
+extern const Function COS;
+extern const Function TAN;
+extern const Function ABS;
+extern const Function POW;
+extern const Function MIN;
+extern const Function MAX;
+// transpose(m) and dot(u, v), see matrix.h. On numbers they are the identity and the product.
+extern const Function TRANSPOSE;
+extern const Function DOT;
+
+// sum(i, a, b, expr) and prod(i, a, b, expr): EXPR for the variable I going from A to B by steps of 1.
+// Always evaluated lazily, PTR only identifies them.
+extern const Function SUM;
+extern const Function PROD;
+// solve(expr, x, low, high) and minimize(expr, x, low, high), see solver.h. Always evaluated lazily.
+extern const Function SOLVE;
+extern const Function MINIMIZE;
+// Calls of user functions, see UserFunction. Always evaluated lazily, PTR only identifies them.
+extern const Function CALL;
+// The imaginary unit 'i' of complex mode, a function of no arguments. PTR signals ERR_COMPLEX_OPERAND.
+extern const Function IMAGINARY;
+
+void initFunctions();
+
+bool isReduction(functionptr function);
+bool isSolver(functionptr function);
+/**
+ * Index of the argument naming the variable bound by FUNCTION (the index of a sum...), -1 if there is none.
+ */
+i32 boundArgument(functionptr function);
+
+const Builtin* getBuiltin(u32 index);
+u32 getBuiltinCount();
+/**
+ * Looks up the builtin named by the LENGTH first characters of STR.
+ */
+bool builtinFromName(const char* str, u64 length, u32* outIndex);
+/**
+ * Looks up the builtin whose function is FUNCTION.
+ */
+bool builtinFromFunction(functionptr function, u32* outIndex);
+
+#define USER_FUNCTION_MAX_ARITY 16
+// Calls nested deeper are assumed to recurse without end, before they overflow the stack.
+#define MAX_CALL_DEPTH 1000
+
+struct eval_node;
+struct program;
+
+/**
+ * A function defined by a statement such as 'f(x, y) = x * x + y', callable by the statements parsed after it.
+ * Its parameters are variables bound by each call, like the index of a sum. Small bodies are copied into
+ * their calls when these are parsed, the others are compiled once, on their first call, and run in a frame
+ * holding the arguments. Recursive bodies cannot be compiled, they are walked with the parameters set to the
+ * arguments, then restored.
+ * Definitions are kept until shutUserFunctions: defining a name again adds a new function, the calls parsed
+ * before keep calling the previous one.
+ */
+typedef struct user_function_t {
+    char* name;
+    u32 arity;
+    u32 params[USER_FUNCTION_MAX_ARITY]; // variable slots
+    struct eval_node* body;              // null while the definition is parsed
+    struct program* program;             // null if the body cannot be compiled
+    bool compiled;                       // whether PROGRAM was attempted
+} UserFunction;
+
+/**
+ * Adds a function named by the LENGTH first characters of NAME, taking the variables in slots PARAMS.
+ * Its body is set once parsed, recursive calls in it find the function. Returns false if memory ran out.
+ */
+bool userFunctionDefine(const char* name, u64 length, u32 arity, const u32* params, u32* outIndex);
+/**
+ * Removes the function added last, whose body could not be parsed.
+ */
+void userFunctionUndefine();
+/**
+ * Looks up the latest definition of the function named by the LENGTH first characters of STR.
+ */
+bool userFunctionFromName(const char* str, u64 length, u32* outIndex);
+UserFunction* getUserFunction(u32 index);
+u32 getUserFunctionCount();
+/**
+ * Returns the compiled body of the function, compiling it on the first call. Null if it cannot be compiled.
+ */
+const struct program* userFunctionProgram(u32 index);
+void shutUserFunctions();
 
 #endif /* ! FUNCTION_H */
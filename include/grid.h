@@ -0,0 +1,50 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "defines.h"
+
+#include <stdio.h>
+
+#define GRID_MAX_DIMENSIONS 4
+
+/**
+ * One dimension of a grid: the variable NAME goes from LOW to HIGH (included) by steps of STEP.
+ */
+typedef struct grid_axis {
+    const char* name; // not null-terminated
+    u64 nameLength;
+    double low;
+    double high;
+    double step;
+    u64 count;
+} GridAxis;
+
+/**
+ * A lattice of points, the last axis varying fastest (rows of an image for a 2D grid).
+ */
+typedef struct grid {
+    GridAxis axes[GRID_MAX_DIMENSIONS];
+    u32 dimensions;
+    u64 points;
+} Grid;
+
+typedef enum {
+    GRID_RAW, // little-endian doubles, one per point (floats under PRECISION_F32)
+    GRID_PGM, // 16-bit greyscale image, values clamped to [0, 1], 2D grids only
+    GRID_CSV, // one line per point: the coordinates, then the value
+} GridFormat;
+
+/**
+ * Parses a grid specification such as "x=0:1:1e-3,y=0:1:1e-3". The names point into SPEC.
+ */
+bool gridParse(const char* spec, Grid* outGrid);
+bool gridParseFormat(const char* name, GridFormat* outFormat);
+
+/**
+ * Compiles EXPRESSION once, evaluates it at every point of GRID on the thread pool, tile by tile,
+ * and writes the values to OUT in FORMAT. Points whose evaluation failed are written as NaN.
+ * Errors and warnings go to ERRSTREAM. Returns false if nothing could be written, or if writing to OUT failed.
+ */
+bool gridRun(const Grid* grid, const char* expression, FILE* out, GridFormat format, FILE* errStream);
+
+#endif /* ! GRID_H */
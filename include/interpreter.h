@@ -2,8 +2,85 @@
 #include "eval-tree.h"
 #include "token.h"
 
-bool tokenize(const char *str, darray* tokenBuffer);
+bool tokenize(const char *str, TokenStream* tokens);
 
-EvalNode *parse(darray *tokens);
+/**
+ * Parses the tokens in [BEGIN, END) into a single tree.
+ */
+EvalNode *parseRange(TokenStream *tokens, u64 begin, u64 end);
+EvalNode *parse(TokenStream *tokens);
 
-bool evaluate(const char* expression, double* outResult);
+// Target of statements which are not assignments.
+#define NO_TARGET ((u32)-1)
+// Target of function definitions.
+#define FUNCTION_TARGET ((u32)-2)
+
+/**
+ * Returns the index of the first ';' token at or after BEGIN, or the number of tokens.
+ */
+u64 statementEnd(TokenStream* tokens, u64 begin);
+/**
+ * Parses the statement in [BEGIN, END). If it is of the form 'name = expression', declares the variable NAME,
+ * writes its slot to OUT_TARGET and returns the tree of the expression. OUT_TARGET is NO_TARGET otherwise.
+ * Definitions such as 'f(x, y) = x * y' define the function right away, see UserFunction: OUT_TARGET is then
+ * FUNCTION_TARGET, and there is no tree.
+ */
+EvalNode* parseStatement(TokenStream* tokens, u64 begin, u64 end, u32* outTarget);
+
+/**
+ * Whether TOKENS call or define user functions, which only the interpreter runs.
+ */
+bool tokensUseFunctions(const TokenStream* tokens);
+
+/**
+ * Outcome of one ';'-separated statement.
+ */
+typedef struct statement_result {
+    double value;
+    bool ok;
+    // Formatted error report of this statement, null if there is none.
+    char* errors;
+    u64 errorsLength;
+    // Partial derivatives of the value with respect to each declared variable, in gradient mode. Null otherwise.
+    double* gradient;
+    u32 gradientLength;
+    // Reports of the solvers run by the statement, null if there are none.
+    char* notes;
+    u64 notesLength;
+    // Set if the value is an exact integer, then held by INTEGER with all of its digits.
+    bool exact;
+    i64 integer;
+    // Value of statements giving a matrix, null otherwise.
+    struct matrix* matrix;
+    // Imaginary part of the value, in complex mode.
+    double imaginary;
+    // Value in arbitrary precision mode, VALUE being rounded from it. Null otherwise, and for exact integers.
+    struct big* big;
+} StatementResult;
+
+/**
+ * Enables gradient mode: statements are evaluated over dual numbers, and their results also hold the
+ * partial derivatives of their value with respect to every variable declared at the time.
+ * Variables are independent inputs: 'y = x * x; y' gives 1 for dy and 0 for dx.
+ */
+void setGradient(bool enabled);
+
+/**
+ * Parses all ';'-separated statements of already tokenized input in a single pass, then evaluates them in order.
+ * A statement of the form 'name = expression' also stores its value in the variable NAME.
+ * One StatementResult is appended to RESULTS per non-empty statement. Function definitions which succeed have none.
+ * The errors of each statement are formatted into its result, and cleared from the error system.
+ * Returns false if any statement failed.
+ */
+bool evaluateStatements(const char* expression, TokenStream* tokens, darray* results);
+
+void initResults(darray* results);
+/**
+ * Frees the error reports held by RESULTS and empties it.
+ */
+void clearResults(darray* results);
+
+/**
+ * Tokenizes EXPRESSION once, then evaluates all of its statements. See evaluateStatements.
+ */
+bool evaluate(const char* expression, darray* results);
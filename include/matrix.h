@@ -0,0 +1,64 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include "eval-tree.h"
+
+#include <stdio.h>
+
+/**
+ * Matrix values: literals such as '[1, 2; 3, 4]' (',' separates the elements of a row, ';' the rows),
+ * and the variables they are assigned to. Vectors are matrices with a single row or column.
+ *
+ * Operators and builtins apply element-wise, numbers being used for every element, except:
+ *  - '*' between two matrices, the matrix product,
+ *  - transpose(m),
+ *  - dot(u, v), the sum of the products of the elements of two matrices with as many elements.
+ * Lazy builtins (sum, solve...) and logical operators only take numbers. The condition of 'c ? a : b'
+ * is a number, its operands may be matrices.
+ *
+ * Elements are stored row by row. Freed matrices are kept by the thread which freed them and reused
+ * for the next ones of the same size class, so that evaluating a formula does not allocate once per node.
+ */
+typedef struct matrix {
+    u32 rows;
+    u32 columns;
+    u32 sizeClass; // DATA holds 2^sizeClass elements
+    double* data;
+} Matrix;
+
+#define MATRIX_MAX_ELEMENTS (1u << 28)
+
+/**
+ * Returns an uninitialized ROWS x COLUMNS matrix, null if memory ran out or it would be too large
+ * (ERR_ALLOC_FAIL is signaled).
+ */
+Matrix* matrixCreate(u32 rows, u32 columns);
+Matrix* matrixCopy(const Matrix* matrix);
+void matrixDestroy(Matrix* matrix);
+/**
+ * Releases the matrices kept for reuse by the calling thread.
+ */
+void shutMatrices();
+
+/**
+ * OUT = A B, where A has as many columns as B has rows, and OUT has the rows of A and the columns of B.
+ * OUT must not be A nor B.
+ */
+void matrixMultiply(const Matrix* a, const Matrix* b, Matrix* out);
+
+/**
+ * Prints MATRIX the way it is written: '[1, 2; 3, 4]'.
+ */
+void matrixPrint(FILE* stream, const Matrix* matrix);
+
+/**
+ * Whether TREE contains matrix literals or reads variables holding matrices.
+ */
+bool treeHasMatrices(EvalNode* tree);
+/**
+ * Evaluates TREE, which may contain matrices. Returns its value if it is a matrix, to be destroyed by the caller.
+ * Otherwise returns null, and writes the value to OUT_VALUE if there were no errors.
+ */
+Matrix* treeEvalMatrix(EvalNode* tree, double* outValue);
+
+#endif /* ! MATRIX_H */
@@ -0,0 +1,81 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include "defines.h"
+
+/**
+ * Every allocation made by the interpreter goes through this module, tagged with the subsystem
+ * responsible for it, so that live bytes, peak bytes and allocation counts can be reported
+ * per subsystem, and a global memory cap can be enforced.
+ */
+typedef enum {
+    MEM_GENERAL = 0,
+    MEM_DARRAY,
+    MEM_STRING,
+    MEM_TREE,
+    MEM_LEXER,
+    MEM_ERROR,
+    MEM_PROGRAM,
+    MEM_MATRIX,
+    MEM_SHARE,
+    MEM_BIG,
+    MEM_TIER,
+
+    _MEM_SUBSYSTEM_SIZE
+} MemSubsystem;
+
+/**
+ * Backend used to obtain raw memory. The accounting layer adds its own header to each block,
+ * so the sizes seen by the backend are slightly larger than the ones requested.
+ */
+typedef struct allocator_t {
+    void* (*alloc)(u64 size, void* userData);
+    void* (*realloc)(void* ptr, u64 oldSize, u64 newSize, void* userData);
+    void (*free)(void* ptr, u64 size, void* userData);
+    void* userData;
+} Allocator;
+
+typedef struct mem_stats_t {
+    u64 live;
+    u64 peak;
+    u64 allocations;
+    u64 frees;
+    u64 failures;
+} MemStats;
+
+/**
+ * Replaces the allocation backend. Passing null restores the default (libc) backend.
+ * Must be called while no block allocated through the previous backend is still alive.
+ */
+void memSetAllocator(const Allocator* allocator);
+
+/**
+ * Sets the maximum number of live bytes across all subsystems. 0 means unlimited.
+ * Allocations exceeding the cap fail and raise ERR_ALLOC_FAIL.
+ * The error subsystem is exempt, so that the failure itself can always be reported.
+ */
+void memSetCap(u64 bytes);
+u64 memGetCap();
+
+void* memAlloc(MemSubsystem subsystem, u64 size);
+void* memRealloc(MemSubsystem subsystem, void* ptr, u64 newSize);
+void memFree(void* ptr);
+
+/**
+ * Live and peak bytes of SUBSYSTEM, and its number of allocations, frees and failures over all threads.
+ */
+void memGetStats(MemSubsystem subsystem, MemStats* out);
+/**
+ * Statistics summed over all subsystems. The peak is the peak of the total, not the sum of peaks.
+ */
+void memGetTotalStats(MemStats* out);
+
+void memPrintStats();
+
+/**
+ * Parses a size such as "512", "64k", "16M" or "2G" into a number of bytes.
+ * Returns false on negative sizes, and on sizes which do not fit in 64 bits.
+ */
+bool memParseSize(const char* str, u64* outBytes);
+
+#endif /* ! MEMORY_H */
@@ -12,4 +12,4 @@
 #define DEF_RESULT_SIMPLE(type) DEF_RESULT(type, type)
 
 DEF_RESULT_SIMPLE(u64);
-DEF_RESULT(Tokens, Token**);
+DEF_RESULT(Tokens, TokenStream*);
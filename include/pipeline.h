@@ -0,0 +1,26 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "darray.h"
+
+#include <stdio.h>
+
+#define PIPELINE_DEFAULT_DEPTH 256
+// Lines in flight between two stages, beyond this the rings only waste memory.
+#define PIPELINE_MAX_DEPTH (1u << 20)
+
+/**
+ * Prints the outcome of all statements of one line (StatementResult), the way the REPL does.
+ * Error reports go to ERRSTREAM, right before the result of the statement they belong to.
+ */
+void printResults(FILE* stream, FILE* errStream, darray* results);
+
+/**
+ * Reads expressions line by line from IN and writes results to OUT, like the serial REPL,
+ * but with reading/lexing, parsing/evaluation and formatting/output running on three threads,
+ * connected by SPSC rings of DEPTH entries. Results are written in input order.
+ * Error reports go to ERRSTREAM, interleaved with the results in the same order.
+ */
+bool runPipeline(FILE* in, FILE* out, FILE* errStream, u64 depth);
+
+#endif /* ! PIPELINE_H */
@@ -0,0 +1,164 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include "darray.h"
+#include "eval-tree.h"
+
+/**
+ * A tree compiled once into postfix code for a stack machine, which evaluates PROGRAM_LANES
+ * points at a time: every instruction works on a whole block of lanes, in loops simple enough
+ * to be vectorized by the compiler.
+ *
+ * Programs take parameters, the indices of the reductions they are the body of. The last
+ * parameter is the index of the innermost one, it has a different value in every lane.
+ * Conditionals and logical operators are compiled without branches, both sides are evaluated,
+ * but errors of the discarded side are dropped so that the result is the same as with treeEval.
+ */
+#define PROGRAM_LANES 8
+
+typedef enum {
+    OP_CONST,    // constants[operand]
+    OP_VARIABLE, // variable in slot operand
+    OP_PARAM,    // parameter operand
+    OP_ADD,
+    OP_SUBTRACT,
+    OP_MULTIPLY,
+    OP_DIVIDE,
+    OP_EQUAL,
+    OP_NOT_EQUAL,
+    OP_LESS,
+    OP_LESS_EQUAL,
+    OP_GREATER,
+    OP_GREATER_EQUAL,
+    OP_AND,
+    OP_OR,
+    OP_NOT,
+    OP_SELECT,
+    OP_CALL, // any other function, one lane at a time
+    OP_SUM,  // sum of subprograms[operand] over [a, b]
+    OP_PROD, // product of subprograms[operand] over [a, b]
+    OP_NEGATE,
+    OP_INVOKE, // compiled body of the user function operand, in a frame holding the arguments
+} Opcode;
+
+typedef struct instruction {
+    u8 opcode;
+    u8 arity;
+    u32 operand;
+    functionptr function;
+} Instruction;
+
+typedef struct program {
+    darray code;        // Instruction
+    darray constants;   // Number
+    darray subprograms; // struct program*, bodies of nested reductions
+    u32 maxDepth;
+    u32 params;
+} Program;
+
+/**
+ * Faults found while running a program, as bits. They are returned instead of signaled,
+ * so that programs can run on threads other than the one reporting errors.
+ */
+enum {
+    FAULT_DIV_BY_ZERO = 1,
+    FAULT_RANGE = 2,
+};
+
+typedef enum {
+    REDUCE_SUM,
+    REDUCE_PROD,
+} ReduceKind;
+
+/**
+ * Values of the last parameter of a program over a block of lanes: ORIGIN + (INDEX + l) * STEP in lane l.
+ * If COLUMNS is not null, every parameter varies instead: parameter k is COLUMNS[k][INDEX + l] in lane l,
+ * and PARAMS, ORIGIN and STEP are unused. FLOAT_COLUMNS takes the place of COLUMNS for programRunFloat.
+ */
+typedef struct lane_range {
+    double origin;
+    double step;
+    u64 index;
+    const double* const* columns;
+    const float* const* floatColumns;
+} LaneRange;
+
+/**
+ * Compiles TREE, where reading the variable in slot BOUND[k] reads parameter k.
+ * Returns null if memory ran out, or if TREE contains a solver or matrices, which cannot be compiled, or calls
+ * which cannot be compiled: of recursive functions, or of functions reading the variables in BOUND.
+ */
+Program* programCompile(EvalNode* tree, const u32* bound, u32 boundCount);
+/**
+ * Constant CONSTANT of PROGRAM, a program or one of its subprograms, compiled from the NUMBER token TOKEN.
+ * Writing another literal there makes the program compute the same tree with that literal instead.
+ */
+typedef struct program_literal {
+    Program* program;
+    u32 constant;
+    u32 token;
+} ProgramLiteral;
+
+/**
+ * Compiles TREE, which takes no parameters, reading nothing but TREE: unlike programCompile, it can run on a thread
+ * other than the one evaluating statements. Calls of user functions cannot be compiled, and reading variables which
+ * hold matrices is not refused: callers check programReadsMatrices before running the program.
+ * One ProgramLiteral per constant is appended to LITERALS, unless it is null.
+ */
+Program* programCompileDetached(EvalNode* tree, darray* literals);
+/**
+ * Whether PROGRAM reads variables which now hold matrices.
+ */
+bool programReadsMatrices(const Program* program);
+/**
+ * Creates an empty program taking PARAMS parameters, for loaders to fill.
+ */
+Program* programCreate(u32 params);
+void programDestroy(Program* program);
+
+/**
+ * Evaluates PROGRAM for LANES (at most PROGRAM_LANES) values of its last parameter, described by RANGE,
+ * the other parameters being PARAMS. Writes the results to OUT, and the faults of each of them to OUT_FAULTS.
+ */
+void programRun(const Program* program, const double* params, const LaneRange* range, u32 lanes, double* out,
+                u8* outFaults);
+/**
+ * programRun over float lanes, for PRECISION_F32: twice as many lanes fit in a vector register, and OUT is half
+ * the size. The results are those of programRun, but for the parameters, which are rounded to floats as well.
+ */
+void programRunFloat(const Program* program, const double* params, const LaneRange* range, u32 lanes, float* out,
+                     u8* outFaults);
+
+/**
+ * Runs PROGRAM, which takes no parameters, in 64-bit integers, into OUT. Returns false if its result is not
+ * an exact integer, see treeEvalExact: it is then to be run by programRun. Both sides of conditionals are
+ * evaluated, but only the side which is selected must be exact.
+ */
+bool programRunExact(const Program* program, i64* out);
+
+/**
+ * Opcode of the instructions applying FUNCTION, OP_CALL for the functions without one.
+ */
+Opcode programOpcode(functionptr function);
+/**
+ * Applies the operation of OPCODE (FUNCTION for OP_CALL) to the integers ARGS, eagerly.
+ * Returns false if the result is not an exact integer: on overflow, fractional quotients, division by zero,
+ * negative powers, and for the functions without an integer version.
+ */
+bool integerApply(Opcode opcode, functionptr function, const i64* args, i64* out);
+
+/**
+ * Sum or product of BODY for its last parameter going from FIRST to LAST by steps of 1, the other
+ * parameters being PARAMS. Terms are combined pairwise in an order which only depends on the number
+ * of terms, so the result is the same whether the terms are spread over the thread pool (PARALLEL) or not.
+ * Faults are or-ed into OUT_FAULTS.
+ */
+double programReduce(const Program* body, ReduceKind kind, const double* params, double first, double last,
+                     bool parallel, u8* outFaults);
+
+/**
+ * Signals the errors corresponding to FAULTS.
+ */
+void signalFaults(u8 faults);
+
+#endif /* ! PROGRAM_H */
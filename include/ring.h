@@ -0,0 +1,40 @@
+#ifndef RING_H
+#define RING_H
+
+#include "defines.h"
+
+#define RING_CACHE_LINE 64
+
+/**
+ * Bounded single-producer / single-consumer lock-free queue of pointers.
+ * Exactly one thread may push and exactly one (other) thread may pop.
+ */
+typedef struct ring_t {
+    void** slots;
+    u64 mask;
+
+    // Written by the producer only.
+    _Alignas(RING_CACHE_LINE) u64 tail;
+    u64 cachedHead;
+
+    // Written by the consumer only.
+    _Alignas(RING_CACHE_LINE) u64 head;
+    u64 cachedTail;
+} Ring;
+
+/**
+ * CAPACITY is rounded up to the next power of two. Returns false if memory ran out, or if CAPACITY is above 2^63.
+ */
+bool ringInit(Ring* ring, u64 capacity);
+void ringDestroy(Ring* ring);
+
+bool ringTryPush(Ring* ring, void* item);
+bool ringTryPop(Ring* ring, void** outItem);
+
+/**
+ * Blocking variants: spin for a while, then back off to sleeping while the ring is full (empty).
+ */
+void ringPush(Ring* ring, void* item);
+void* ringPop(Ring* ring);
+
+#endif /* ! RING_H */
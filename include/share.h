@@ -0,0 +1,31 @@
+#ifndef SHARE_H
+#define SHARE_H
+
+#include "eval-tree.h"
+
+#define SHARE_DEFAULT_BUDGET (16ul << 20)
+
+/**
+ * Subexpression sharing across the statements of a run: the values of the subtrees evaluated are kept in a table,
+ * keyed by a 128-bit hash of their normalized form, where variables are replaced by their current values and the
+ * operands of '+' and '*' are ordered. A subtree equal to one already evaluated, in this line or an earlier one,
+ * with the same values, is not evaluated again: its value is taken from the table.
+ * The table holds at most BUDGET bytes, the least recently used values are evicted first.
+ * Only the thread evaluating the statements uses it.
+ */
+bool initShare(u64 budget);
+/**
+ * Smallest budget initShare accepts: a single bucket of entries.
+ */
+u64 shareMinBudget();
+void shutShare();
+bool isShareEnabled();
+
+/**
+ * Same result and errors as treeEval, TREE having been measured. Values are only stored when no error was signaled.
+ * Subtrees holding solvers or calls are never shared: solvers report notes, and call bodies read variables
+ * which are not leaves of the subtree.
+ */
+double treeEvalShared(EvalNode* tree);
+
+#endif /* ! SHARE_H */
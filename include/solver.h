@@ -0,0 +1,39 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include "eval-tree.h"
+#include "program.h"
+
+#define SOLVER_MAX_ITERATIONS 200
+
+/**
+ * How a solver run went, reported along with the result of the statement it belongs to.
+ */
+typedef struct solver_report {
+    const char* command; // "solve" or "minimize"
+    const char* method;
+    u32 iterations;
+    bool converged;
+    double x;
+    double value; // of the expression at X
+} SolverReport;
+
+/**
+ * solve(expr, x, low, high): a root of EXPR in [LOW, HIGH], where it must change sign.
+ * EXPR is F, also compiled as PROGRAM with the variable in SLOT as its parameter (null if it cannot be compiled).
+ * Uses Newton's method, with derivatives from dual evaluation and kept inside the bracket by bisection,
+ * when F is smooth, and Brent's method otherwise.
+ */
+double solveRoot(EvalNode* f, const Program* program, u32 slot, double low, double high);
+/**
+ * minimize(expr, x, low, high): a local minimum of EXPR in [LOW, HIGH], found with Brent's method.
+ */
+double minimizeFunction(EvalNode* f, const Program* program, u32 slot, double low, double high);
+
+/**
+ * Formats the reports of the solvers run by the calling thread since the last call into a newly
+ * allocated string (to be released with free()), and forgets them. Returns null if there are none.
+ */
+char* formatSolverReports(u64* outLength);
+
+#endif /* ! SOLVER_H */
@@ -0,0 +1,27 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "defines.h"
+
+/**
+ * Runs the INDEX-th task of a parallel loop.
+ */
+typedef void (*taskfn)(void* arg, u64 index);
+
+/**
+ * Starts THREADS - 1 worker threads, the thread calling poolFor being the last one.
+ * 0 uses one thread per online processor. Without a pool, poolFor runs everything on the calling thread.
+ */
+bool initThreadPool(u32 threads);
+void shutThreadPool();
+u32 poolThreadCount();
+
+/**
+ * Runs TASK(ARG, i) for every i in [0, COUNT), spread over the pool and the calling thread,
+ * and returns once all of them are done. Tasks are handed out in increasing order, one at a time.
+ * Tasks must not call poolFor themselves. Workers have their own error lists: tasks signaling errors
+ * must hand them over with takeErrors.
+ */
+void poolFor(u64 count, taskfn task, void* arg);
+
+#endif /* ! THREAD_POOL_H */
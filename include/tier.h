@@ -0,0 +1,55 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include "interpreter.h"
+#include "token.h"
+
+#include <stdio.h>
+
+#define TIER_DEFAULT_THRESHOLD 16
+
+/**
+ * Tiered execution of the statements of a run. Every statement is counted, keyed by its shape: its tokens, numbers
+ * aside. 'x*2+1' and 'x * 3 + 0.5' have the same shape. Statements are walked by the interpreter until their shape
+ * has run THRESHOLD times, their tree is then compiled to a program on a background thread. Once the program is
+ * ready, statements of that shape are neither parsed nor walked anymore: the program runs instead, their numbers
+ * taking the place of the constants it was compiled with, see tierRun.
+ * Statements calling user functions are not counted, their meaning changes when the functions are defined again.
+ * Those holding solvers or matrices are counted, but cannot be compiled.
+ * Only the thread evaluating the statements uses it, besides the compiler thread.
+ */
+bool initTier(u32 threshold);
+void shutTier();
+bool isTierEnabled();
+
+typedef struct tier_entry TierEntry;
+
+/**
+ * Counts one more run of the shape of the statement [BEGIN, END) of TOKENS, and returns its entry. Null if the
+ * statement is not counted: tiering is disabled, it calls user functions, or too many shapes are counted already.
+ * Programs compiled since the last call are picked up.
+ */
+TierEntry* tierCount(const TokenStream* tokens, u64 begin, u64 end);
+/**
+ * Whether the statement of ENTRY is compiled: it is to be run by tierRun, without being parsed.
+ */
+bool tierIsHot(const TierEntry* entry);
+/**
+ * Hands ROOT, the tree of the statement of ENTRY starting at token BEGIN and assigning TARGET (or NO_TARGET),
+ * which was just evaluated without errors, to the compiler thread if the shape ran often enough.
+ * Returns whether ROOT was taken: the compiler thread destroys it.
+ */
+bool tierPromote(TierEntry* entry, EvalNode* root, u32 target, u64 begin);
+/**
+ * Runs the program of ENTRY, hot, for the statement of TOKENS starting at BEGIN, into RESULT, and assigns its target.
+ * Returns false, leaving RESULT and the variables unchanged, if the statement must be walked instead: it reads
+ * matrices, or fails, only the interpreter reporting where.
+ */
+bool tierRun(TierEntry* entry, const TokenStream* tokens, u64 begin, StatementResult* result);
+
+/**
+ * Prints the number of shapes counted and compiled, and of the runs of each tier.
+ */
+void tierPrintStats(FILE* stream);
+
+#endif /* ! TIER_H */
@@ -2,11 +2,14 @@
 #include "darray.h"
 #include "function.h"
 
+#include <stdio.h>
+
 typedef enum {
     OPERATOR = 0,
     NUMBER,
+    NAME,
 
-    LPAREN, RPAREN, SEMI,
+    LPAREN, RPAREN, SEMI, COMMA, QUESTION, COLON, LBRACKET, RBRACKET,
 
     _IDENTIFIER_SIZE
 } Identifier;
@@ -14,35 +17,123 @@ typedef enum {
 typedef struct {
     i8 priority;
     bool rightAssociative;
+    // Prefix operators take one operand, on their right ('-x', '!x'). Infix operators take two.
+    bool prefix;
 } Operator;
 
+/**
+ * Describes an operator once. Tokens only refer to it by its index in the operator table.
+ */
 typedef struct {
-    Identifier identifier;
-    char* symbol;
-    union data {
-        double number;
-        Operator operator;
-    } value;
+    const char* symbol;
+    Operator operator;
     Function function;
-
-    //Metadata for error reporting
-    u64 position;
-} Token;
+} OperatorDesc;
 
 enum OperatorType {
     OPERATOR_ADD,
     OPERATOR_SUBTRACT,
     OPERATOR_MULTIPLY,
     OPERATOR_DIVIDE,
+    OPERATOR_EQUAL,
+    OPERATOR_NOT_EQUAL,
+    OPERATOR_LESS,
+    OPERATOR_LESS_EQUAL,
+    OPERATOR_GREATER,
+    OPERATOR_GREATER_EQUAL,
+    OPERATOR_AND,
+    OPERATOR_OR,
+    OPERATOR_NOT,
+    OPERATOR_ASSIGN,
+    OPERATOR_NEGATE,
+    OPERATOR_POWER,
+    // Operators registered at run time come after the predefined ones.
     _OPERATOR_SIZE
 };
 
+#define MAX_OPERATORS 64
+#define OPERATOR_MAX_LENGTH 8
+#define NO_OPERATOR ((u32)-1)
+
+// Priority of the ternary conditional 'c ? a : b', lower than any operator.
+#define TERNARY_PRIORITY 1
+
+/**
+ * Tokens in structure-of-arrays layout, 13 bytes per token. Token i is described by:
+ *  - kinds[i]    (u8)  : its Identifier,
+ *  - offsets[i]  (u32) : the position of its first character in the source,
+ *  - lengths[i]  (u32) : its number of characters in the source,
+ *  - payloads[i] (u32) : an index into LITERALS for NUMBER tokens, into the operator table for OPERATOR tokens,
+ *                        into the builtin table for NAME tokens (NO_BUILTIN if the name is not a builtin).
+ * The symbol of a token is never copied, it is read back from the source when needed.
+ */
+typedef struct token_stream {
+    const char* source;
+    darray kinds;    // u8
+    darray offsets;  // u32
+    darray lengths;  // u32
+    darray payloads; // u32
+    darray literals; // Number
+} TokenStream;
+
+void tokenStreamInit(TokenStream* stream, const char* source);
+void tokenStreamDestroy(TokenStream* stream);
+/**
+ * Forgets all tokens but keeps the buffers, so the stream can be reused for SOURCE.
+ */
+void tokenStreamReset(TokenStream* stream, const char* source);
+
+bool tokenStreamPush(TokenStream* stream, Identifier kind, u32 offset, u32 length, u32 payload);
+bool tokenStreamAddLiteral(TokenStream* stream, Number value, u32* outIndex);
+
+u64 tokenCount(const TokenStream* stream);
+Identifier tokenKind(const TokenStream* stream, u64 index);
+u32 tokenOffset(const TokenStream* stream, u64 index);
+u32 tokenLength(const TokenStream* stream, u64 index);
+u32 tokenPayload(const TokenStream* stream, u64 index);
+double tokenNumber(const TokenStream* stream, u64 index);
+Number tokenLiteral(const TokenStream* stream, u64 index);
+const OperatorDesc* tokenOperator(const TokenStream* stream, u64 index);
+
 const char* getSymbol(Identifier identifier);
 Identifier getIdentifier(const char* symbol);
-bool initToken(Token* tok, Identifier identifier, char* symbol, u64 position);
+/**
+ * Identifier of the single character token C (parentheses, ';'...), or _IDENTIFIER_SIZE.
+ */
+Identifier identifierFromChar(char c);
 bool isGeneric(Identifier identifier);
 
-bool operatorFromSymbol(const char *str, Token* newToken);
+const OperatorDesc* getOperator(u32 index);
+/**
+ * Looks up the prefix (if PREFIX) or infix operator named by the LENGTH first characters of STR.
+ */
+bool operatorFromSymbol(const char *str, u64 length, bool prefix, u32* outIndex);
+/**
+ * Finds the longest operator symbol starting STR, reading at most LENGTH characters, among the prefix
+ * operators if PREFIX, among the infix ones otherwise. Returns its length, 0 if there is none.
+ */
+u64 operatorMatch(const char* str, u64 length, bool prefix, u32* outIndex);
+/**
+ * Adds an operator. Its symbol is made of at most OPERATOR_MAX_LENGTH characters which cannot start
+ * any other token (no letters, digits, spaces, parentheses...). Returns false if the symbol is invalid
+ * or already names an operator of the same kind, or if there are MAX_OPERATORS operators already.
+ */
+bool registerOperator(const char* symbol, u64 length, Operator op, Function function);
+/**
+ * Registers the operators described by the file at PATH, one per line:
+ *     symbol priority left|right prefix|infix implementation
+ * e.g. '^ 9 right infix pow'. The implementation is a builtin function, or the symbol of an operator
+ * of the same kind ('<> 4 left infix !='). Priorities go from 2 to 100, the predefined operators use
+ * 2 ('||') to 9 ('**'). Empty lines and lines starting with '#' are ignored.
+ * Errors are reported to ERRSTREAM with their line number, and stop the loading.
+ */
+bool loadOperators(const char* path, FILE* errStream);
+/**
+ * Hash of the operator table: symbol, priority, associativity, kind and implementation of every operator.
+ * The same from one run to the other as long as the same operators are registered. Keys compiled lines,
+ * which are parsed according to it.
+ */
+u64 hashOperators();
 void initOperators();
 
 void shutTokens();
@@ -1,8 +1,103 @@
 #ifndef VAR_HANDLER_H
 #define VAR_HANDLER_H
 
+#include "function.h"
+
+#define MAX_VARIABLES 256
+
+struct matrix;
+struct big;
+
+/**
+ * Variables, declared by assignment statements ('x = 2 * 3') and referenced by name in later expressions.
+ * Each variable has a slot, its index in declaration order, which never changes.
+ * Names are never moved nor freed before shutVariables, so other threads may read the name of any slot
+ * they have been handed.
+ */
 typedef struct varctx_t {
-    
+    char* names[MAX_VARIABLES];
+    double values[MAX_VARIABLES];
+    // Exact values of the variables holding integers, see Number.
+    i64 integers[MAX_VARIABLES];
+    bool exact[MAX_VARIABLES];
+    // Imaginary parts, in complex mode. Setting a number clears them.
+    double imaginary[MAX_VARIABLES];
+    // Matrix held by the variable, null if it holds a number. Its value is then NaN.
+    struct matrix* matrices[MAX_VARIABLES];
+    // Value of the variable in arbitrary precision mode, null if it only has its number. Setting a number clears it.
+    struct big* bigs[MAX_VARIABLES];
+    // Incremented whenever a matrix or an arbitrary precision value is assigned to the variable.
+    u64 generations[MAX_VARIABLES];
+    u32 count;
 } VarCtx;
 
+void initVariables();
+void shutVariables();
+
+/**
+ * Finds the variable named by the LENGTH first characters of NAME.
+ */
+bool varFind(const char* name, u64 length, u32* outSlot);
+/**
+ * Finds the variable, or declares it (with a value of 0) if it does not exist yet.
+ * Returns false if there is no slot left, or the name could not be copied.
+ */
+bool varDeclare(const char* name, u64 length, u32* outSlot);
+
+u32 varCount();
+const char* varName(u32 slot);
+double varGet(u32 slot);
+void varSet(u32 slot, double value);
+Number varGetNumber(u32 slot);
+/**
+ * Sets the variable to VALUE, keeping its exact integer value if it has one. varSet makes it inexact.
+ */
+void varSetNumber(u32 slot, Number value);
+double varGetImaginary(u32 slot);
+/**
+ * Sets the imaginary part of the variable, whose number must be set first.
+ */
+void varSetImaginary(u32 slot, double imaginary);
+struct matrix* varMatrix(u32 slot);
+/**
+ * Makes the variable hold MATRIX, which it now owns.
+ */
+void varSetMatrix(u32 slot, struct matrix* matrix);
+const struct big* varBig(u32 slot);
+/**
+ * Makes the variable hold VALUE, which it now owns, and its number VALUE rounded to a double.
+ */
+void varSetBig(u32 slot, struct big* value);
+u64 varGeneration(u32 slot);
+
+typedef struct var_value {
+    Number number;
+    double imaginary;
+    struct matrix* matrix;
+    struct big* big;
+} VarValue;
+
+/**
+ * Copy of the values of the COUNT variables declared at some point, matrices and arbitrary precision values included.
+ */
+typedef struct var_snapshot {
+    VarValue* values;
+    u32 count;
+} VarSnapshot;
+
+/**
+ * Copies the values of all variables into OUT. Returns false if memory ran out (ERR_ALLOC_FAIL is signaled).
+ */
+bool varSnapshot(VarSnapshot* out);
+void varSnapshotDestroy(VarSnapshot* snapshot);
+/**
+ * Whether the variable in SLOT has the same value in A and B, compared bitwise: a NaN which stays NaN did not change.
+ * Variables declared after a snapshot was taken hold 0 in it, as when they were declared.
+ */
+bool varSnapshotSame(const VarSnapshot* a, const VarSnapshot* b, u32 slot);
+/**
+ * Sets the variable in SLOT to its value in SNAPSHOT. Returns false if memory ran out (ERR_ALLOC_FAIL is signaled).
+ */
+bool varRestore(const VarSnapshot* snapshot, u32 slot);
+
 #endif /* ! VAR_HANDLER_H */
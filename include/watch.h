@@ -0,0 +1,24 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "defines.h"
+
+#include <stdio.h>
+
+/**
+ * Watch mode: evaluates the lines of the file at PATH, in order, then waits for the file to be
+ * saved again (inotify) and only re-evaluates the lines affected by the change. The results are
+ * those of evaluating the whole new version from scratch:
+ *  - the variables are set back to their values after the last line unchanged at the start of the file,
+ *  - lines whose text changed, found by comparing the line hashes of both versions, are evaluated,
+ *  - so are the lines after them which name a variable whose value before them changed, and the lines
+ *    which failed or use user functions, if any variable changed: they may have been missing one.
+ * Other lines keep their compiled statements and are not evaluated, their variables get the values they
+ * assigned last time. The results of the re-evaluated lines are written to OUT, preceded by their line
+ * number, errors to ERRSTREAM.
+ * Variables are never undeclared: those only assigned by removed lines hold 0 again.
+ * Only returns if the file cannot be watched.
+ */
+bool watchRun(const char* path, FILE* out, FILE* errStream);
+
+#endif /* ! WATCH_H */
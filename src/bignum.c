@@ -0,0 +1,855 @@
+#include "bignum.h"
+#include "darray.h"
+#include "error.h"
+#include "memory.h"
+#include "var-handler.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BASE 1000000000u
+#define LIMB_DIGITS 9
+// Limbs kept beyond the precision, so that truncations do not show once results are rounded.
+#define GUARD_LIMBS 2
+// Below, schoolbook multiplication does fewer operations.
+#define KARATSUBA_MIN_LIMBS 32
+#define ARENA_CHUNK_LIMBS (1u << 16)
+// Values whose exponent goes past this many limbs are out of range: their limbs could not even be aligned.
+#define MAX_EXPONENT (1l << 40)
+// Precision of products which are not truncated.
+#define EXACT ((u32)-1)
+
+static const u32 POWERS_OF_10[LIMB_DIGITS] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+static u32 oneLimb = 1;
+static u32 halfLimb = BASE / 2;
+static const Big ZERO = {null, 0, false, 0};
+static const Big ONE = {&oneLimb, 1, false, 0};
+static const Big HALF = {&halfLimb, 1, false, -1};
+
+// Precision of the statement being evaluated, in limbs.
+static u32 precision = 0;
+static u32 callDepth = 0;
+
+/* ----- Arena ----- */
+
+typedef struct chunk {
+    u32* limbs;
+    u64 capacity;
+    u64 used;
+} Chunk;
+
+typedef struct arena_mark {
+    u64 chunk;
+    u64 used;
+} ArenaMark;
+
+// Chunk, in order of use. Those past the current one are empty.
+static darray chunks = {0, sizeof(Chunk), 0, null, MEM_BIG};
+static u64 current = 0;
+
+// Signals ERR_ALLOC_FAIL and returns null if memory ran out. Chunks never move, nor grow.
+static u32* arenaAlloc(u64 count) {
+    for (u64 i = current; i < chunks.length; i++) {
+        Chunk* chunk = (Chunk*)chunks.a + i;
+        if (chunk->capacity - chunk->used >= count) {
+            current = i;
+            chunk->used += count;
+            return chunk->limbs + chunk->used - count;
+        }
+    }
+    u64 capacity = count > ARENA_CHUNK_LIMBS ? count : ARENA_CHUNK_LIMBS;
+    Chunk chunk = {memAlloc(MEM_BIG, capacity * sizeof(u32)), capacity, count};
+    if (chunk.limbs == null)
+        return null;
+    if (!darrayAdd(&chunks, chunk)) {
+        memFree(chunk.limbs);
+        return null;
+    }
+    current = chunks.length - 1;
+    return chunk.limbs;
+}
+
+static ArenaMark arenaMark() {
+    if (chunks.length == 0)
+        return (ArenaMark){0, 0};
+    return (ArenaMark){current, ((Chunk*)chunks.a)[current].used};
+}
+
+static void arenaRelease(ArenaMark mark) {
+    for (u64 i = mark.chunk; i <= current && i < chunks.length; i++) {
+        ((Chunk*)chunks.a)[i].used = i == mark.chunk ? mark.used : 0;
+    }
+    current = mark.chunk;
+}
+
+// Releases what was allocated since MARK, but VALUE, whose limbs are moved there. They come from after MARK, or
+// from outside the arena: allocating from MARK again never overwrites them before they are moved.
+static Big keep(ArenaMark mark, Big value) {
+    arenaRelease(mark);
+    if (value.length == 0)
+        return value;
+    u32* limbs = arenaAlloc(value.length);
+    if (limbs == null)
+        return ZERO;
+    memmove(limbs, value.limbs, value.length * sizeof(u32));
+    value.limbs = limbs;
+    return value;
+}
+
+void shutBig() {
+    for (u64 i = 0; i < chunks.length; i++) {
+        memFree(((Chunk*)chunks.a)[i].limbs);
+    }
+    darrayEmpty(&chunks);
+    current = 0;
+}
+
+/* ----- Magnitudes: arrays of limbs, least significant first ----- */
+
+// OUT[0, LENGTH) += IN[0, COUNT). The sum must fit in LENGTH limbs.
+static void magnitudeAdd(u32* out, u64 length, const u32* in, u64 count) {
+    while (count > 0 && in[count - 1] == 0)
+        count--;
+    u32 carry = 0;
+    u64 i = 0;
+    for (; i < count; i++) {
+        u32 sum = out[i] + in[i] + carry;
+        carry = sum >= BASE;
+        out[i] = carry ? sum - BASE : sum;
+    }
+    for (; carry && i < length; i++) {
+        carry = out[i] == BASE - 1;
+        out[i] = carry ? 0 : out[i] + 1;
+    }
+}
+
+// OUT[0, LENGTH) -= IN[0, COUNT). OUT must not be less than IN.
+static void magnitudeSubtract(u32* out, u64 length, const u32* in, u64 count) {
+    while (count > 0 && in[count - 1] == 0)
+        count--;
+    u32 borrow = 0;
+    u64 i = 0;
+    for (; i < count; i++) {
+        u32 subtracted = in[i] + borrow;
+        borrow = out[i] < subtracted;
+        out[i] = borrow ? out[i] + BASE - subtracted : out[i] - subtracted;
+    }
+    for (; borrow && i < length; i++) {
+        borrow = out[i] == 0;
+        out[i] = borrow ? BASE - 1 : out[i] - 1;
+    }
+}
+
+static void schoolbookMultiply(const u32* a, u64 la, const u32* b, u64 lb, u32* out) {
+    memset(out, 0, (la + lb) * sizeof(u32));
+    for (u64 i = 0; i < la; i++) {
+        u64 carry = 0;
+        for (u64 j = 0; j < lb; j++) {
+            u64 t = (u64)a[i] * b[j] + out[i + j] + carry;
+            out[i + j] = t % BASE;
+            carry = t / BASE;
+        }
+        out[i + lb] = carry;
+    }
+}
+
+// OUT[0, LA + LB) = A B. Karatsuba: with A = A1 BASE^h + A0 and B = B1 BASE^h + B0, the middle term
+// A1 B0 + A0 B1 is (A0 + A1)(B0 + B1) - A0 B0 - A1 B1, three products of half the size instead of four.
+static void magnitudeMultiply(const u32* a, u64 la, const u32* b, u64 lb, u32* out) {
+    if (la < lb) {
+        magnitudeMultiply(b, lb, a, la, out);
+        return;
+    }
+    if (lb < KARATSUBA_MIN_LIMBS) {
+        schoolbookMultiply(a, la, b, lb, out);
+        return;
+    }
+    ArenaMark mark = arenaMark();
+    if (la >= 2 * lb) {
+        // Slices of A as long as B, whose products are balanced.
+        memset(out, 0, (la + lb) * sizeof(u32));
+        u32* part = arenaAlloc(2 * lb);
+        for (u64 i = 0; part != null && i < la; i += lb) {
+            u64 n = la - i < lb ? la - i : lb;
+            magnitudeMultiply(a + i, n, b, lb, part);
+            magnitudeAdd(out + i, la + lb - i, part, n + lb);
+        }
+        arenaRelease(mark);
+        return;
+    }
+    // LA < 2 LB, so that B1 is not empty.
+    u64 h = la / 2;
+    magnitudeMultiply(a, h, b, h, out);
+    magnitudeMultiply(a + h, la - h, b + h, lb - h, out + 2 * h);
+    u64 lsa = la - h + 1;
+    u64 lsb = (h > lb - h ? h : lb - h) + 1;
+    u32* sa = arenaAlloc(lsa);
+    u32* sb = arenaAlloc(lsb);
+    u32* middle = arenaAlloc(lsa + lsb);
+    if (sa == null || sb == null || middle == null) {
+        arenaRelease(mark);
+        return;
+    }
+    memset(sa, 0, lsa * sizeof(u32));
+    memcpy(sa, a + h, (la - h) * sizeof(u32));
+    magnitudeAdd(sa, lsa, a, h);
+    memset(sb, 0, lsb * sizeof(u32));
+    if (h > lb - h) {
+        memcpy(sb, b, h * sizeof(u32));
+        magnitudeAdd(sb, lsb, b + h, lb - h);
+    } else {
+        memcpy(sb, b + h, (lb - h) * sizeof(u32));
+        magnitudeAdd(sb, lsb, b, h);
+    }
+    magnitudeMultiply(sa, lsa, sb, lsb, middle);
+    magnitudeSubtract(middle, lsa + lsb, out, 2 * h);
+    magnitudeSubtract(middle, lsa + lsb, out + 2 * h, la + lb - 2 * h);
+    magnitudeAdd(out + h, la + lb - h, middle, lsa + lsb);
+    arenaRelease(mark);
+}
+
+/* ----- Numbers ----- */
+
+static Big normalize(Big value) {
+    while (value.length > 0 && value.limbs[value.length - 1] == 0)
+        value.length--;
+    while (value.length > 0 && value.limbs[0] == 0) {
+        value.limbs++;
+        value.length--;
+        value.exponent++;
+    }
+    return value.length == 0 ? ZERO : value;
+}
+
+static Big checked(Big value) {
+    if (value.length > 0 && (value.exponent + value.length > MAX_EXPONENT || value.exponent < -MAX_EXPONENT)) {
+        signalErrorNoToken(ERR_BIG_RESULT, null, -1);
+        return ZERO;
+    }
+    return value;
+}
+
+// VALUE without its limbs below the position LOW, truncated toward zero.
+static Big dropBelow(Big value, i64 low) {
+    if (value.exponent >= low)
+        return value;
+    if (value.exponent + value.length <= low)
+        return ZERO;
+    u64 drop = low - value.exponent;
+    value.limbs += drop;
+    value.length -= drop;
+    value.exponent = low;
+    return normalize(value);
+}
+
+// VALUE truncated to its COUNT most significant limbs.
+static Big truncated(Big value, u32 count) {
+    return value.length <= count ? value : dropBelow(value, value.exponent + value.length - count);
+}
+
+static Big negate(Big value) {
+    value.negative = value.length > 0 && !value.negative;
+    return value;
+}
+
+static int compareMagnitudes(Big a, Big b) {
+    if (a.length == 0 || b.length == 0)
+        return (a.length != 0) - (b.length != 0);
+    i64 top = a.exponent + a.length;
+    if (top != b.exponent + b.length)
+        return top < b.exponent + b.length ? -1 : 1;
+    for (i64 position = top - 1;; position--) {
+        // The lowest limb is never 0: the value with limbs left is the largest.
+        if (position < a.exponent || position < b.exponent)
+            return (position >= a.exponent) - (position >= b.exponent);
+        u32 x = a.limbs[position - a.exponent];
+        u32 y = b.limbs[position - b.exponent];
+        if (x != y)
+            return x < y ? -1 : 1;
+    }
+}
+
+static int compare(Big a, Big b) {
+    int signA = a.length == 0 ? 0 : a.negative ? -1 : 1;
+    int signB = b.length == 0 ? 0 : b.negative ? -1 : 1;
+    if (signA != signB)
+        return signA < signB ? -1 : 1;
+    return signA < 0 ? -compareMagnitudes(a, b) : compareMagnitudes(a, b);
+}
+
+static Big add(Big a, Big b, u32 limbs) {
+    i64 top = a.exponent + a.length > b.exponent + b.length ? a.exponent + a.length : b.exponent + b.length;
+    // Limbs further than LIMBS below the top cannot show in the sum.
+    a = dropBelow(a, top - limbs - 1);
+    b = dropBelow(b, top - limbs - 1);
+    if (a.length == 0 || b.length == 0)
+        return truncated(a.length == 0 ? b : a, limbs);
+    i64 low = a.exponent < b.exponent ? a.exponent : b.exponent;
+    u64 length = top - low + 1;
+    u32* sum = arenaAlloc(length);
+    if (sum == null)
+        return ZERO;
+    Big larger = a;
+    Big smaller = b;
+    if (a.negative != b.negative && compareMagnitudes(a, b) < 0) {
+        larger = b;
+        smaller = a;
+    }
+    memset(sum, 0, length * sizeof(u32));
+    memcpy(sum + (larger.exponent - low), larger.limbs, larger.length * sizeof(u32));
+    u64 offset = smaller.exponent - low;
+    if (a.negative == b.negative)
+        magnitudeAdd(sum + offset, length - offset, smaller.limbs, smaller.length);
+    else
+        magnitudeSubtract(sum + offset, length - offset, smaller.limbs, smaller.length);
+    return checked(truncated(normalize((Big){sum, length, larger.negative, low}), limbs));
+}
+
+static Big multiply(Big a, Big b, u32 limbs) {
+    if (a.length == 0 || b.length == 0)
+        return ZERO;
+    a = truncated(a, limbs);
+    b = truncated(b, limbs);
+    u32* product = arenaAlloc((u64)a.length + b.length);
+    if (product == null)
+        return ZERO;
+    magnitudeMultiply(a.limbs, a.length, b.limbs, b.length, product);
+    Big value = {product, a.length + b.length, a.negative != b.negative, a.exponent + b.exponent};
+    return checked(truncated(normalize(value), limbs));
+}
+
+// VALUE rounded to its COUNT most significant limbs, half away from zero.
+static Big rounded(Big value, u32 count) {
+    if (value.length <= count)
+        return value;
+    bool up = value.limbs[value.length - count - 1] >= BASE / 2;
+    Big unit = {&oneLimb, 1, value.negative, value.exponent + value.length - count};
+    value = truncated(value, count);
+    return up ? add(value, unit, count + 1) : value;
+}
+
+// The three most significant limbs of VALUE, as a double in [1, BASE).
+static double leading(Big value) {
+    double lead = 0;
+    double scale = 1;
+    for (u32 i = 0; i < 3 && i < value.length; i++) {
+        lead += value.limbs[value.length - 1 - i] * scale;
+        scale /= BASE;
+    }
+    return lead;
+}
+
+// X BASE^EXPONENT, X being in (1 / BASE, 1].
+static Big fromEstimate(double x, i64 exponent, bool negative) {
+    u64 scaled = x * ((double)BASE * BASE);
+    u32* limbs = arenaAlloc(3);
+    if (limbs == null)
+        return ZERO;
+    limbs[0] = scaled % BASE;
+    limbs[1] = scaled / BASE % BASE;
+    limbs[2] = scaled / BASE / BASE;
+    return normalize((Big){limbs, 3, negative, exponent - 2});
+}
+
+/*
+ * Newton's iterations double the digits right at each step, from the 15 digits of a double estimate.
+ * Each step works with a few more limbs than it can get right, up to LIMBS for the last one.
+ */
+
+// Limbs of the next step, after one getting DIGITS right.
+static u32 nextStep(u64 digits, u32 limbs) {
+    u64 next = (2 * digits + LIMB_DIGITS - 1) / LIMB_DIGITS + 1;
+    return next < limbs ? next : limbs;
+}
+
+// 1 / VALUE to LIMBS, by x' = x + x (1 - value x).
+static Big reciprocal(Big value, u32 limbs) {
+    i64 top = value.exponent + value.length;
+    Big x = fromEstimate(1 / leading(value), 1 - top, value.negative);
+    u64 digits = 15;
+    u32 step;
+    do {
+        step = nextStep(digits, limbs);
+        Big error = add(ONE, negate(multiply(value, x, step)), step);
+        x = add(x, multiply(x, error, step), step);
+        digits = (2 * digits < LIMB_DIGITS * (step - 1) ? 2 * digits : LIMB_DIGITS * (step - 1)) - 2;
+    } while (step < limbs && getErrorCount() == 0);
+    return x;
+}
+
+// Quotients and roots which fit in the precision are exact: ESTIMATE, rounded a limb short of it, is checked
+// against VALUE by an exact product with FACTOR, or with itself if FACTOR is null.
+static Big exactOr(Big estimate, Big value, const Big* factor, u32 limbs) {
+    Big candidate = rounded(estimate, limbs - 1);
+    if (compare(multiply(candidate, factor != null ? *factor : candidate, EXACT), value) == 0)
+        return candidate;
+    return truncated(estimate, limbs);
+}
+
+static Big divide(Big a, Big b, u32 limbs) {
+    if (b.length == 0) {
+        signalErrorNoToken(ERR_DIV_BY_ZERO, null, -1);
+        return ZERO;
+    }
+    if (a.length == 0)
+        return ZERO;
+    Big quotient = multiply(a, reciprocal(b, limbs + 1), limbs + 1);
+    return exactOr(quotient, a, &b, limbs);
+}
+
+// sqrt(value) = value y, the inverse square root y following y' = y + y (1 - value y^2) / 2.
+static Big squareRoot(Big value, u32 limbs) {
+    if (value.length == 0)
+        return ZERO;
+    if (value.negative) {
+        signalErrorNoToken(ERR_BIG_RESULT, null, -1);
+        return ZERO;
+    }
+    // VALUE = lead BASE^power, with an even power.
+    i64 power = value.exponent + value.length - 1;
+    double lead = leading(value);
+    if (power % 2 != 0) {
+        lead *= BASE;
+        power--;
+    }
+    Big y = fromEstimate(1 / sqrt(lead), -power / 2, false);
+    u64 digits = 15;
+    u32 step;
+    do {
+        step = nextStep(digits, limbs + 1);
+        Big error = add(ONE, negate(multiply(value, multiply(y, y, step), step)), step);
+        y = add(y, multiply(y, multiply(error, HALF, step), step), step);
+        digits = (2 * digits < LIMB_DIGITS * (step - 1) ? 2 * digits : LIMB_DIGITS * (step - 1)) - 2;
+    } while (step < limbs + 1 && getErrorCount() == 0);
+    return exactOr(multiply(value, y, limbs + 1), value, null, limbs);
+}
+
+// VALUE^EXPONENT by squaring, for integer exponents.
+static Big power(Big value, Big exponent, u32 limbs) {
+    i64 n;
+    if (!bigToInteger(&exponent, &n)) {
+        signalErrorNoToken(ERR_BIG_FUNCTION, null, -1);
+        return ZERO;
+    }
+    if (value.length == 0 && n < 0) {
+        signalErrorNoToken(ERR_DIV_BY_ZERO, null, -1);
+        return ZERO;
+    }
+    Big result = ONE;
+    for (u64 m = n < 0 ? -(u64)n : (u64)n; m > 0 && getErrorCount() == 0; m >>= 1) {
+        if (m & 1)
+            result = multiply(result, value, limbs + 1);
+        if (m > 1)
+            value = multiply(value, value, limbs + 1);
+    }
+    return n < 0 ? divide(ONE, result, limbs) : truncated(result, limbs);
+}
+
+static Big truth(bool value) {
+    return value ? ONE : ZERO;
+}
+
+/* ----- Conversions ----- */
+
+static Big fromInteger(i64 value) {
+    u64 magnitude = value < 0 ? -(u64)value : (u64)value;
+    u32* limbs = arenaAlloc(3);
+    if (limbs == null)
+        return ZERO;
+    for (u32 i = 0; i < 3; i++) {
+        limbs[i] = magnitude % BASE;
+        magnitude /= BASE;
+    }
+    return normalize((Big){limbs, 3, value < 0, 0});
+}
+
+// Digits and dots, then an optional exponent. The value is DIGITS 10^exponent = DIGITS 10^shift BASE^q.
+static Big parse(const char* str, u64 length) {
+    u64 mantissa = 0;
+    while (mantissa < length && str[mantissa] != 'e' && str[mantissa] != 'E')
+        mantissa++;
+    i64 exponent = 0;
+    if (mantissa + 1 < length) {
+        u64 i = mantissa + 1;
+        bool negative = str[i] == '-';
+        if (str[i] == '-' || str[i] == '+')
+            i++;
+        // Exponents past the range only need to stay past it.
+        for (; i < length && exponent < LIMB_DIGITS * MAX_EXPONENT; i++) {
+            exponent = exponent * 10 + (str[i] - '0');
+        }
+        exponent = negative ? -exponent : exponent;
+    }
+    u64 digits = 0;
+    bool point = false;
+    for (u64 i = 0; i < mantissa; i++) {
+        if (str[i] == '.') {
+            point = true;
+        } else {
+            digits++;
+            exponent -= point;
+        }
+    }
+    i64 q = exponent >= 0 ? exponent / LIMB_DIGITS : -((-exponent + LIMB_DIGITS - 1) / LIMB_DIGITS);
+    u64 shift = exponent - q * LIMB_DIGITS;
+    u64 count = (digits + shift + LIMB_DIGITS - 1) / LIMB_DIGITS;
+    u32* limbs = count > 0 ? arenaAlloc(count) : null;
+    if (limbs == null)
+        return ZERO;
+    memset(limbs, 0, count * sizeof(u32));
+    u64 position = shift;
+    for (u64 i = mantissa; i-- > 0;) {
+        if (str[i] == '.')
+            continue;
+        limbs[position / LIMB_DIGITS] += (str[i] - '0') * POWERS_OF_10[position % LIMB_DIGITS];
+        position++;
+    }
+    return checked(normalize((Big){limbs, count, false, q}));
+}
+
+static Big fromNumber(Number number) {
+    if (number.exact)
+        return fromInteger(number.integer);
+    if (!isfinite(number.value)) {
+        signalErrorNoToken(ERR_BIG_RESULT, null, -1);
+        return ZERO;
+    }
+    // The shortest decimal form which reads back as the same double.
+    char text[32];
+    int length = 0;
+    for (int digits = 15; digits <= 17; digits++) {
+        length = snprintf(text, sizeof text, "%.*g", digits, number.value);
+        if (strtod(text, null) == number.value)
+            break;
+    }
+    bool negative = text[0] == '-';
+    Big value = parse(text + negative, length - negative);
+    return negative ? negate(value) : value;
+}
+
+Big* bigParse(const char* str, u64 length) {
+    ArenaMark mark = arenaMark();
+    Big value = parse(str, length);
+    Big* copy = bigClone(&value);
+    arenaRelease(mark);
+    return copy;
+}
+
+Big* bigClone(const Big* value) {
+    Big* copy = memAlloc(MEM_BIG, sizeof(Big) + value->length * sizeof(u32));
+    if (copy == null)
+        return null;
+    *copy = *value;
+    copy->limbs = (u32*)(copy + 1);
+    if (value->length > 0)
+        memcpy(copy->limbs, value->limbs, value->length * sizeof(u32));
+    return copy;
+}
+
+double bigToDouble(const Big* value) {
+    if (value->length == 0)
+        return 0;
+    // The three leading limbs hold more digits than a double, strtod rounds them.
+    char text[64];
+    u32 count = value->length < 3 ? value->length : 3;
+    int length = snprintf(text, sizeof text, "%s%u", value->negative ? "-" : "", value->limbs[value->length - 1]);
+    for (u32 i = 1; i < count; i++) {
+        length += snprintf(text + length, sizeof text - length, "%09u", value->limbs[value->length - 1 - i]);
+    }
+    snprintf(text + length, sizeof text - length, "e%ld", LIMB_DIGITS * (value->exponent + value->length - count));
+    return strtod(text, null);
+}
+
+bool bigToInteger(const Big* value, i64* out) {
+    if (value->exponent < 0 || value->exponent + value->length > 3)
+        return false;
+    u64 magnitude = 0;
+    for (i64 position = value->exponent + value->length - 1; position >= 0; position--) {
+        u64 limb = position >= value->exponent ? value->limbs[position - value->exponent] : 0;
+        if (__builtin_mul_overflow(magnitude, BASE, &magnitude) || __builtin_add_overflow(magnitude, limb, &magnitude))
+            return false;
+    }
+    if (magnitude > (u64)INT64_MAX + value->negative)
+        return false;
+    *out = value->negative ? (i64)(0 - magnitude) : (i64)magnitude;
+    return true;
+}
+
+void bigPrint(FILE* stream, const Big* value) {
+    if (value->length == 0) {
+        fputs("0", stream);
+        return;
+    }
+    u64 digits = getBigPrecision();
+    // Only the limbs holding the first DIGITS + 1 digits are needed.
+    u32 count = value->length < digits / LIMB_DIGITS + 2 ? value->length : digits / LIMB_DIGITS + 2;
+    char text[count * LIMB_DIGITS + 1];
+    u64 length = sprintf(text, "%u", value->limbs[value->length - 1]);
+    for (u32 i = 1; i < count; i++) {
+        length += sprintf(text + length, "%09u", value->limbs[value->length - 1 - i]);
+    }
+    // Decimal exponent of the first digit.
+    i64 exponent = (i64)length - 1 + LIMB_DIGITS * (value->exponent + value->length - count);
+    if (length > digits) {
+        bool up = text[digits] >= '5';
+        length = digits;
+        for (u64 i = length; up && i-- > 0;) {
+            up = text[i] == '9';
+            text[i] = up ? '0' : text[i] + 1;
+        }
+        if (up) {
+            text[0] = '1';
+            exponent++;
+        }
+    }
+    while (length > 1 && text[length - 1] == '0')
+        length--;
+    if (value->negative)
+        fputc('-', stream);
+    if (exponent < -4 || exponent >= (i64)digits) {
+        fputc(text[0], stream);
+        if (length > 1) {
+            fputc('.', stream);
+            fwrite(text + 1, 1, length - 1, stream);
+        }
+        fprintf(stream, "e%c%02ld", exponent < 0 ? '-' : '+', labs(exponent));
+    } else if (exponent < 0) {
+        fputs("0.", stream);
+        for (i64 i = -1; i > exponent; i--) {
+            fputc('0', stream);
+        }
+        fwrite(text, 1, length, stream);
+    } else if (exponent >= (i64)length - 1) {
+        fwrite(text, 1, length, stream);
+        for (i64 i = length - 1; i < exponent; i++) {
+            fputc('0', stream);
+        }
+    } else {
+        fwrite(text, 1, exponent + 1, stream);
+        fputc('.', stream);
+        fwrite(text + exponent + 1, 1, length - exponent - 1, stream);
+    }
+}
+
+/* ----- Evaluation ----- */
+
+typedef Big (*bigptr)(const Big* arguments);
+
+static Big bigAdd(const Big* args) {
+    return add(args[0], args[1], precision);
+}
+
+static Big bigSubtract(const Big* args) {
+    return add(args[0], negate(args[1]), precision);
+}
+
+static Big bigMultiply(const Big* args) {
+    return multiply(args[0], args[1], precision);
+}
+
+static Big bigDivide(const Big* args) {
+    return divide(args[0], args[1], precision);
+}
+
+static Big bigNegate(const Big* args) {
+    return negate(args[0]);
+}
+
+static Big bigEqual(const Big* args) {
+    return truth(compare(args[0], args[1]) == 0);
+}
+
+static Big bigNotEqual(const Big* args) {
+    return truth(compare(args[0], args[1]) != 0);
+}
+
+static Big bigLess(const Big* args) {
+    return truth(compare(args[0], args[1]) < 0);
+}
+
+static Big bigLessEqual(const Big* args) {
+    return truth(compare(args[0], args[1]) <= 0);
+}
+
+static Big bigGreater(const Big* args) {
+    return truth(compare(args[0], args[1]) > 0);
+}
+
+static Big bigGreaterEqual(const Big* args) {
+    return truth(compare(args[0], args[1]) >= 0);
+}
+
+static Big bigNot(const Big* args) {
+    return truth(args[0].length == 0);
+}
+
+static Big bigSqrt(const Big* args) {
+    return squareRoot(args[0], precision);
+}
+
+static Big bigAbs(const Big* args) {
+    Big value = args[0];
+    value.negative = false;
+    return value;
+}
+
+static Big bigPow(const Big* args) {
+    return power(args[0], args[1], precision);
+}
+
+static Big bigMin(const Big* args) {
+    return compare(args[0], args[1]) <= 0 ? args[0] : args[1];
+}
+
+static Big bigMax(const Big* args) {
+    return compare(args[0], args[1]) >= 0 ? args[0] : args[1];
+}
+
+static bigptr bigFunction(functionptr function) {
+    static const struct {
+        const Function* function;
+        bigptr version;
+    } table[] = {
+        {&ADD, bigAdd},         {&SUBTRACT, bigSubtract},         {&MULTIPLY, bigMultiply},
+        {&DIVIDE, bigDivide},   {&NEGATE, bigNegate},             {&EQUAL, bigEqual},
+        {&NOT_EQUAL, bigNotEqual}, {&LESS, bigLess},              {&LESS_EQUAL, bigLessEqual},
+        {&GREATER, bigGreater}, {&GREATER_EQUAL, bigGreaterEqual}, {&NOT, bigNot},
+        {&SQRT, bigSqrt},       {&ABS, bigAbs},                   {&POW, bigPow},
+        {&MIN, bigMin},         {&MAX, bigMax},
+    };
+    for (u32 i = 0; i < sizeof table / sizeof *table; i++) {
+        if (table[i].function->ptr == function)
+            return table[i].version;
+    }
+    return null;
+}
+
+static Big evalBig(EvalNode* tree);
+
+// Evaluates TREE, leaving only its value in the arena: the temporaries of the subtree are released.
+static Big evalKept(EvalNode* tree) {
+    ArenaMark mark = arenaMark();
+    return keep(mark, evalBig(tree));
+}
+
+// sum(i, a, b, expr) and prod: the body is walked for every index, the variable holding it as an exact integer.
+static Big evalReductionBig(EvalNode* tree) {
+    Big first = evalKept(treeChild(tree, 1));
+    Big last = evalKept(treeChild(tree, 2));
+    if (getErrorCount() > 0)
+        return ZERO;
+    double low = bigToDouble(&first);
+    double high = bigToDouble(&last);
+    if (!isfinite(low) || !isfinite(high)) {
+        signalErrorNoToken(ERR_INVALID_RANGE, null, -1);
+        return ZERO;
+    }
+    u32 slot = treeChild(tree, 0)->variable;
+    Number saved = varGetNumber(slot);
+    Big* savedBig = varBig(slot) != null ? bigClone(varBig(slot)) : null;
+    bool sum = tree->function == SUM.ptr;
+    ArenaMark mark = arenaMark();
+    Big result = sum ? ZERO : ONE;
+    for (double i = low; i <= high && getErrorCount() == 0; i++) {
+        bool integer = i == trunc(i) && fabs(i) < 0x1p63;
+        varSetNumber(slot, (Number){i, integer ? (i64)i : 0, integer});
+        Big term = evalBig(treeChild(tree, 3));
+        result = keep(mark, sum ? add(result, term, precision) : multiply(result, term, precision));
+    }
+    varSetNumber(slot, saved);
+    if (savedBig != null)
+        varSetBig(slot, savedBig);
+    return result;
+}
+
+// The body is walked with the parameters holding the arguments, then restored.
+static Big evalCallBig(EvalNode* tree) {
+    const UserFunction* function = getUserFunction(tree->variable);
+    if (callDepth == MAX_CALL_DEPTH) {
+        signalErrorNoToken(ERR_CALL_DEPTH, null, -1);
+        return ZERO;
+    }
+    ArenaMark mark = arenaMark();
+    Big* args[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        Big value = evalKept(treeChild(tree, i));
+        args[i] = getErrorCount() == 0 ? bigClone(&value) : null;
+    }
+    if (getErrorCount() > 0) {
+        for (u64 i = 0; i < tree->arity; i++) {
+            memFree(args[i]);
+        }
+        return ZERO;
+    }
+    Number saved[tree->arity];
+    Big* savedBigs[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        u32 slot = function->params[i];
+        saved[i] = varGetNumber(slot);
+        savedBigs[i] = varBig(slot) != null ? bigClone(varBig(slot)) : null;
+        varSetBig(slot, args[i]);
+    }
+    callDepth++;
+    // Kept before the parameters are restored: the value may be one of them.
+    Big result = keep(mark, evalBig(function->body));
+    callDepth--;
+    for (u64 i = 0; i < tree->arity; i++) {
+        varSetNumber(function->params[i], saved[i]);
+        if (savedBigs[i] != null)
+            varSetBig(function->params[i], savedBigs[i]);
+    }
+    return result;
+}
+
+static Big evalBig(EvalNode* tree) {
+    if (getErrorCount() > 0)
+        return ZERO;
+    if (tree->kind == NUMBER)
+        return tree->big != null ? *tree->big : fromNumber(tree->literal);
+    if (tree->kind == LBRACKET) {
+        signalErrorNoToken(ERR_MATRIX_OPERAND, null, -1);
+        return ZERO;
+    }
+    if (tree->kind == NAME && tree->function == null)
+        return varBig(tree->variable) != null ? *varBig(tree->variable) : fromNumber(varGetNumber(tree->variable));
+    if (isReduction(tree->function))
+        return evalReductionBig(tree);
+    if (tree->function == CALL.ptr)
+        return evalCallBig(tree);
+    if (tree->lazy && !isSolver(tree->function)) {
+        // Short-circuiting evaluation: only the operands that decide the result are evaluated.
+        Big first = evalKept(treeChild(tree, 0));
+        if (getErrorCount() > 0)
+            return ZERO;
+        if (tree->function == AND.ptr)
+            return truth(first.length != 0 && evalKept(treeChild(tree, 1)).length != 0);
+        if (tree->function == OR.ptr)
+            return truth(first.length != 0 || evalKept(treeChild(tree, 1)).length != 0);
+        // SELECT
+        return evalBig(treeChild(tree, first.length != 0 ? 1 : 2));
+    }
+    bigptr version = bigFunction(tree->function);
+    if (version == null) {
+        signalErrorNoToken(ERR_BIG_FUNCTION, null, -1);
+        return ZERO;
+    }
+    Big args[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        args[i] = evalKept(treeChild(tree, i));
+        if (getErrorCount() > 0)
+            return ZERO;
+    }
+    return version(args);
+}
+
+Big* treeEvalBig(EvalNode* tree) {
+    precision = (getBigPrecision() + LIMB_DIGITS - 1) / LIMB_DIGITS + GUARD_LIMBS;
+    ArenaMark mark = arenaMark();
+    Big value = evalBig(tree);
+    Big* result = getErrorCount() == 0 ? bigClone(&value) : null;
+    arenaRelease(mark);
+    return result;
+}
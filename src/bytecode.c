@@ -0,0 +1,482 @@
+#include "bytecode.h"
+#include "error.h"
+#include "function.h"
+#include "interpreter.h"
+#include "util.h"
+#include "var-handler.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BYTE_ORDER_MARK 0x0102
+#define PADDED(size) (((size) + 7) & ~(u64)7)
+// Bounds what a module file can make the loader and programRun put on the stack.
+#define MAX_NESTING 64
+#define MAX_STACK_DEPTH 4096
+#define MAX_NAMED_BUILTINS 1024
+#define FNV_PRIME 0x100000001b3ul
+
+void moduleInit(Module* module) {
+    darrayInitIn(&module->statements, 4, sizeof(CompiledStatement), MEM_PROGRAM);
+    darrayInitIn(&module->lineEnds, 4, sizeof(u32), MEM_PROGRAM);
+}
+
+// Destroys the statements from index FIRST on.
+static void truncateStatements(Module* module, u64 first) {
+    CompiledStatement statement;
+    while (darrayLength(&module->statements) > first && darrayPop(&module->statements, &statement)) {
+        programDestroy(statement.program);
+    }
+}
+
+void moduleDestroy(Module* module) {
+    truncateStatements(module, 0);
+    darrayEmpty(&module->statements);
+    darrayEmpty(&module->lineEnds);
+}
+
+u64 moduleLineCount(const Module* module) {
+    return module->lineEnds.length;
+}
+
+bool moduleCompileLine(Module* module, const char* line) {
+    u64 first = darrayLength(&module->statements);
+    TokenStream tokens;
+    tokenStreamInit(&tokens, line);
+    // Definitions must run to exist, and calls refer to them: both are left to the interpreter.
+    // So are complex numbers.
+    bool ok = !isComplexMode() && getBigPrecision() == 0 && tokenize(line, &tokens) && !tokensUseFunctions(&tokens);
+    u64 length = tokenCount(&tokens);
+    for (u64 begin = 0; ok && begin <= length; begin++) {
+        u64 end = statementEnd(&tokens, begin);
+        if (end > begin) {
+            CompiledStatement statement;
+            EvalNode* root = parseStatement(&tokens, begin, end, &statement.target);
+            statement.program = root != null && getErrorCount() == 0 ? programCompile(root, null, 0) : null;
+            if (root != null)
+                treeDestroy(root);
+            ok = statement.program != null && darrayAdd(&module->statements, statement);
+            if (!ok)
+                programDestroy(statement.program);
+        }
+        begin = end;
+    }
+    ok = ok && darrayAdd(&module->lineEnds, (u32)darrayLength(&module->statements));
+    tokenStreamDestroy(&tokens);
+    if (!ok)
+        truncateStatements(module, first);
+    return ok;
+}
+
+bool moduleReadsMatrices(const Module* module, u64 line) {
+    const u32* ends = module->lineEnds.a;
+    const CompiledStatement* statements = module->statements.a;
+    for (u64 i = line == 0 ? 0 : ends[line - 1]; i < ends[line]; i++) {
+        if (programReadsMatrices(statements[i].program))
+            return true;
+    }
+    return false;
+}
+
+bool moduleEvaluateLine(const Module* module, u64 line, darray* results) {
+    const u32* ends = module->lineEnds.a;
+    const CompiledStatement* statements = module->statements.a;
+    bool success = true;
+    for (u64 i = line == 0 ? 0 : ends[line - 1]; i < ends[line]; i++) {
+        StatementResult result = {0, true, null, 0, null, 0, null, 0, false, 0, null, 0, null};
+        LaneRange range = {0, 0, 0, null, null};
+        u8 faults = 0;
+        if (programReadsMatrices(statements[i].program)) {
+            signalErrorNoToken(ERR_MATRIX_OPERAND, null, -1);
+        } else {
+            result.exact = programRunExact(statements[i].program, &result.integer);
+            if (result.exact)
+                result.value = roundToPrecision((double)result.integer);
+            else
+                programRun(statements[i].program, null, &range, 1, &result.value, &faults);
+        }
+        signalFaults(faults);
+        if (getErrorCount() > 0) {
+            // Compiled statements can only fail at run time, these errors have no position in the source.
+            result.ok = false;
+            result.errors = formatErrors("", &result.errorsLength);
+            success = false;
+        } else if (statements[i].target != NO_TARGET) {
+            varSetNumber(statements[i].target, (Number){result.value, result.integer, result.exact});
+        }
+        if (!darrayAdd(results, result)) {
+            free(result.errors);
+            return false;
+        }
+    }
+    return success;
+}
+
+/* ----- Writing ----- */
+
+typedef struct writer {
+    FILE* out;
+    // Index in the variable table of each slot, NO_TARGET for the slots the module does not use.
+    u32 variables[MAX_VARIABLES];
+    u32 slots[MAX_VARIABLES];
+    u32 variableCount;
+} Writer;
+
+// Pads a section of SIZE bytes to a multiple of 8.
+static bool pad(FILE* out, u64 size) {
+    static const u8 zeros[8] = {0};
+    u64 padding = PADDED(size) - size;
+    return fwrite(zeros, 1, padding, out) == padding;
+}
+
+static bool put(FILE* out, const void* data, u64 size) {
+    return fwrite(data, 1, size, out) == size && pad(out, size);
+}
+
+static void useVariable(Writer* w, u32 slot) {
+    if (slot == NO_TARGET || w->variables[slot] != NO_TARGET)
+        return;
+    w->variables[slot] = w->variableCount;
+    w->slots[w->variableCount++] = slot;
+}
+
+static void collectVariables(Writer* w, const Program* program) {
+    const Instruction* code = program->code.a;
+    for (u64 pc = 0; pc < program->code.length; pc++) {
+        if (code[pc].opcode == OP_VARIABLE)
+            useVariable(w, code[pc].operand);
+    }
+    for (u64 i = 0; i < program->subprograms.length; i++) {
+        collectVariables(w, ((Program**)program->subprograms.a)[i]);
+    }
+}
+
+static bool writeNames(FILE* out, const char** names, u32 count) {
+    u32 lengths[count];
+    u64 total = 0;
+    for (u32 i = 0; i < count; i++) {
+        lengths[i] = strlen(names[i]);
+        total += lengths[i];
+    }
+    if (!put(out, lengths, count * sizeof(u32)))
+        return false;
+    for (u32 i = 0; i < count; i++) {
+        if (fwrite(names[i], 1, lengths[i], out) != lengths[i])
+            return false;
+    }
+    return pad(out, total);
+}
+
+static bool writeProgram(Writer* w, const Program* program) {
+    ProgramHeader header = {program->params, program->maxDepth, program->code.length, program->constants.length,
+                            program->subprograms.length, 0};
+    if (!put(w->out, &header, sizeof header))
+        return false;
+    const Number* constants = program->constants.a;
+    for (u64 i = 0; i < program->constants.length; i++) {
+        ModuleConstant constant = {constants[i].value, constants[i].exact ? constants[i].integer : 0,
+                                   constants[i].exact, 0};
+        if (!put(w->out, &constant, sizeof constant))
+            return false;
+    }
+    const Instruction* code = program->code.a;
+    for (u64 pc = 0; pc < program->code.length; pc++) {
+        ModuleInstruction instruction = {code[pc].opcode, code[pc].arity, 0, code[pc].operand};
+        if (code[pc].opcode == OP_VARIABLE)
+            instruction.operand = w->variables[code[pc].operand];
+        else if (code[pc].opcode == OP_CALL && !builtinFromFunction(code[pc].function, &instruction.operand))
+            return false;
+        if (!put(w->out, &instruction, sizeof instruction))
+            return false;
+    }
+    for (u64 i = 0; i < program->subprograms.length; i++) {
+        if (!writeProgram(w, ((Program**)program->subprograms.a)[i]))
+            return false;
+    }
+    return true;
+}
+
+bool moduleWrite(const Module* module, const char* source, u64 sourceLength, FILE* out) {
+    Writer w;
+    w.out = out;
+    w.variableCount = 0;
+    for (u32 i = 0; i < MAX_VARIABLES; i++) {
+        w.variables[i] = NO_TARGET;
+    }
+    const CompiledStatement* statements = module->statements.a;
+    u64 statementCount = module->statements.length;
+    for (u64 i = 0; i < statementCount; i++) {
+        useVariable(&w, statements[i].target);
+        collectVariables(&w, statements[i].program);
+    }
+
+    ModuleHeader header = {MODULE_MAGIC, MODULE_VERSION, BYTE_ORDER_MARK, getPrecision(), {0}, sourceLength,
+                           w.variableCount, getBuiltinCount(), module->lineEnds.length, statementCount, 0,
+                           hashOperators()};
+    const char* names[w.variableCount + header.builtinCount + 1];
+    for (u32 i = 0; i < w.variableCount; i++) {
+        names[i] = varName(w.slots[i]);
+    }
+    for (u32 i = 0; i < header.builtinCount; i++) {
+        names[w.variableCount + i] = getBuiltin(i)->name;
+    }
+    if (!put(out, &header, sizeof header) || !put(out, source, sourceLength) ||
+        !writeNames(out, names, w.variableCount + header.builtinCount) ||
+        !put(out, module->lineEnds.a, module->lineEnds.length * sizeof(u32)))
+        return false;
+    for (u64 i = 0; i < statementCount; i++) {
+        u32 target[2] = {statements[i].target == NO_TARGET ? NO_TARGET : w.variables[statements[i].target], 0};
+        if (!put(out, target, sizeof target) || !writeProgram(&w, statements[i].program))
+            return false;
+    }
+    return true;
+}
+
+/* ----- Loading ----- */
+
+typedef struct reader {
+    const u8* at;
+    const u8* end;
+    u32* variables; // slot of each entry of the variable table
+    u32 variableCount;
+    u32* builtins; // index of each entry of the builtin table, NO_BUILTIN if it does not exist anymore
+    u32 builtinCount;
+} Reader;
+
+// Returns the next SIZE bytes, and skips their padding. Null if the file is too short.
+static const void* take(Reader* r, u64 size) {
+    u64 padded = PADDED(size);
+    if (padded < size || (u64)(r->end - r->at) < padded)
+        return null;
+    const void* data = r->at;
+    r->at += padded;
+    return data;
+}
+
+// Checks the operands of INSTRUCTION and binds them, going from the file's tables to this process'.
+static bool decodeInstruction(const Reader* r, const ProgramHeader* header, ModuleInstruction in, Instruction* out) {
+    out->opcode = in.opcode;
+    out->arity = in.arity;
+    out->operand = in.operand;
+    out->function = null;
+    switch (in.opcode) {
+    case OP_CONST:
+        return in.arity == 0 && in.operand < header->constantCount;
+    case OP_VARIABLE:
+        if (in.arity != 0 || in.operand >= r->variableCount)
+            return false;
+        out->operand = r->variables[in.operand];
+        return true;
+    case OP_PARAM:
+        return in.arity == 0 && in.operand < header->params;
+    case OP_NOT:
+    case OP_NEGATE:
+        return in.arity == 1;
+    case OP_SELECT:
+        return in.arity == 3;
+    case OP_CALL: {
+        if (in.operand >= r->builtinCount || r->builtins[in.operand] == NO_BUILTIN)
+            return false;
+        const Function* function = &getBuiltin(r->builtins[in.operand])->function;
+        out->function = function->ptr;
+        out->operand = 0;
+        // Lazy builtins have opcodes of their own, or cannot be compiled.
+        return !function->lazy && in.arity == function->arity;
+    }
+    case OP_SUM:
+    case OP_PROD:
+        return in.arity == 2 && in.operand < header->subprogramCount;
+    default:
+        return in.opcode <= OP_OR && in.arity == 2;
+    }
+}
+
+static Program* readProgram(Reader* r, u32 params) {
+    const ProgramHeader* header = take(r, sizeof *header);
+    if (header == null || header->params != params || params > MAX_NESTING)
+        return null;
+    const ModuleConstant* constants = take(r, header->constantCount * sizeof(ModuleConstant));
+    const ModuleInstruction* code = take(r, header->codeLength * sizeof(ModuleInstruction));
+    if (constants == null || code == null)
+        return null;
+    Program* program = programCreate(params);
+    if (program == null)
+        return null;
+    bool ok = true;
+    for (u32 i = 0; ok && i < header->constantCount; i++) {
+        Number constant = {constants[i].value, constants[i].integer, constants[i].exact};
+        ok = constants[i].exact <= 1 && darrayAdd(&program->constants, constant);
+    }
+    // The stack must never underflow, and must hold the result alone at the end.
+    u32 depth = 0;
+    for (u32 pc = 0; ok && pc < header->codeLength; pc++) {
+        Instruction instruction;
+        ok = decodeInstruction(r, header, code[pc], &instruction) && depth >= instruction.arity &&
+             darrayAdd(&program->code, instruction);
+        depth = depth + 1 - instruction.arity;
+        if (depth > program->maxDepth)
+            program->maxDepth = depth;
+    }
+    ok = ok && depth == 1 && program->maxDepth == header->maxDepth && header->maxDepth <= MAX_STACK_DEPTH;
+    for (u32 i = 0; ok && i < header->subprogramCount; i++) {
+        Program* body = readProgram(r, params + 1);
+        ok = body != null && darrayAdd(&program->subprograms, body);
+        if (!ok)
+            programDestroy(body);
+    }
+    if (!ok) {
+        programDestroy(program);
+        return null;
+    }
+    return program;
+}
+
+// Binds the names of the variable and builtin tables, declaring the variables.
+static bool readNames(Reader* r) {
+    u32 count = r->variableCount + r->builtinCount;
+    const u32* lengths = take(r, (u64)count * sizeof(u32));
+    if (lengths == null)
+        return false;
+    u64 total = 0;
+    for (u32 i = 0; i < count; i++) {
+        total += lengths[i];
+    }
+    const char* name = take(r, total);
+    if (name == null)
+        return false;
+    for (u32 i = 0; i < count; i++) {
+        if (memchr(name, '\0', lengths[i]) != null)
+            return false;
+        if (i < r->variableCount) {
+            if (lengths[i] == 0 || !varDeclare(name, lengths[i], r->variables + i))
+                return false;
+        } else if (!builtinFromName(name, lengths[i], r->builtins + i - r->variableCount)) {
+            r->builtins[i - r->variableCount] = NO_BUILTIN;
+        }
+        name += lengths[i];
+    }
+    return true;
+}
+
+static bool decodeModule(const u8* data, u64 size, Module* module, const char* source) {
+    Reader r = {data, data + size, null, 0, null, 0};
+    const ModuleHeader* header = take(&r, sizeof *header);
+    if (header == null || memcmp(header->magic, MODULE_MAGIC, 4) != 0 || header->version != MODULE_VERSION ||
+        header->byteOrder != BYTE_ORDER_MARK || header->precision != getPrecision() ||
+        header->operators != hashOperators() || header->variableCount > MAX_VARIABLES ||
+        header->builtinCount > MAX_NAMED_BUILTINS)
+        return false;
+    const char* text = take(&r, header->sourceLength);
+    if (text == null || (source != null && (header->sourceLength != strlen(source) ||
+                                            memcmp(text, source, header->sourceLength) != 0)))
+        return false;
+    u32 variables[header->variableCount + 1];
+    u32 builtins[header->builtinCount + 1];
+    r.variables = variables;
+    r.variableCount = header->variableCount;
+    r.builtins = builtins;
+    r.builtinCount = header->builtinCount;
+    const u32* ends = readNames(&r) ? take(&r, (u64)header->lineCount * sizeof(u32)) : null;
+    if (ends == null)
+        return false;
+    for (u32 i = 0; i < header->lineCount; i++) {
+        if (ends[i] > header->statementCount || (i > 0 && ends[i] < ends[i - 1]) ||
+            !darrayAdd(&module->lineEnds, (u32)ends[i]))
+            return false;
+    }
+    if (header->lineCount > 0 && ends[header->lineCount - 1] != header->statementCount)
+        return false;
+    for (u32 i = 0; i < header->statementCount; i++) {
+        const u32* target = take(&r, 2 * sizeof(u32));
+        if (target == null || (*target != NO_TARGET && *target >= r.variableCount))
+            return false;
+        CompiledStatement statement = {*target == NO_TARGET ? NO_TARGET : variables[*target], readProgram(&r, 0)};
+        if (statement.program == null)
+            return false;
+        if (!darrayAdd(&module->statements, statement)) {
+            programDestroy(statement.program);
+            return false;
+        }
+    }
+    return r.at == r.end;
+}
+
+bool moduleLoad(const char* path, Module* module, const char* source) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (u64)st.st_size < sizeof(ModuleHeader)) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(null, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    bool ok = decodeModule(data, st.st_size, module, source);
+    munmap(data, st.st_size);
+    if (!ok) {
+        truncateStatements(module, 0);
+        darrayClear(&module->lineEnds);
+    }
+    return ok;
+}
+
+/* ----- Cache ----- */
+
+u64 hashSource(const char* source, u64 length) {
+    u64 hash = 0xcbf29ce484222325ul;
+    for (u64 i = 0; i < length; i++) {
+        hash = (hash ^ (u8)source[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Hash of LINE and of everything else its compiled form depends on.
+static u64 hashLine(const char* line) {
+    u64 hash = hashSource(line, strlen(line));
+    hash = (hash ^ getPrecision()) * FNV_PRIME;
+    hash = (hash ^ hashOperators()) * FNV_PRIME;
+    return (hash ^ MODULE_VERSION) * FNV_PRIME;
+}
+
+// The module is written to a temporary file first, other runs never map a partially written one.
+static void storeModule(const char* path, const Module* module, const char* line) {
+    char temporary[strlen(path) + 32];
+    snprintf(temporary, sizeof temporary, "%s.%d.tmp", path, (int)getpid());
+    FILE* out = fopen(temporary, "wb");
+    if (out == null)
+        return;
+    bool ok = moduleWrite(module, line, strlen(line), out);
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(temporary, path) != 0)
+        remove(temporary);
+}
+
+bool evaluateCached(const char* directory, const char* line, darray* results) {
+    char path[strlen(directory) + 32];
+    snprintf(path, sizeof path, "%s/%016lx.tc", directory, hashLine(line));
+    Module module;
+    moduleInit(&module);
+    bool success;
+    // The source is checked while loading: a module holding another line is a hash collision.
+    bool compiled = moduleLoad(path, &module, line);
+    if (!compiled && moduleCompileLine(&module, line)) {
+        storeModule(path, &module, line);
+        compiled = true;
+    }
+    if (compiled && !moduleReadsMatrices(&module, 0)) {
+        success = moduleEvaluateLine(&module, 0, results);
+    } else {
+        // The interpreter reports the errors with their position, and runs solvers and matrices.
+        clearErrors();
+        success = evaluate(line, results);
+    }
+    moduleDestroy(&module);
+    return success;
+}
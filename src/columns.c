@@ -0,0 +1,474 @@
+#include "columns.h"
+#include "block.h"
+#include "error.h"
+#include "function.h"
+#include "interpreter.h"
+#include "program.h"
+#include "thread-pool.h"
+#include "var-handler.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Rows evaluated by one task, 32 KiB of results: a block stays in the cache of the core computing it.
+#define BLOCK_ROWS 4096
+// Blocks read before their values are written out, bounds the memory used by the parsed CSV fields.
+#define BATCH_BLOCKS 16
+// Longer fields are not numbers.
+#define FIELD_MAX_LENGTH 64
+
+typedef struct columns_run {
+    const Table* table;
+    const Program* program;
+    u64 batchStart;
+    u64 batchRows;
+    // Under PRECISION_F32, columns are read and rows computed over float lanes: FLOAT_COLUMNS are used instead
+    // of COLUMNS, and VALUES and PARSED hold floats.
+    bool floats;
+    // Values of each column, from the first row of the batch.
+    const double* columns[COLUMNS_MAX];
+    const float* floatColumns[COLUMNS_MAX];
+    // CSV tables only: the fields parsed by the tasks, and the first line and number of rows of each block.
+    void* parsed[COLUMNS_MAX];
+    u64 blockStarts[BATCH_BLOCKS];
+    u64 blockRows[BATCH_BLOCKS];
+    u8* malformed;
+    void* values;
+    u64 faultyRows;
+} ColumnsRun;
+
+// Size of the values of raw columns, and of the results.
+static u64 valueSize() {
+    return getPrecision() == PRECISION_F32 ? sizeof(float) : sizeof(double);
+}
+
+static bool isIdentifier(const char* name, u64 length) {
+    if (length == 0 || (name[0] >= '0' && name[0] <= '9'))
+        return false;
+    for (u64 i = 0; i < length; i++) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'))
+            return false;
+    }
+    return true;
+}
+
+static bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Adds the column NAME, not null-terminated, to TABLE.
+static bool addColumn(Table* table, const char* name, u64 length, FILE* errStream) {
+    while (length > 0 && isBlank(*name)) {
+        name++;
+        length--;
+    }
+    while (length > 0 && isBlank(name[length - 1]))
+        length--;
+    if (!isIdentifier(name, length)) {
+        fprintf(errStream, "Invalid column name '%.*s'.\n", (int)length, name);
+        return false;
+    }
+    for (u32 k = 0; k < table->count; k++) {
+        if (table->nameLengths[k] == length && memcmp(table->names[k], name, length) == 0) {
+            fprintf(errStream, "The column '%.*s' appears twice.\n", (int)length, name);
+            return false;
+        }
+    }
+    if (table->count == COLUMNS_MAX) {
+        fprintf(errStream, "Too many columns, at most %d are supported.\n", COLUMNS_MAX);
+        return false;
+    }
+    table->names[table->count] = name;
+    table->nameLengths[table->count] = length;
+    table->count++;
+    return true;
+}
+
+// Maps the file at PATH into TABLE, private and writable so that raw columns can be byte-swapped in place.
+static bool mapFile(Table* table, const char* path, FILE* errStream) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(errStream, "Could not open '%s'.\n", path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    // Empty files cannot be mapped.
+    void* data = null;
+    if (st.st_size > 0)
+        data = mmap(null, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(errStream, "Could not map '%s' in memory.\n", path);
+        return false;
+    }
+    table->maps[table->mapCount] = data;
+    table->mapSizes[table->mapCount] = st.st_size;
+    table->mapCount++;
+    return true;
+}
+
+static bool openCsv(const char* path, Table* table, FILE* errStream) {
+    table->format = COLUMNS_CSV;
+    if (!mapFile(table, path, errStream))
+        return false;
+    const char* text = table->maps[0];
+    u64 size = table->mapSizes[0];
+    const char* newline = size > 0 ? memchr(text, '\n', size) : null;
+    u64 headerLength = newline ? (u64)(newline - text) : size;
+    if (headerLength == 0) {
+        fprintf(errStream, "'%s' has no header line naming its columns.\n", path);
+        return false;
+    }
+    for (u64 start = 0; start <= headerLength;) {
+        const char* comma = memchr(text + start, ',', headerLength - start);
+        u64 end = comma ? (u64)(comma - text) : headerLength;
+        if (!addColumn(table, text + start, end - start, errStream))
+            return false;
+        start = end + 1;
+    }
+    table->body = text + headerLength + (newline != null);
+    table->bodyLength = size - headerLength - (newline != null);
+    return true;
+}
+
+static bool openRaw(const char* spec, Table* table, FILE* errStream) {
+    table->format = COLUMNS_RAW;
+    while (*spec != '\0') {
+        const char* comma = strchr(spec, ',');
+        u64 length = comma ? (u64)(comma - spec) : strlen(spec);
+        const char* equal = memchr(spec, '=', length);
+        if (equal == null || !addColumn(table, spec, equal - spec, errStream)) {
+            if (equal == null)
+                fprintf(errStream, "Invalid column '%.*s', expected 'name=file'.\n", (int)length, spec);
+            return false;
+        }
+        char path[PATH_MAX];
+        u64 pathLength = spec + length - equal - 1;
+        if (pathLength == 0 || pathLength >= sizeof path) {
+            fprintf(errStream, "Invalid file name for the column '%.*s'.\n", (int)(equal - spec), spec);
+            return false;
+        }
+        memcpy(path, equal + 1, pathLength);
+        path[pathLength] = '\0';
+        if (!mapFile(table, path, errStream))
+            return false;
+        u64 size = table->mapSizes[table->mapCount - 1];
+        if (size % valueSize() != 0 || (table->mapCount > 1 && size / valueSize() != table->rows)) {
+            fprintf(errStream, "'%s' is not a column of as many %s as the previous ones.\n", path,
+                    valueSize() == sizeof(float) ? "floats" : "doubles");
+            return false;
+        }
+        table->rows = size / valueSize();
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+        for (u64 i = 0; i < table->rows; i++) {
+            if (valueSize() == sizeof(float)) {
+                u32* bits = table->maps[table->mapCount - 1];
+                bits[i] = __builtin_bswap32(bits[i]);
+            } else {
+                u64* bits = table->maps[table->mapCount - 1];
+                bits[i] = __builtin_bswap64(bits[i]);
+            }
+        }
+#endif
+        spec += length + (comma != null);
+    }
+    return table->count > 0;
+}
+
+bool tableOpen(const char* spec, Table* outTable, FILE* errStream) {
+    memset(outTable, 0, sizeof *outTable);
+    // Raw columns are the only specifications naming variables.
+    bool ok = strchr(spec, '=') ? openRaw(spec, outTable, errStream) : openCsv(spec, outTable, errStream);
+    if (!ok)
+        tableClose(outTable);
+    return ok;
+}
+
+void tableClose(Table* table) {
+    for (u32 i = 0; i < table->mapCount; i++) {
+        if (table->maps[i] != null)
+            munmap(table->maps[i], table->mapSizes[i]);
+    }
+    table->mapCount = 0;
+}
+
+/*
+ * CSV text is split a block at a time: newlines and commas are found with byte comparisons,
+ * a whole block of bytes being skipped when it holds none. Blocks never extend past the end of the text.
+ */
+
+// Offset of the line following the WANTED first lines of TEXT, LENGTH if there are fewer.
+// Writes the number of lines skipped, a last line without a newline included, to OUT_LINES.
+static u64 skipLines(const char* text, u64 length, u64 wanted, u64* outLines) {
+    u64 n = 0;
+    u64 lines = 0;
+#ifdef BLOCK_BYTES
+    for (; n + BLOCK_BYTES <= length; n += BLOCK_BYTES) {
+        u32 mask = blockMask(blockEq(blockLoad(text + n), blockSet('\n')));
+        u64 found = __builtin_popcount(mask);
+        if (lines + found >= wanted) {
+            // Drops the newlines before the last wanted one.
+            for (; lines + 1 < wanted; lines++) {
+                mask &= mask - 1;
+            }
+            *outLines = wanted;
+            return n + __builtin_ctz(mask) + 1;
+        }
+        lines += found;
+    }
+#endif
+    for (; n < length; n++) {
+        if (text[n] == '\n' && ++lines == wanted) {
+            *outLines = lines;
+            return n + 1;
+        }
+    }
+    *outLines = lines + (length > 0 && text[length - 1] != '\n');
+    return length;
+}
+
+// Length of the field at STR, up to the next comma or newline, reading at most LENGTH characters.
+static u64 fieldLength(const char* str, u64 length) {
+    u64 n = 0;
+#ifdef BLOCK_BYTES
+    for (; n + BLOCK_BYTES <= length; n += BLOCK_BYTES) {
+        Block v = blockLoad(str + n);
+        u32 mask = blockMask(blockOr(blockEq(v, blockSet(',')), blockEq(v, blockSet('\n'))));
+        if (mask != 0)
+            return n + __builtin_ctz(mask);
+    }
+#endif
+    while (n < length && str[n] != ',' && str[n] != '\n')
+        n++;
+    return n;
+}
+
+// Reads the number in the LENGTH characters at STR, rounded to the current precision. NaN if it is not one.
+static bool parseField(const char* str, u64 length, double* out) {
+    *out = NAN;
+    while (length > 0 && isBlank(*str)) {
+        str++;
+        length--;
+    }
+    while (length > 0 && isBlank(str[length - 1]))
+        length--;
+    // strtod would read past the end of the field, give it its own copy.
+    char buffer[FIELD_MAX_LENGTH + 1];
+    if (length == 0 || length > FIELD_MAX_LENGTH)
+        return false;
+    memcpy(buffer, str, length);
+    buffer[length] = '\0';
+    char* end;
+    double value = getPrecision() == PRECISION_F32 ? strtof(buffer, &end) : strtod(buffer, &end);
+    if (end != buffer + length)
+        return false;
+    *out = value;
+    return true;
+}
+
+// Reads the fields of the line at LINE into row ROW of COLUMNS, of floats if FLOATS. Returns the offset of the next
+// line.
+static u64 parseRow(const char* line, u64 length, void* const* columns, bool floats, u32 count, u64 row,
+                    u8* outMalformed) {
+    u64 n = 0;
+    bool valid = true;
+    bool ended = false;
+    for (u32 k = 0; k < count; k++) {
+        // Missing fields are read as empty ones.
+        u64 field = ended ? 0 : fieldLength(line + n, length - n);
+        double value;
+        valid &= parseField(line + n, field, &value);
+        if (floats)
+            ((float*)columns[k])[row] = value;
+        else
+            ((double*)columns[k])[row] = value;
+        n += field;
+        if (k + 1 == count)
+            break;
+        if (n < length && line[n] == ',') {
+            n++;
+        } else {
+            ended = true;
+            valid = false;
+        }
+    }
+    // Extra fields make the row invalid.
+    if (n < length && line[n] != '\n')
+        valid = false;
+    const char* newline = n < length ? memchr(line + n, '\n', length - n) : null;
+    *outMalformed = !valid;
+    return newline ? (u64)(newline - line) + 1 : length;
+}
+
+// Reads then evaluates the rows of one block.
+static void evalBlock(void* arg, u64 index) {
+    ColumnsRun* run = arg;
+    const Table* table = run->table;
+    u64 begin = index * BLOCK_ROWS;
+    u64 end = begin + BLOCK_ROWS < run->batchRows ? begin + BLOCK_ROWS : run->batchRows;
+    if (table->format == COLUMNS_CSV) {
+        u64 offset = run->blockStarts[index];
+        for (u64 row = begin; row < end; row++) {
+            offset += parseRow(table->body + offset, table->bodyLength - offset, run->parsed, run->floats,
+                               table->count, row, run->malformed + row);
+        }
+    }
+
+    u64 faulty = 0;
+    u8 faults[PROGRAM_LANES];
+    LaneRange range = {0, 0, 0, run->columns, run->floatColumns};
+    for (range.index = begin; range.index < end; range.index += PROGRAM_LANES) {
+        u32 lanes = end - range.index < PROGRAM_LANES ? end - range.index : PROGRAM_LANES;
+        if (run->floats)
+            programRunFloat(run->program, null, &range, lanes, (float*)run->values + range.index, faults);
+        else
+            programRun(run->program, null, &range, lanes, (double*)run->values + range.index, faults);
+        for (u32 l = 0; l < lanes; l++) {
+            if (faults[l] == 0 && (table->format != COLUMNS_CSV || !run->malformed[range.index + l]))
+                continue;
+            if (run->floats)
+                ((float*)run->values)[range.index + l] = NAN;
+            else
+                ((double*)run->values)[range.index + l] = NAN;
+            faulty++;
+        }
+    }
+    __atomic_add_fetch(&run->faultyRows, faulty, __ATOMIC_RELAXED);
+}
+
+static void writeValues(const ColumnsRun* run, u64 count, FILE* out) {
+    if (run->table->format == COLUMNS_CSV) {
+        for (u64 i = 0; i < count; i++) {
+            fprintf(out, "%.17g\n", run->floats ? ((const float*)run->values)[i] : ((const double*)run->values)[i]);
+        }
+        return;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    fwrite(run->values, valueSize(), count, out);
+#else
+    for (u64 i = 0; i < count; i++) {
+        if (run->floats) {
+            u32 bits;
+            memcpy(&bits, (const float*)run->values + i, sizeof bits);
+            bits = __builtin_bswap32(bits);
+            fwrite(&bits, sizeof bits, 1, out);
+        } else {
+            u64 bits;
+            memcpy(&bits, (const double*)run->values + i, sizeof bits);
+            bits = __builtin_bswap64(bits);
+            fwrite(&bits, sizeof bits, 1, out);
+        }
+    }
+#endif
+}
+
+// Parses EXPRESSION, with the columns declared as variables, and compiles it with them as parameters.
+static Program* compileExpression(const Table* table, const char* expression, FILE* errStream) {
+    u32 slots[COLUMNS_MAX];
+    for (u32 k = 0; k < table->count; k++) {
+        if (!varDeclare(table->names[k], table->nameLengths[k], slots + k)) {
+            fprintf(errStream, "Could not declare the column variable '%.*s'.\n", (int)table->nameLengths[k],
+                    table->names[k]);
+            return null;
+        }
+    }
+    TokenStream tokens;
+    tokenStreamInit(&tokens, expression);
+    EvalNode* tree = null;
+    if (tokenize(expression, &tokens))
+        tree = parse(&tokens);
+    Program* program = null;
+    if (tree != null)
+        program = programCompile(tree, slots, table->count);
+    if (getErrorCount() > 0)
+        printErrorsTo(errStream, expression);
+    else if (program == null)
+        fprintf(errStream, "Solvers and matrices cannot be evaluated over columns.\n");
+    if (tree != null)
+        treeDestroy(tree);
+    tokenStreamDestroy(&tokens);
+    return program;
+}
+
+// Finds the blocks of the next batch of CSV rows, from OFFSET in the body. Returns the offset following them.
+static u64 nextCsvBatch(ColumnsRun* run, u64 offset) {
+    const Table* table = run->table;
+    run->batchRows = 0;
+    for (u32 b = 0; b < BATCH_BLOCKS && offset < table->bodyLength; b++) {
+        run->blockStarts[b] = offset;
+        offset += skipLines(table->body + offset, table->bodyLength - offset, BLOCK_ROWS, run->blockRows + b);
+        run->batchRows += run->blockRows[b];
+    }
+    return offset;
+}
+
+bool columnsRun(const Table* table, const char* expression, FILE* out, FILE* errStream) {
+    Program* program = compileExpression(table, expression, errStream);
+    if (program == null)
+        return false;
+    u64 batchCapacity = (u64)BLOCK_ROWS * BATCH_BLOCKS;
+    ColumnsRun run = {table, program, 0, 0, getPrecision() == PRECISION_F32, {0}, {0}, {0}, {0}, {0}, null, null, 0};
+    bool ok = (run.values = memAlloc(MEM_GENERAL, batchCapacity * valueSize())) != null;
+    if (ok && table->format == COLUMNS_CSV) {
+        ok = (run.malformed = memAlloc(MEM_GENERAL, batchCapacity)) != null;
+        for (u32 k = 0; ok && k < table->count; k++) {
+            ok = (run.parsed[k] = memAlloc(MEM_GENERAL, batchCapacity * valueSize())) != null;
+            if (run.floats)
+                run.floatColumns[k] = run.parsed[k];
+            else
+                run.columns[k] = run.parsed[k];
+        }
+    }
+
+    // Nothing more is computed once OUT failed.
+    u64 totalRows = 0;
+    if (ok && table->format == COLUMNS_CSV) {
+        fputs("value\n", out);
+        for (u64 offset = nextCsvBatch(&run, 0); run.batchRows > 0 && !ferror(out);
+             offset = nextCsvBatch(&run, offset)) {
+            poolFor((run.batchRows + BLOCK_ROWS - 1) / BLOCK_ROWS, evalBlock, &run);
+            writeValues(&run, run.batchRows, out);
+            totalRows += run.batchRows;
+        }
+    } else if (ok) {
+        for (run.batchStart = 0; run.batchStart < table->rows && !ferror(out); run.batchStart += batchCapacity) {
+            u64 remaining = table->rows - run.batchStart;
+            run.batchRows = remaining < batchCapacity ? remaining : batchCapacity;
+            for (u32 k = 0; k < table->count; k++) {
+                if (run.floats)
+                    run.floatColumns[k] = (const float*)table->maps[k] + run.batchStart;
+                else
+                    run.columns[k] = (const double*)table->maps[k] + run.batchStart;
+            }
+            poolFor((run.batchRows + BLOCK_ROWS - 1) / BLOCK_ROWS, evalBlock, &run);
+            writeValues(&run, run.batchRows, out);
+        }
+        totalRows = table->rows;
+    }
+    bool written = fflush(out) == 0 && !ferror(out);
+    if (!ok && getErrorCount() > 0)
+        printErrorsTo(errStream, expression);
+    else if (!written)
+        fprintf(errStream, "Could not write the values.\n");
+    if (written && run.faultyRows > 0)
+        fprintf(errStream,
+                "%lu of %lu rows could not be computed (malformed fields, division by zero or invalid range), "
+                "written as NaN.\n",
+                run.faultyRows, totalRows);
+    for (u32 k = 0; k < table->count; k++) {
+        memFree(run.parsed[k]);
+    }
+    memFree(run.malformed);
+    memFree(run.values);
+    programDestroy(program);
+    return ok && written;
+}
@@ -1,31 +1,44 @@
 #include "darray.h"
 #include "util.h"
 
-#include <stdlib.h>
 #include <err.h>
 
 #define FIELD_SIZE 3 * sizeof(u64)
 
 darray* darrayCreate(u64 size, u64 stride) {
-    darray* array = malloc(sizeof *array);
-    darrayInit(array, size, stride);
-    return array;
+    return darrayCreateIn(size, stride, MEM_DARRAY);
 }
 
 void darrayInit(darray *array, u64 size, u64 stride) {
-    array->capacity = size;
+    darrayInitIn(array, size, stride, MEM_DARRAY);
+}
+
+darray* darrayCreateIn(u64 size, u64 stride, MemSubsystem subsystem) {
+    darray* array = memAlloc(subsystem, sizeof *array);
+    if (array == null)
+        return null;
+    darrayInitIn(array, size, stride, subsystem);
+    return array;
+}
+
+void darrayInitIn(darray *array, u64 size, u64 stride, MemSubsystem subsystem) {
     array->stride = stride;
     array->length = 0;
-    array->a = malloc(size * stride);
+    array->subsystem = subsystem;
+    array->a = memAlloc(subsystem, size * stride);
+    array->capacity = array->a == null ? 0 : size;
 }
 
 void darrayDestroy(darray* array) {
     darrayEmpty(array);
-    free(array);
+    memFree(array);
 }
 
 void darrayEmpty(darray* array) {
-    free(array->a);
+    memFree(array->a);
+    array->a = null;
+    array->capacity = 0;
+    array->length = 0;
 }
 
 u64 darrayCapacity(darray *array) {
@@ -40,34 +53,33 @@ u64 darrayLength(darray *array) {
     return array->length;
 }
 
-static void* ensureCapacity(darray* array) {
+static bool ensureCapacity(darray* array) {
     u64 capacity = darrayCapacity(array);
     u64 stride = darrayStride(array);
-    u64 newCapacity = capacity << 1;
+    u64 newCapacity = capacity == 0 ? 4 : capacity << 1;
 
-    void* ptr = realloc(array->a, newCapacity * stride);
-    if(ptr == NULL)
+    void* ptr = memRealloc(array->subsystem, array->a, newCapacity * stride);
+    if(ptr == null)
         return false;
     array->a = ptr;
     array->capacity = newCapacity;
-    return array;
+    return true;
 }
 
-void _darrayAdd(darray* array, void *element) {
+bool _darrayAdd(darray* array, void *element) {
     u64 capacity = darrayCapacity(array);
     u64 stride = darrayStride(array);
     u64 length = darrayLength(array);
 
-    if (capacity <= length) {
-        array = ensureCapacity(array);
-        capacity = darrayCapacity(array);
-    }
+    if (capacity <= length && !ensureCapacity(array))
+        return false;
 
     memcpy(array->a + length * stride, element, stride);
     array->length++;
+    return true;
 }
 
-void _darrayInsert(darray* array, void *element, u64 index) {
+bool _darrayInsert(darray* array, void *element, u64 index) {
     u64 capacity = darrayCapacity(array);
     u64 stride = darrayStride(array);
     u64 length = darrayLength(array);
@@ -75,17 +87,16 @@ void _darrayInsert(darray* array, void *element, u64 index) {
         return _darrayAdd(array, element);
     }
 
-    if (capacity == length) {
-        array = ensureCapacity(array);
-        capacity = darrayCapacity(array);
-    }
+    if (capacity == length && !ensureCapacity(array))
+        return false;
 
     void* addr = array->a;
-    for (u64 i = length - 1; i > index; i--) {
-        memcpy(addr + (i + 1) * stride, addr + i * stride, stride);
+    for (u64 i = length; i > index; i--) {
+        memcpy(addr + i * stride, addr + (i - 1) * stride, stride);
     }
     memcpy(addr + index * stride, element, stride);
     array->length++;
+    return true;
 }
 
 bool darrayRemove(darray* array, u64 index, void *out) {
@@ -99,7 +110,11 @@ bool darrayRemove(darray* array, u64 index, void *out) {
     if(out != null)
         memcpy(out, address, stride);
 
-    memcpy(address, address + stride, (length - index - 1) * stride);
+    // One element at a time: the source and destination of a single copy never overlap.
+    for (u64 i = index + 1; i < length; i++) {
+        memcpy(address, address + stride, stride);
+        address += stride;
+    }
     array->length--;
     return true;
 }
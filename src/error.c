@@ -2,24 +2,21 @@
 #include "util.h"
 
 #include <err.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define MSG(code, msg) messages[code] = msg
 
-static darray* errors;
-static u64 errIndex;
-static bool initialized = false;
+// Each thread has its own error list, so that pipeline stages can report errors independently.
+static __thread darray* errors;
+static __thread u64 errIndex;
+static __thread bool initialized = false;
 
 static char* messages[_ERR_SIZE];
+static pthread_once_t messagesOnce = PTHREAD_ONCE_INIT;
 
-void initErrorSystem() {
-    if (initialized)
-        return;
-    errors = darrayCreate(4, sizeof(Error));
-    errIndex = 0;
-    initialized = true;
-
+static void initMessages() {
     MSG(ERR_OP_MISSING_OPERAND, "Operator is missing one or more operands.");
     MSG(ERR_FUNC_MISSING_OPERAND, "Function is missing one or more operands.");
     MSG(ERR_MISMATCH_PAREN, "Mismatched parentheses.");
@@ -27,34 +24,62 @@ void initErrorSystem() {
     MSG(ERR_UNKNOWN_TOKEN, "Unknown token.");
     MSG(ERR_DIV_BY_ZERO, "Division by zero.");
     MSG(ERR_INVALID_EXPR, "Malformed expression.");
+    MSG(ERR_UNKNOWN_VARIABLE, "Unknown variable.");
+    MSG(ERR_TOO_MANY_VARS, "Too many variables.");
+    MSG(ERR_INVALID_RANGE, "Invalid index range.");
+    MSG(ERR_NOT_BRACKETED, "The expression does not change sign over the interval.");
+    MSG(ERR_MATRIX_SHAPE, "Incompatible matrix shapes.");
+    MSG(ERR_MATRIX_OPERAND, "A matrix cannot be used here.");
+    MSG(ERR_CALL_DEPTH, "Too many nested function calls.");
+    MSG(ERR_COMPLEX_OPERAND, "A complex number cannot be used here.");
+    MSG(ERR_BIG_FUNCTION, "This function is not available in arbitrary precision.");
+    MSG(ERR_BIG_RESULT, "The result is not a finite real number.");
 }
 
-void signalError(enum errortype type, Token* token) {
-    if (!initialized) {
-        err(ERR_SYSTEM_UNINIT, "Attempt to report error while the system has not been initialized.");
+void initErrorSystem() {
+    if (initialized)
         return;
-    }
-    Error error = {type, !token ? 0 : token->position, true, {.token = token}, false};
-    darrayAdd(errors, error);
+    errors = darrayCreateIn(4, sizeof(Error), MEM_ERROR);
+    errIndex = 0;
+    initialized = true;
+    pthread_once(&messagesOnce, initMessages);
 }
 
-void signalErrorNoToken(enum errortype type, char* symbol, u64 position) {
+// Copies LENGTH characters of SYMBOL into the error, truncating it if it is too long.
+static void recordError(Error* error, const char* symbol, u64 length) {
     if (!initialized) {
         err(ERR_SYSTEM_UNINIT, "Attempt to report error while the system has not been initialized.");
         return;
     }
+    // A single allocation failure usually cascades, only report the first one.
+    if (error->type == ERR_ALLOC_FAIL && hasErrorOfType(ERR_ALLOC_FAIL))
+        return;
+    error->symbolTooLong = length >= ERR_SYMBOL_MAX;
+    if (error->symbolTooLong)
+        length = ERR_SYMBOL_MAX - 1;
+    memcpy(error->symbol, symbol, length);
+    error->symbol[length] = '\0';
+    darrayAdd(errors, *error);
+}
+
+void signalError(enum errortype type, const TokenStream* tokens, u64 index) {
     Error error;
-    error.hasToken = false;
-    error.position = position;
     error.type = type;
-    u64 symbolLen = strlen(symbol);
-    error.symbolTooLong = symbolLen >= ERR_SYMBOL_MAX;
-    memcpy(error.value.symbol, symbol, error.symbolTooLong ? ERR_SYMBOL_MAX - 1 : symbolLen);
-    //If the string is too long, the null character is not copied.
-    //We need to add it manually.
-    if(error.symbolTooLong)
-        error.value.symbol[ERR_SYMBOL_MAX - 1] = 0;
-    darrayAdd(errors, error);
+    error.position = tokenOffset(tokens, index);
+    error.hasToken = true;
+    error.tokenKind = tokenKind(tokens, index);
+    recordError(&error, tokens->source + error.position, tokenLength(tokens, index));
+}
+
+void signalErrorNoToken(enum errortype type, const char* symbol, u64 position) {
+    Error error;
+    error.type = type;
+    error.position = position;
+    error.hasToken = false;
+    error.tokenKind = _IDENTIFIER_SIZE;
+    if (symbol == null)
+        symbol = "";
+    recordError(&error, symbol, strlen(symbol));
 }
 
 u64 getErrorCount() {
@@ -65,6 +90,33 @@ u64 getErrorCount() {
     return darrayLength(errors);
 }
 
+void clearErrors() {
+    darrayClear(errors);
+}
+
+bool hasErrorOfType(enum errortype type) {
+    for (u64 i = 0; i < darrayLength(errors); i++) {
+        if (((Error*)errors->a)[i].type == type)
+            return true;
+    }
+    return false;
+}
+
+void takeErrors(darray* outErrors) {
+    for (u64 i = 0; i < darrayLength(errors); i++) {
+        darrayAdd(outErrors, ((Error*)errors->a)[i]);
+    }
+    darrayClear(errors);
+}
+
+void resignalErrors(const darray* taken) {
+    for (u64 i = 0; i < taken->length; i++) {
+        Error error = ((Error*)taken->a)[i];
+        if (error.type != ERR_ALLOC_FAIL || !hasErrorOfType(ERR_ALLOC_FAIL))
+            darrayAdd(errors, error);
+    }
+}
+
 Error* getNextError() {
     if (!initialized) {
         err(ERR_SYSTEM_UNINIT, "Attempt to get error while the system has not been initialized.");
@@ -75,62 +127,81 @@ Error* getNextError() {
     return ((Error*)errors->a) + errIndex++;
 }
 
-static void previewExprError(const char* expression, const char* symbol, size_t pos, bool tooLongSymbol) {
+static void previewExprError(FILE* stream, const char* expression, const char* symbol, size_t pos, bool tooLongSymbol) {
     size_t symbolLen = strlen(symbol);
     u64 exprlen = strlen(expression);
-    fputs("\x1b[22m", stderr);
+    fputs("\x1b[22m", stream);
     u64 minIndex = pos < 50 ? 0 : pos - 50;
     u64 maxIndex = pos + 50;
     if(minIndex > 0)
-        fputs("...", stderr);
+        fputs("...", stream);
     for (size_t i = minIndex; expression[i] && i < maxIndex; i++) {
         if (i == pos)
-            fputs("\x1b[31;1m", stderr);
+            fputs("\x1b[31;1m", stream);
         else if (i == pos + symbolLen)
-            fputs("\x1b[39;22m", stderr);
-        fputc(expression[i], stderr);
+            fputs("\x1b[39;22m", stream);
+        fputc(expression[i], stream);
     }
     if(exprlen > maxIndex)
-        fputs("...", stderr);
+        fputs("...", stream);
     size_t j = 0;
     for (j = 0; j < pos; j++) {
-        fputc(' ', stderr);
+        fputc(' ', stream);
     }
-    fputs("\e[31;1m", stderr);
-    fputc('^', stderr);
+    fputs("\e[31;1m", stream);
+    fputc('^', stream);
     for (j = 0; j < symbolLen - 1; j++) {
-        fputc('-', stderr);
+        fputc('-', stream);
     }
     if(tooLongSymbol)
-        fputs("...", stderr);
-    fprintf(stderr, "%s\n", "\e[0m");
+        fputs("...", stream);
+    fprintf(stream, "%s\n", "\e[0m");
 }
 
-void printErrors(const char* expression) {
+void printErrorsTo(FILE* stream, const char* expression) {
     u64 errCount = getErrorCount();
     for (u64 i = 0; i < errCount; i++) {
         Error* err = ((Error*)errors->a) + i;
         if (err->position == (u64)-1) {
-            fprintf(stderr, "Error when evaluating : %s\n", messages[err->type]);
+            fprintf(stream, "Error when evaluating : %s\n", messages[err->type]);
             continue;
         }
 
-        printf("Error at position %zu : %s\n", err->position, messages[err->type]);
+        fprintf(stream, "Error at position %zu : %s\n", err->position, messages[err->type]);
         if (err->hasToken) {
-            Token* tok = err->value.token;
-            fprintf(stderr, "Problematic token : '%s' [%i]\n", tok->symbol, tok->identifier);
-            previewExprError(expression, tok->symbol, err->position, false);
+            fprintf(stream, "Problematic token : '%s' [%i]\n", err->symbol, err->tokenKind);
         } else {
-            fprintf(stderr, "Erroneous symbol : %s", err->value.symbol);
+            fprintf(stream, "Erroneous symbol : %s", err->symbol);
             if(err->symbolTooLong)
-                fputs("...", stderr);
-            fputc('\n', stderr);
-            previewExprError(expression, err->value.symbol, err->position, err->symbolTooLong);
+                fputs("...", stream);
+            fputc('\n', stream);
         }
+        previewExprError(stream, expression, err->symbol, err->position, err->symbolTooLong);
     }
     darrayClear(errors);
 }
 
+void printErrors(const char* expression) {
+    printErrorsTo(stderr, expression);
+}
+
+char* formatErrors(const char* expression, u64* outLength) {
+    *outLength = 0;
+    if (getErrorCount() == 0)
+        return null;
+    char* text = null;
+    size_t length = 0;
+    FILE* stream = open_memstream(&text, &length);
+    if (stream == null) {
+        printErrors(expression);
+        return null;
+    }
+    printErrorsTo(stream, expression);
+    fclose(stream);
+    *outLength = length;
+    return text;
+}
+
 void shutErrorSystem() {
     if (!initialized)
         return;
@@ -1,48 +1,382 @@
 #include "eval-tree.h"
+#include "bignum.h"
 #include "error.h"
+#include "program.h"
+#include "solver.h"
+#include "thread-pool.h"
+#include "var-handler.h"
 
-#include <stdlib.h>
+#include <math.h>
 #include <stdio.h>
 
-EvalNode *treeCreate(Token *token) {
-    EvalNode* node = malloc(sizeof *node);
+EvalNode *treeCreate(const TokenStream *tokens, u32 index) {
+    EvalNode* node = memAlloc(MEM_TREE, sizeof *node);
     if(node == null)
         return null;
 
-    node->children = darrayCreate(2, sizeof(EvalNode*));
+    node->children = darrayCreateIn(2, sizeof(EvalNode*), MEM_TREE);
+    if (node->children == null) {
+        memFree(node);
+        return null;
+    }
     node->parent = null;
+    node->program = null;
+    node->kind = tokenKind(tokens, index);
+    node->token = index;
+    node->literal = (Number){0, 0, false};
+    node->big = null;
+    node->variable = 0;
+    node->rows = 0;
+    node->size = 1;
+    node->binds = false;
+    Function function = NONE;
+    switch (node->kind) {
+    case NUMBER:
+        node->literal = tokenLiteral(tokens, index);
+        if (getBigPrecision() > 0)
+            node->big = bigParse(tokens->source + tokenOffset(tokens, index), tokenLength(tokens, index));
+        break;
+    case OPERATOR:
+        function = tokenOperator(tokens, index)->function;
+        break;
+    case NAME:
+        // Names which are not builtins are variables, see treeCreateVariable.
+        if (tokenPayload(tokens, index) != NO_BUILTIN)
+            function = getBuiltin(tokenPayload(tokens, index))->function;
+        break;
+    case COLON:
+        function = SELECT;
+        break;
+    default:
+        break;
+    }
+    node->function = function.ptr;
+    node->partials = function.partials;
+    node->arity = function.arity;
+    node->lazy = function.lazy;
+    return node;
+}
+
+EvalNode* treeCreateVariable(const TokenStream* tokens, u32 index, u32 slot) {
+    EvalNode* node = treeCreate(tokens, index);
+    if (node == null)
+        return null;
+    node->function = null;
+    node->partials = null;
+    node->arity = 0;
+    node->lazy = false;
+    node->variable = slot;
+    return node;
+}
+
+EvalNode* treeCreateCall(const TokenStream* tokens, u32 index, u32 function) {
+    EvalNode* node = treeCreate(tokens, index);
+    if (node == null)
+        return null;
+    node->function = CALL.ptr;
+    node->partials = null;
+    node->arity = getUserFunction(function)->arity;
+    node->lazy = true;
+    node->variable = function;
+    return node;
+}
+
+static bool isVariable(EvalNode* tree) {
+    return tree->kind == NAME && tree->function == null;
+}
+
+/*
+ * Inlining: the body is copied with the arguments in place of the parameters. Only where this evaluates the same
+ * as the call, which evaluates every argument once before the body: bodies binding no variable, and arguments which
+ * are leaves, or used exactly once by the body, outside the operands lazy nodes may skip.
+ */
+
+// Larger bodies are compiled once and called, copying them at every call would grow trees without bound.
+#define INLINE_MAX_NODES 32
+
+// Counts the uses of the parameters of FUNCTION in TREE. SKIPPABLE if one of them is under a lazy node.
+static void countUses(const UserFunction* function, EvalNode* tree, bool skippable, u32* uses) {
+    for (u32 k = 0; isVariable(tree) && k < function->arity; k++) {
+        if (tree->variable == function->params[k])
+            uses[k] += skippable ? 2 : 1;
+    }
+    for (u64 i = 0; i < tree->arity; i++) {
+        countUses(function, treeChild(tree, i), skippable || (tree->lazy && i > 0), uses);
+    }
+}
+
+// Copy of TREE alone, without children, reported at TOKEN.
+static EvalNode* copyNode(EvalNode* tree, u32 token) {
+    EvalNode* node = memAlloc(MEM_TREE, sizeof *node);
+    if (node == null)
+        return null;
+    *node = *tree;
+    node->children = darrayCreateIn(tree->arity > 2 ? tree->arity : 2, sizeof(EvalNode*), MEM_TREE);
+    if (node->children == null) {
+        memFree(node);
+        return null;
+    }
     node->token = token;
-    node->function = token->function.ptr; //TODO
-    node->arity = token->function.arity;
+    node->program = null;
+    node->parent = null;
+    node->big = tree->big != null ? bigClone(tree->big) : null;
+    return node;
+}
+
+static EvalNode* copyTree(EvalNode* tree) {
+    EvalNode* node = copyNode(tree, tree->token);
+    for (u64 i = 0; node != null && i < tree->arity; i++) {
+        EvalNode* child = copyTree(treeChild(tree, i));
+        if (child == null || !treeAddChild(node, child)) {
+            if (child != null)
+                treeDestroy(child);
+            treeDestroy(node);
+            return null;
+        }
+    }
     return node;
 }
 
-void treeAddChild(EvalNode *parent, EvalNode *child) {
-    darrayAdd(parent->children, child);
+// Turns NODE into a literal, computed from its children, which are literals, unless this would signal an error.
+static void fold(EvalNode* node) {
+    // In complex mode, functions of real arguments may give complex results. In arbitrary precision mode,
+    // literals hold more than their double.
+    if (node->lazy || node->function == null || node->arity == 0 || node->kind == LBRACKET || isComplexMode() ||
+        getBigPrecision() > 0)
+        return;
+    double args[node->arity];
+    i64 integers[node->arity];
+    bool exact = true;
+    for (u64 i = 0; i < node->arity; i++) {
+        EvalNode* child = treeChild(node, i);
+        if (child->kind != NUMBER)
+            return;
+        args[i] = child->literal.value;
+        integers[i] = child->literal.integer;
+        exact &= child->literal.exact;
+    }
+    if (node->function == DIVIDE.ptr && args[1] == 0)
+        return;
+    Number literal = {roundToPrecision(node->function(args)), 0, false};
+    literal.exact = exact && integerApply(programOpcode(node->function), node->function, integers, &literal.integer);
+    for (u64 i = 0; i < node->arity; i++) {
+        treeDestroy(treeChild(node, i));
+    }
+    darrayClear(node->children);
+    node->kind = NUMBER;
+    node->literal = literal;
+    node->function = null;
+    node->partials = null;
+    node->arity = 0;
+}
+
+// Copy of the body TREE of FUNCTION, with copies of ARGS in place of its parameters, at the TOKEN of the call.
+// Conditionals whose condition became constant are replaced by the selected operand.
+static EvalNode* inlineTree(const UserFunction* function, EvalNode* tree, EvalNode** args, u32 token) {
+    for (u32 k = 0; isVariable(tree) && k < function->arity; k++) {
+        if (tree->variable == function->params[k])
+            return copyTree(args[k]);
+    }
+    if (tree->function == SELECT.ptr) {
+        EvalNode* condition = inlineTree(function, treeChild(tree, 0), args, token);
+        if (condition != null && condition->kind == NUMBER && condition->big == null) {
+            u32 chosen = condition->literal.value != 0 ? 1 : 2;
+            treeDestroy(condition);
+            return inlineTree(function, treeChild(tree, chosen), args, token);
+        }
+        if (condition != null)
+            treeDestroy(condition);
+    }
+    EvalNode* node = copyNode(tree, token);
+    for (u64 i = 0; node != null && i < tree->arity; i++) {
+        EvalNode* child = inlineTree(function, treeChild(tree, i), args, token);
+        if (child == null || !treeAddChild(node, child)) {
+            if (child != null)
+                treeDestroy(child);
+            treeDestroy(node);
+            return null;
+        }
+    }
+    if (node != null)
+        fold(node);
+    return node;
+}
+
+EvalNode* treeInlineCall(EvalNode* call) {
+    const UserFunction* function = getUserFunction(call->variable);
+    // The body is not parsed yet in recursive calls.
+    if (function->body == null || function->body->size > INLINE_MAX_NODES || function->body->binds)
+        return call;
+    u32 uses[USER_FUNCTION_MAX_ARITY] = {0};
+    countUses(function, function->body, false, uses);
+    EvalNode** args = call->children->a;
+    for (u32 k = 0; k < function->arity; k++) {
+        if (uses[k] != 1 && args[k]->kind != NUMBER && !isVariable(args[k]))
+            return call;
+    }
+    EvalNode* node = inlineTree(function, function->body, args, call->token);
+    if (node == null)
+        return call;
+    treeDestroy(call);
+    return node;
+}
+
+bool treeAddChild(EvalNode *parent, EvalNode *child) {
+    if (!darrayAdd(parent->children, child))
+        return false;
     child->parent = parent;
+    return true;
 }
 
-static void printTreeRec(EvalNode *tree, u64 level) {
+static void printTreeRec(EvalNode *tree, const TokenStream *tokens, u64 level) {
     for (u64 i = 0; i < level; i++) {
         printf("%s", "  ");
     }
-    printf("%s\n", tree->token->symbol);
+    printf("%.*s\n", (int)tokenLength(tokens, tree->token), tokens->source + tokenOffset(tokens, tree->token));
     for (u64 i = 0; i < tree->arity; i++) {
         EvalNode* node;
         darrayGet(tree->children, i, &node);
-        printTreeRec(node, level + 1);
+        printTreeRec(node, tokens, level + 1);
+    }
+}
+
+void printTree(EvalNode *tree, const TokenStream *tokens) {
+    printTreeRec(tree, tokens, 0);
+}
+
+EvalNode* treeChild(EvalNode* tree, u64 index) {
+    return ((EvalNode**)tree->children->a)[index];
+}
+
+// Reductions whose body cannot be compiled walk it once per index.
+static double evalReductionWalk(EvalNode* tree, double first, double last) {
+    u32 index = treeChild(tree, 0)->variable;
+    bool sum = tree->function == SUM.ptr;
+    double saved = varGet(index);
+    double result = sum ? 0 : 1;
+    for (double i = first; i <= last && getErrorCount() == 0; i++) {
+        varSet(index, i);
+        double term = treeEval(treeChild(tree, 3));
+        result = roundToPrecision(sum ? result + term : result * term);
+    }
+    varSet(index, saved);
+    return result;
+}
+
+// sum(i, a, b, expr): the bounds are evaluated by walking the tree, the body is compiled once
+// and evaluated over the whole range on the thread pool.
+static double evalReduction(EvalNode* tree) {
+    double first = treeEval(treeChild(tree, 1));
+    double last = treeEval(treeChild(tree, 2));
+    if (getErrorCount() > 0)
+        return 0;
+    if (!isfinite(first) || !isfinite(last)) {
+        signalErrorNoToken(ERR_INVALID_RANGE, null, -1);
+        return 0;
+    }
+    if (tree->program == null) {
+        u32 index = treeChild(tree, 0)->variable;
+        tree->program = programCompile(treeChild(tree, 3), &index, 1);
+        if (tree->program == null)
+            return getErrorCount() > 0 ? 0 : evalReductionWalk(tree, first, last);
     }
+    u8 faults = 0;
+    ReduceKind kind = tree->function == SUM.ptr ? REDUCE_SUM : REDUCE_PROD;
+    double result = programReduce(tree->program, kind, null, first, last, true, &faults);
+    signalFaults(faults);
+    return result;
 }
 
-void printTree(EvalNode *tree) {
-    printTreeRec(tree, 0);
+// solve(expr, x, low, high) and minimize(expr, x, low, high).
+static double evalSolver(EvalNode* tree) {
+    double low = treeEval(treeChild(tree, 2));
+    double high = treeEval(treeChild(tree, 3));
+    if (getErrorCount() > 0)
+        return 0;
+    u32 slot = treeChild(tree, 1)->variable;
+    // Solvers nested in EXPR prevent its compilation, it is then walked.
+    if (tree->program == null)
+        tree->program = programCompile(treeChild(tree, 0), &slot, 1);
+    if (tree->function == SOLVE.ptr)
+        return solveRoot(treeChild(tree, 0), tree->program, slot, low, high);
+    return minimizeFunction(treeChild(tree, 0), tree->program, slot, low, high);
+}
+
+static __thread u32 callDepth = 0;
+
+// The arguments are evaluated first. Bodies which compile run in a frame holding the arguments, one column per
+// parameter. The others, recursive ones, are walked with the parameters set to the arguments, then restored.
+static double evalCall(EvalNode* tree) {
+    const UserFunction* function = getUserFunction(tree->variable);
+    double args[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        args[i] = treeEval(treeChild(tree, i));
+        if (getErrorCount() > 0)
+            return 0;
+    }
+    const Program* program = userFunctionProgram(tree->variable);
+    if (program != null) {
+        const double* columns[tree->arity];
+        for (u64 i = 0; i < tree->arity; i++) {
+            columns[i] = args + i;
+        }
+        double result;
+        u8 faults;
+        programRun(program, null, &(LaneRange){0, 0, 0, columns, null}, 1, &result, &faults);
+        signalFaults(faults);
+        return result;
+    }
+    if (callDepth == MAX_CALL_DEPTH) {
+        signalErrorNoToken(ERR_CALL_DEPTH, null, -1);
+        return 0;
+    }
+    Number saved[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        saved[i] = varGetNumber(function->params[i]);
+        varSet(function->params[i], args[i]);
+    }
+    callDepth++;
+    double result = treeEval(function->body);
+    callDepth--;
+    for (u64 i = 0; i < tree->arity; i++) {
+        varSetNumber(function->params[i], saved[i]);
+    }
+    return result;
+}
+
+// Short-circuiting evaluation: only the operands that decide the result are evaluated.
+static double evalLazy(EvalNode* tree) {
+    if (isReduction(tree->function))
+        return evalReduction(tree);
+    if (isSolver(tree->function))
+        return evalSolver(tree);
+    if (tree->function == CALL.ptr)
+        return evalCall(tree);
+    double first = treeEval(treeChild(tree, 0));
+    if (getErrorCount() > 0)
+        return 0;
+    if (tree->function == AND.ptr)
+        return first != 0 && treeEval(treeChild(tree, 1)) != 0;
+    if (tree->function == OR.ptr)
+        return first != 0 || treeEval(treeChild(tree, 1)) != 0;
+    // SELECT
+    return treeEval(treeChild(tree, first != 0 ? 1 : 2));
 }
 
 double treeEval(EvalNode *tree) {
-    if(getErrorCount() > 0)
+    if(tree == null || getErrorCount() > 0)
+        return 0;
+    if(tree->kind == NUMBER)
+        return tree->literal.value;
+    // Trees with matrices are evaluated by treeEvalMatrix.
+    if (tree->kind == LBRACKET) {
+        signalErrorNoToken(ERR_MATRIX_OPERAND, null, -1);
         return 0;
-    if(tree->token->identifier == NUMBER)
-        return tree->token->value.number;
+    }
+    if (isVariable(tree))
+        return varGet(tree->variable);
+    if (tree->lazy)
+        return evalLazy(tree);
     double args[tree->arity];
     for (u64 i = 0; i < tree->arity; i++) {
         if(getErrorCount() > 0)
@@ -51,7 +385,479 @@ double treeEval(EvalNode *tree) {
         darrayGet(tree->children, i, &node);
         args[i] = treeEval(node);
     }
-    return tree->function(args);
+    return roundToPrecision(tree->function(args));
+}
+
+void treeMeasure(EvalNode* tree) {
+    tree->size = 1;
+    tree->binds = isReduction(tree->function) || isSolver(tree->function) || tree->function == CALL.ptr;
+    for (u64 i = 0; i < darrayLength(tree->children); i++) {
+        EvalNode* child = treeChild(tree, i);
+        treeMeasure(child);
+        tree->size += child->size;
+        tree->binds |= child->binds;
+    }
+}
+
+/*
+ * Parallel evaluation: the largest subtrees which are not too large become tasks, evaluated ahead on the pool.
+ * The nodes above them are then walked like treeEval does, which takes the values of the tasks in evaluation
+ * order, along with their errors: a task's errors are only signaled if the walk reaches it, so the first error
+ * stops the evaluation as if the whole tree had been walked.
+ */
+
+// Smaller subtrees are walked by the thread reaching them: scheduling them would cost more than evaluating them.
+#define TASK_MIN_NODES 4096
+// Subtrees are uneven, splitting the tree into more tasks than threads lets the threads done first take the rest.
+#define TASKS_PER_THREAD 8
+
+typedef struct split {
+    darray roots; // EvalNode*, the subtrees evaluated as tasks, in evaluation order
+    double* values;
+    darray* errors; // darray of Error per task
+    u64 next;       // first task whose value was not used yet
+} Split;
+
+// Adds the subtrees of TREE to evaluate as tasks, up to GRAIN nodes each unless they cannot be split.
+static bool pickTasks(EvalNode* tree, u64 grain, darray* roots) {
+    if (tree->size < TASK_MIN_NODES)
+        return true;
+    bool splittable = false;
+    for (u64 i = 0; i < tree->arity; i++) {
+        splittable |= treeChild(tree, i)->size >= TASK_MIN_NODES;
+    }
+    // Lazy nodes may not evaluate all of their operands: they are evaluated whole, or by the walk.
+    if (!tree->binds && (tree->size <= grain || tree->lazy || !splittable))
+        return darrayAdd(roots, tree);
+    if (tree->lazy)
+        return true;
+    for (u64 i = 0; i < tree->arity; i++) {
+        if (!pickTasks(treeChild(tree, i), grain, roots))
+            return false;
+    }
+    return true;
+}
+
+static void evalTask(void* arg, u64 index) {
+    Split* split = arg;
+    split->values[index] = treeEval(((EvalNode**)split->roots.a)[index]);
+    takeErrors(split->errors + index);
+}
+
+// Whether the next task is a subtree of TREE. Tasks are in evaluation order, if it is not none of the others are.
+static bool holdsTask(EvalNode* tree, const Split* split) {
+    if (split->next == split->roots.length)
+        return false;
+    for (EvalNode* node = ((EvalNode**)split->roots.a)[split->next]; node != null; node = node->parent) {
+        if (node == tree)
+            return true;
+    }
+    return false;
+}
+
+// treeEval for the nodes above the tasks, which are never lazy.
+static double evalAbove(EvalNode* tree, Split* split) {
+    if (getErrorCount() > 0)
+        return 0;
+    if (split->next < split->roots.length && ((EvalNode**)split->roots.a)[split->next] == tree) {
+        resignalErrors(split->errors + split->next);
+        return split->values[split->next++];
+    }
+    if (!holdsTask(tree, split))
+        return treeEval(tree);
+    double args[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        if (getErrorCount() > 0)
+            return 0;
+        args[i] = evalAbove(treeChild(tree, i), split);
+    }
+    return roundToPrecision(tree->function(args));
+}
+
+double treeEvalParallel(EvalNode* tree) {
+    u32 threads = poolThreadCount();
+    if (tree == null || threads == 1 || tree->size < 2 * TASK_MIN_NODES || getErrorCount() > 0)
+        return treeEval(tree);
+    u64 grain = tree->size / ((u64)threads * TASKS_PER_THREAD);
+    Split split;
+    darrayInitIn(&split.roots, 16, sizeof(EvalNode*), MEM_TREE);
+    split.values = null;
+    split.errors = null;
+    split.next = 0;
+    bool ok = pickTasks(tree, grain > TASK_MIN_NODES ? grain : TASK_MIN_NODES, &split.roots);
+    u64 count = split.roots.length;
+    if (ok && count > 1) {
+        split.values = memAlloc(MEM_GENERAL, count * sizeof(double));
+        split.errors = memAlloc(MEM_GENERAL, count * sizeof(darray));
+    }
+    double result;
+    if (split.values == null || split.errors == null) {
+        // Too few tasks, or no memory for them: allocation failures are not errors of the expression.
+        clearErrors();
+        result = treeEval(tree);
+    } else {
+        for (u64 i = 0; i < count; i++) {
+            darrayInitIn(split.errors + i, 1, sizeof(Error), MEM_ERROR);
+        }
+        poolFor(count, evalTask, &split);
+        result = evalAbove(tree, &split);
+        for (u64 i = 0; i < count; i++) {
+            darrayEmpty(split.errors + i);
+        }
+    }
+    memFree(split.values);
+    memFree(split.errors);
+    darrayEmpty(&split.roots);
+    return result;
+}
+
+bool treeEvalExact(EvalNode* tree, i64* out) {
+    if (tree->kind == LBRACKET)
+        return false;
+    if (tree->kind == NUMBER) {
+        *out = tree->literal.integer;
+        return tree->literal.exact;
+    }
+    if (isVariable(tree)) {
+        Number variable = varGetNumber(tree->variable);
+        *out = variable.integer;
+        return variable.exact;
+    }
+    Opcode opcode = programOpcode(tree->function);
+    i64 args[tree->arity];
+    if (tree->lazy) {
+        // Reductions and solvers iterate over reals.
+        if (opcode != OP_AND && opcode != OP_OR && opcode != OP_SELECT)
+            return false;
+        if (!treeEvalExact(treeChild(tree, 0), args))
+            return false;
+        if (opcode == OP_SELECT)
+            return treeEvalExact(treeChild(tree, args[0] != 0 ? 1 : 2), out);
+        if ((args[0] != 0) == (opcode == OP_OR)) {
+            *out = opcode == OP_OR;
+            return true;
+        }
+        if (!treeEvalExact(treeChild(tree, 1), args + 1))
+            return false;
+        *out = args[1] != 0;
+        return true;
+    }
+    for (u64 i = 0; i < tree->arity; i++) {
+        if (!treeEvalExact(treeChild(tree, i), args + i))
+            return false;
+    }
+    return integerApply(opcode, tree->function, args, out);
+}
+
+// Dual version of evalReduction, walking the body once per index.
+// (f g)' = f' g + f g' for products.
+static void evalReductionDual(EvalNode* tree, u32 variables, double* out) {
+    u32 width = 1 + variables;
+    double first = treeEval(treeChild(tree, 1));
+    double last = treeEval(treeChild(tree, 2));
+    u32 index = treeChild(tree, 0)->variable;
+    bool sum = tree->function == SUM.ptr;
+    out[0] = sum ? 0 : 1;
+    if (getErrorCount() > 0)
+        return;
+    if (!isfinite(first) || !isfinite(last)) {
+        signalErrorNoToken(ERR_INVALID_RANGE, null, -1);
+        return;
+    }
+    double term[width];
+    double saved = varGet(index);
+    for (double i = first; i <= last && getErrorCount() == 0; i++) {
+        varSet(index, i);
+        treeEvalDual(treeChild(tree, 3), variables, term);
+        for (u32 v = 1; v < width; v++) {
+            out[v] = roundToPrecision(sum ? out[v] + term[v] : out[v] * term[0] + out[0] * term[v]);
+        }
+        out[0] = roundToPrecision(sum ? out[0] + term[0] : out[0] * term[0]);
+    }
+    // The index is bound by the reduction, the result does not depend on it.
+    varSet(index, saved);
+    if (index < variables)
+        out[1 + index] = 0;
+}
+
+// The root x of f(x, p) = 0 moves with p by dx/dp = -(df/dp) / (df/dx) (implicit function theorem).
+// Minima would need second derivatives, they are taken as constant.
+static void evalSolverDual(EvalNode* tree, u32 variables, double* out) {
+    out[0] = evalSolver(tree);
+    if (getErrorCount() > 0 || tree->function != SOLVE.ptr)
+        return;
+    u32 slot = treeChild(tree, 1)->variable;
+    u32 width = (slot < variables ? variables : slot + 1) + 1;
+    double dual[width];
+    double saved = varGet(slot);
+    varSet(slot, out[0]);
+    treeEvalDual(treeChild(tree, 0), width - 1, dual);
+    varSet(slot, saved);
+    double slope = dual[1 + slot];
+    for (u32 v = 0; v < variables; v++) {
+        if (v != slot && dual[1 + v] != 0)
+            out[1 + v] = roundToPrecision(-dual[1 + v] / slope);
+    }
+}
+
+// Dual version of evalCall, always walking the body. It is differentiated with respect to its parameters too,
+// which the chain rule turns into derivatives with respect to the variables the arguments depend on.
+static void evalCallDual(EvalNode* tree, u32 variables, double* out) {
+    const UserFunction* function = getUserFunction(tree->variable);
+    u32 width = 1 + variables;
+    double duals[tree->arity * width];
+    for (u64 i = 0; i < tree->arity; i++) {
+        treeEvalDual(treeChild(tree, i), variables, duals + i * width);
+        if (getErrorCount() > 0)
+            return;
+    }
+    if (callDepth == MAX_CALL_DEPTH) {
+        signalErrorNoToken(ERR_CALL_DEPTH, null, -1);
+        return;
+    }
+    u32 bodyVariables = variables;
+    for (u64 i = 0; i < tree->arity; i++) {
+        if (function->params[i] >= bodyVariables)
+            bodyVariables = function->params[i] + 1;
+    }
+    double body[1 + bodyVariables];
+    Number saved[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        saved[i] = varGetNumber(function->params[i]);
+        varSet(function->params[i], duals[i * width]);
+    }
+    callDepth++;
+    treeEvalDual(function->body, bodyVariables, body);
+    callDepth--;
+    for (u64 i = 0; i < tree->arity; i++) {
+        varSetNumber(function->params[i], saved[i]);
+    }
+    out[0] = body[0];
+    // The body reads the other variables directly.
+    for (u32 v = 0; v < variables; v++) {
+        out[1 + v] = body[1 + v];
+    }
+    for (u64 i = 0; i < tree->arity; i++) {
+        u32 param = function->params[i];
+        if (param < variables)
+            out[1 + param] = 0;
+    }
+    for (u64 i = 0; i < tree->arity; i++) {
+        double slope = body[1 + function->params[i]];
+        const double* d = duals + i * width;
+        for (u32 v = 1; v < width && slope != 0; v++) {
+            if (d[v] != 0)
+                out[v] = roundToPrecision(out[v] + slope * d[v]);
+        }
+    }
+}
+
+// Dual version of evalLazy. The logical operators are piecewise constant, only SELECT carries derivatives.
+static void evalLazyDual(EvalNode* tree, u32 variables, double* out) {
+    if (isReduction(tree->function)) {
+        evalReductionDual(tree, variables, out);
+        return;
+    }
+    if (isSolver(tree->function)) {
+        evalSolverDual(tree, variables, out);
+        return;
+    }
+    if (tree->function == CALL.ptr) {
+        evalCallDual(tree, variables, out);
+        return;
+    }
+    double first[1 + variables];
+    treeEvalDual(treeChild(tree, 0), variables, first);
+    if (getErrorCount() > 0)
+        return;
+    if (tree->function == SELECT.ptr) {
+        treeEvalDual(treeChild(tree, first[0] != 0 ? 1 : 2), variables, out);
+        return;
+    }
+    if (tree->function == AND.ptr)
+        out[0] = first[0] != 0 && treeEval(treeChild(tree, 1)) != 0;
+    else
+        out[0] = first[0] != 0 || treeEval(treeChild(tree, 1)) != 0;
+}
+
+void treeEvalDual(EvalNode* tree, u32 variables, double* out) {
+    u32 width = 1 + variables;
+    for (u32 v = 0; v < width; v++) {
+        out[v] = 0;
+    }
+    if (tree == null || getErrorCount() > 0)
+        return;
+    if (tree->kind == NUMBER) {
+        out[0] = tree->literal.value;
+        return;
+    }
+    if (tree->kind == LBRACKET) {
+        signalErrorNoToken(ERR_MATRIX_OPERAND, null, -1);
+        return;
+    }
+    if (isVariable(tree)) {
+        out[0] = varGet(tree->variable);
+        if (tree->variable < variables)
+            out[1 + tree->variable] = 1;
+        return;
+    }
+    if (tree->lazy) {
+        evalLazyDual(tree, variables, out);
+        return;
+    }
+
+    // duals[i * width + v]: component v of the dual number of argument i.
+    double duals[tree->arity * width];
+    double args[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        treeEvalDual(treeChild(tree, i), variables, duals + i * width);
+        if (getErrorCount() > 0)
+            return;
+        args[i] = duals[i * width];
+    }
+    double result = tree->function(args);
+    out[0] = roundToPrecision(result);
+    if (tree->partials == null)
+        return;
+
+    // Chain rule: d f(a, b...) = df/da * da + df/db * db + ...
+    double partials[tree->arity];
+    tree->partials(args, result, partials);
+    for (u64 i = 0; i < tree->arity; i++) {
+        const double* d = duals + i * width;
+        for (u32 v = 1; v < width; v++) {
+            // Skipping constant arguments keeps infinite partials (e.g. sqrt at 0) from turning into NaNs.
+            if (d[v] != 0)
+                out[v] += partials[i] * d[v];
+        }
+    }
+    for (u32 v = 1; v < width; v++) {
+        out[v] = roundToPrecision(out[v]);
+    }
+}
+
+static Complex roundComplex(Complex z) {
+    return (Complex){roundToPrecision(z.re), roundToPrecision(z.im)};
+}
+
+static bool isTrue(Complex z) {
+    return z.re != 0 || z.im != 0;
+}
+
+// Complex version of evalReductionWalk, the bounds must be real.
+static Complex evalReductionComplex(EvalNode* tree) {
+    Complex first = treeEvalComplex(treeChild(tree, 1));
+    Complex last = treeEvalComplex(treeChild(tree, 2));
+    bool sum = tree->function == SUM.ptr;
+    Complex result = {sum ? 0 : 1, 0};
+    if (getErrorCount() > 0)
+        return result;
+    if (first.im != 0 || last.im != 0) {
+        signalErrorNoToken(ERR_COMPLEX_OPERAND, null, -1);
+        return result;
+    }
+    if (!isfinite(first.re) || !isfinite(last.re)) {
+        signalErrorNoToken(ERR_INVALID_RANGE, null, -1);
+        return result;
+    }
+    u32 index = treeChild(tree, 0)->variable;
+    complexptr combine = complexFunction(sum ? ADD.ptr : MULTIPLY.ptr);
+    Number saved = varGetNumber(index);
+    double savedImaginary = varGetImaginary(index);
+    for (double i = first.re; i <= last.re && getErrorCount() == 0; i++) {
+        varSet(index, i);
+        Complex operands[2] = {result, treeEvalComplex(treeChild(tree, 3))};
+        result = roundComplex(combine(operands));
+    }
+    varSetNumber(index, saved);
+    varSetImaginary(index, savedImaginary);
+    return result;
+}
+
+// Complex version of evalCall, always walking the body.
+static Complex evalCallComplex(EvalNode* tree) {
+    const UserFunction* function = getUserFunction(tree->variable);
+    Complex args[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        args[i] = treeEvalComplex(treeChild(tree, i));
+        if (getErrorCount() > 0)
+            return (Complex){0, 0};
+    }
+    if (callDepth == MAX_CALL_DEPTH) {
+        signalErrorNoToken(ERR_CALL_DEPTH, null, -1);
+        return (Complex){0, 0};
+    }
+    Number saved[tree->arity];
+    double savedImaginary[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        saved[i] = varGetNumber(function->params[i]);
+        savedImaginary[i] = varGetImaginary(function->params[i]);
+        varSet(function->params[i], args[i].re);
+        varSetImaginary(function->params[i], args[i].im);
+    }
+    callDepth++;
+    Complex result = treeEvalComplex(function->body);
+    callDepth--;
+    for (u64 i = 0; i < tree->arity; i++) {
+        varSetNumber(function->params[i], saved[i]);
+        varSetImaginary(function->params[i], savedImaginary[i]);
+    }
+    return result;
+}
+
+// Complex version of evalLazy. Solvers work on real parts.
+static Complex evalLazyComplex(EvalNode* tree) {
+    if (isReduction(tree->function))
+        return evalReductionComplex(tree);
+    if (isSolver(tree->function))
+        return (Complex){evalSolver(tree), 0};
+    if (tree->function == CALL.ptr)
+        return evalCallComplex(tree);
+    Complex first = treeEvalComplex(treeChild(tree, 0));
+    if (getErrorCount() > 0)
+        return (Complex){0, 0};
+    if (tree->function == AND.ptr)
+        return (Complex){isTrue(first) && isTrue(treeEvalComplex(treeChild(tree, 1))), 0};
+    if (tree->function == OR.ptr)
+        return (Complex){isTrue(first) || isTrue(treeEvalComplex(treeChild(tree, 1))), 0};
+    return treeEvalComplex(treeChild(tree, isTrue(first) ? 1 : 2));
+}
+
+Complex treeEvalComplex(EvalNode* tree) {
+    if (tree == null || getErrorCount() > 0)
+        return (Complex){0, 0};
+    if (tree->kind == NUMBER)
+        return (Complex){tree->literal.value, 0};
+    if (tree->kind == LBRACKET) {
+        signalErrorNoToken(ERR_MATRIX_OPERAND, null, -1);
+        return (Complex){0, 0};
+    }
+    if (isVariable(tree))
+        return (Complex){varGet(tree->variable), varGetImaginary(tree->variable)};
+    if (tree->function == IMAGINARY.ptr)
+        return (Complex){0, 1};
+    if (tree->lazy)
+        return evalLazyComplex(tree);
+    Complex args[tree->arity];
+    bool real = true;
+    for (u64 i = 0; i < tree->arity; i++) {
+        args[i] = treeEvalComplex(treeChild(tree, i));
+        if (getErrorCount() > 0)
+            return (Complex){0, 0};
+        real &= args[i].im == 0;
+    }
+    complexptr function = complexFunction(tree->function);
+    if (function != null)
+        return roundComplex(function(args));
+    if (!real) {
+        signalErrorNoToken(ERR_COMPLEX_OPERAND, null, -1);
+        return (Complex){0, 0};
+    }
+    double values[tree->arity];
+    for (u64 i = 0; i < tree->arity; i++) {
+        values[i] = args[i].re;
+    }
+    return (Complex){roundToPrecision(tree->function(values)), 0};
 }
 
 void treeDestroy(EvalNode* tree) {
@@ -61,5 +867,7 @@ void treeDestroy(EvalNode* tree) {
         treeDestroy(child);
     }
     darrayDestroy(tree->children);
-    free(tree);
+    programDestroy(tree->program);
+    memFree(tree->big);
+    memFree(tree);
 }
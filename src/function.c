@@ -1,9 +1,199 @@
 #include "function.h"
+#include "darray.h"
 #include "error.h"
+#include "eval-tree.h"
+#include "program.h"
 
-static Function* functions;
+#include <complex.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE3__)
+#include <pmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define DEF_BUILTIN(_name, _function)                                                                                  \
+    builtins[builtinCount].name = _name;                                                                               \
+    builtins[builtinCount++].function = _function
+
+#define MAX_BUILTINS 32
+
+static Builtin builtins[MAX_BUILTINS];
+static u32 builtinCount = 0;
+static Precision precision = PRECISION_F64;
+static bool complexMode = false;
+static u32 bigPrecision = 0;
+// UserFunction*, in definition order. Entries never move, calls keep pointing at theirs.
+static darray userFunctions = {0, sizeof(UserFunction*), 0, null, MEM_TREE};
 
 void initFunctions() {
+    builtinCount = 0;
+    DEF_BUILTIN("if", SELECT);
+    DEF_BUILTIN("sqrt", SQRT);
+    DEF_BUILTIN("exp", EXP);
+    DEF_BUILTIN("log", LOG);
+    DEF_BUILTIN("sin", SIN);
+    DEF_BUILTIN("cos", COS);
+    DEF_BUILTIN("tan", TAN);
+    DEF_BUILTIN("abs", ABS);
+    DEF_BUILTIN("pow", POW);
+    DEF_BUILTIN("min", MIN);
+    DEF_BUILTIN("max", MAX);
+    DEF_BUILTIN("transpose", TRANSPOSE);
+    DEF_BUILTIN("dot", DOT);
+    DEF_BUILTIN("sum", SUM);
+    DEF_BUILTIN("prod", PROD);
+    DEF_BUILTIN("solve", SOLVE);
+    DEF_BUILTIN("minimize", MINIMIZE);
+}
+
+void setPrecision(Precision newPrecision) {
+    precision = newPrecision;
+}
+
+Precision getPrecision() {
+    return precision;
+}
+
+double roundToPrecision(double x) {
+    return precision == PRECISION_F32 ? (float)x : x;
+}
+
+void setComplexMode(bool enabled) {
+    complexMode = enabled;
+}
+
+bool isComplexMode() {
+    return complexMode;
+}
+
+void setBigPrecision(u32 digits) {
+    bigPrecision = digits;
+}
+
+u32 getBigPrecision() {
+    return bigPrecision;
+}
+
+const Builtin* getBuiltin(u32 index) {
+    return builtins + index;
+}
+
+u32 getBuiltinCount() {
+    return builtinCount;
+}
+
+bool isReduction(functionptr function) {
+    return function == SUM.ptr || function == PROD.ptr;
+}
+
+bool isSolver(functionptr function) {
+    return function == SOLVE.ptr || function == MINIMIZE.ptr;
+}
+
+i32 boundArgument(functionptr function) {
+    if (isReduction(function))
+        return 0;
+    if (isSolver(function))
+        return 1;
+    return -1;
+}
+
+bool builtinFromFunction(functionptr function, u32* outIndex) {
+    for (u32 i = 0; i < builtinCount; i++) {
+        if (builtins[i].function.ptr == function) {
+            *outIndex = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool builtinFromName(const char* str, u64 length, u32* outIndex) {
+    for (u32 i = 0; i < builtinCount; i++) {
+        const char* name = builtins[i].name;
+        u64 j = 0;
+        while (j < length && name[j] != '\0' && name[j] == str[j])
+            j++;
+        if (j == length && name[j] == '\0') {
+            *outIndex = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool userFunctionDefine(const char* name, u64 length, u32 arity, const u32* params, u32* outIndex) {
+    UserFunction* function = memAlloc(MEM_TREE, sizeof *function);
+    if (function == null)
+        return false;
+    function->name = memAlloc(MEM_STRING, length + 1);
+    if (function->name == null || !darrayAdd(&userFunctions, function)) {
+        memFree(function->name);
+        memFree(function);
+        return false;
+    }
+    memcpy(function->name, name, length);
+    function->name[length] = '\0';
+    function->arity = arity;
+    memcpy(function->params, params, arity * sizeof(u32));
+    function->body = null;
+    function->program = null;
+    function->compiled = false;
+    *outIndex = userFunctions.length - 1;
+    return true;
+}
+
+static void destroyUserFunction(UserFunction* function) {
+    if (function->body != null)
+        treeDestroy(function->body);
+    programDestroy(function->program);
+    memFree(function->name);
+    memFree(function);
+}
+
+void userFunctionUndefine() {
+    UserFunction* function;
+    if (darrayPop(&userFunctions, &function))
+        destroyUserFunction(function);
+}
+
+bool userFunctionFromName(const char* str, u64 length, u32* outIndex) {
+    for (u64 i = userFunctions.length; i > 0; i--) {
+        const char* name = getUserFunction(i - 1)->name;
+        if (strncmp(name, str, length) == 0 && name[length] == '\0') {
+            *outIndex = i - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+UserFunction* getUserFunction(u32 index) {
+    return ((UserFunction**)userFunctions.a)[index];
+}
+
+u32 getUserFunctionCount() {
+    return userFunctions.length;
+}
+
+const Program* userFunctionProgram(u32 index) {
+    UserFunction* function = getUserFunction(index);
+    // Marked first: recursive calls find no program, and fail the compilation of the body.
+    if (!function->compiled && function->body != null) {
+        function->compiled = true;
+        function->program = programCompile(function->body, function->params, function->arity);
+    }
+    return function->program;
+}
+
+void shutUserFunctions() {
+    for (u64 i = 0; i < userFunctions.length; i++) {
+        destroyUserFunction(getUserFunction(i));
+    }
+    darrayEmpty(&userFunctions);
 }
 
 double funcAdd(double* args) {
@@ -18,6 +208,10 @@ double funcMultiply(double* args) {
     return args[0] * args[1];
 }
 
+double funcNegate(double* args) {
+    return -args[0];
+}
+
 double funcDivide(double* args) {
     if (args[1] == 0) {
         signalErrorNoToken(ERR_DIV_BY_ZERO, null, -1);
@@ -26,7 +220,443 @@ double funcDivide(double* args) {
     return args[0] / args[1];
 }
 
-const Function ADD = {funcAdd, 2};
-const Function SUBTRACT = {funcSubtract, 2};
-const Function MULTIPLY = {funcMultiply, 2};
-const Function DIVIDE = {funcDivide, 2};
+// Comparisons and logical operators return 1 for true, 0 for false.
+// Any non-zero value is considered true.
+
+double funcEqual(double* args) {
+    return args[0] == args[1];
+}
+
+double funcNotEqual(double* args) {
+    return args[0] != args[1];
+}
+
+double funcLess(double* args) {
+    return args[0] < args[1];
+}
+
+double funcLessEqual(double* args) {
+    return args[0] <= args[1];
+}
+
+double funcGreater(double* args) {
+    return args[0] > args[1];
+}
+
+double funcGreaterEqual(double* args) {
+    return args[0] >= args[1];
+}
+
+// Eager versions of the lazy operators, without branches.
+
+double funcAnd(double* args) {
+    return (args[0] != 0) & (args[1] != 0);
+}
+
+double funcOr(double* args) {
+    return (args[0] != 0) | (args[1] != 0);
+}
+
+double funcNot(double* args) {
+    return args[0] == 0;
+}
+
+// Blends the bit patterns, so that infinities and NaNs in the discarded branch do not leak into the result.
+double funcSelect(double* args) {
+    union {
+        double d;
+        u64 u;
+    } a = {args[1]}, b = {args[2]}, r;
+    u64 mask = -(u64)(args[0] != 0);
+    r.u = (a.u & mask) | (b.u & ~mask);
+    return r.d;
+}
+
+// Mathematical builtins. Domain errors give NaN, as in IEEE arithmetic.
+
+double funcSqrt(double* args) {
+    return sqrt(args[0]);
+}
+
+double funcExp(double* args) {
+    return exp(args[0]);
+}
+
+double funcLog(double* args) {
+    return log(args[0]);
+}
+
+double funcSin(double* args) {
+    return sin(args[0]);
+}
+
+double funcCos(double* args) {
+    return cos(args[0]);
+}
+
+double funcTan(double* args) {
+    return tan(args[0]);
+}
+
+double funcAbs(double* args) {
+    return fabs(args[0]);
+}
+
+double funcPow(double* args) {
+    return pow(args[0], args[1]);
+}
+
+double funcMin(double* args) {
+    return args[0] <= args[1] ? args[0] : args[1];
+}
+
+double funcMax(double* args) {
+    return args[0] >= args[1] ? args[0] : args[1];
+}
+
+// On numbers, the matrix builtins are the identity and the product.
+double funcTranspose(double* args) {
+    return args[0];
+}
+
+double funcDot(double* args) {
+    return args[0] * args[1];
+}
+
+double funcSum(double* args) {
+    (void)args;
+    return NAN;
+}
+
+double funcProd(double* args) {
+    (void)args;
+    return NAN;
+}
+
+double funcSolve(double* args) {
+    (void)args;
+    return NAN;
+}
+
+double funcMinimize(double* args) {
+    (void)args;
+    return NAN;
+}
+
+double funcCall(double* args) {
+    (void)args;
+    return NAN;
+}
+
+double funcImaginary(double* args) {
+    (void)args;
+    signalErrorNoToken(ERR_COMPLEX_OPERAND, null, -1);
+    return NAN;
+}
+
+/*
+ * Complex versions, see complexptr. Complex numbers are packed in one register, the real part in the low lane,
+ * and multiplied with two products of shuffled operands: (a + bi)(c + di) = [ac, bc] -+ [bd, ad].
+ * Without fused multiply-adds, the lanes round like the scalar code: the result does not depend on the
+ * instruction set.
+ */
+#ifdef __SSE2__
+typedef __m128d Packed;
+#define pack(z) _mm_set_pd((z).im, (z).re)
+#define unpack(p) ((Complex){_mm_cvtsd_f64(p), _mm_cvtsd_f64(_mm_unpackhi_pd(p, p))})
+// [a0 - b0, a1 + b1]
+#ifdef __SSE3__
+#define packedAddSub(a, b) _mm_addsub_pd(a, b)
+#else
+#define packedAddSub(a, b) _mm_add_pd(a, _mm_xor_pd(b, _mm_set_pd(0.0, -0.0)))
+#endif
+#endif
+
+static Complex multiply(Complex z, Complex w) {
+#ifdef __SSE2__
+    Packed a = pack(z);
+    Packed b = pack(w);
+    Packed left = _mm_mul_pd(a, _mm_unpacklo_pd(b, b));
+    Packed right = _mm_mul_pd(_mm_shuffle_pd(a, a, 1), _mm_unpackhi_pd(b, b));
+    return unpack(packedAddSub(left, right));
+#else
+    return (Complex){z.re * w.re - z.im * w.im, z.im * w.re + z.re * w.im};
+#endif
+}
+
+// z / w = z conj(w) / |w|^2
+static Complex divide(Complex z, Complex w) {
+    Complex numerator = multiply(z, (Complex){w.re, -w.im});
+    double norm = w.re * w.re + w.im * w.im;
+#ifdef __SSE2__
+    return unpack(_mm_div_pd(pack(numerator), _mm_set1_pd(norm)));
+#else
+    return (Complex){numerator.re / norm, numerator.im / norm};
+#endif
+}
+
+static double complex toC99(Complex z) {
+    return CMPLX(z.re, z.im);
+}
+
+static Complex fromC99(double complex z) {
+    return (Complex){creal(z), cimag(z)};
+}
+
+static Complex complexAdd(const Complex* args) {
+#ifdef __SSE2__
+    return unpack(_mm_add_pd(pack(args[0]), pack(args[1])));
+#else
+    return (Complex){args[0].re + args[1].re, args[0].im + args[1].im};
+#endif
+}
+
+static Complex complexSubtract(const Complex* args) {
+#ifdef __SSE2__
+    return unpack(_mm_sub_pd(pack(args[0]), pack(args[1])));
+#else
+    return (Complex){args[0].re - args[1].re, args[0].im - args[1].im};
+#endif
+}
+
+static Complex complexMultiply(const Complex* args) {
+    return multiply(args[0], args[1]);
+}
+
+static Complex complexDivide(const Complex* args) {
+    if (args[1].re == 0 && args[1].im == 0) {
+        signalErrorNoToken(ERR_DIV_BY_ZERO, null, -1);
+        return (Complex){0, 0};
+    }
+    return divide(args[0], args[1]);
+}
+
+// Real numbers keep a +0 imaginary part: sqrt(-4) is 2i, not -2i, on the branch cut of sqrt and log.
+static Complex complexNegate(const Complex* args) {
+    return (Complex){-args[0].re, 0 - args[0].im};
+}
+
+static Complex complexEqual(const Complex* args) {
+    return (Complex){args[0].re == args[1].re && args[0].im == args[1].im, 0};
+}
+
+static Complex complexNotEqual(const Complex* args) {
+    return (Complex){args[0].re != args[1].re || args[0].im != args[1].im, 0};
+}
+
+static Complex complexNot(const Complex* args) {
+    return (Complex){args[0].re == 0 && args[0].im == 0, 0};
+}
+
+static Complex complexSqrt(const Complex* args) {
+    return fromC99(csqrt(toC99(args[0])));
+}
+
+static Complex complexExp(const Complex* args) {
+    return fromC99(cexp(toC99(args[0])));
+}
+
+static Complex complexLog(const Complex* args) {
+    return fromC99(clog(toC99(args[0])));
+}
+
+static Complex complexSin(const Complex* args) {
+    return fromC99(csin(toC99(args[0])));
+}
+
+static Complex complexCos(const Complex* args) {
+    return fromC99(ccos(toC99(args[0])));
+}
+
+static Complex complexTan(const Complex* args) {
+    return fromC99(ctan(toC99(args[0])));
+}
+
+static Complex complexAbs(const Complex* args) {
+    return (Complex){cabs(toC99(args[0])), 0};
+}
+
+// cpow goes through exp and log: real powers and integer exponents are computed exactly like for numbers.
+static Complex complexPow(const Complex* args) {
+    Complex base = args[0];
+    double exponent = args[1].re;
+    if (args[1].im != 0)
+        return fromC99(cpow(toC99(base), toC99(args[1])));
+    bool integer = exponent == trunc(exponent);
+    if (base.im == 0 && (base.re >= 0 || integer))
+        return (Complex){pow(base.re, exponent), 0};
+    if (!integer || fabs(exponent) > 64)
+        return fromC99(cpow(toC99(base), toC99(args[1])));
+    Complex result = {1, 0};
+    for (u32 n = fabs(exponent); n > 0; n >>= 1) {
+        if (n & 1)
+            result = multiply(result, base);
+        base = multiply(base, base);
+    }
+    return exponent < 0 ? divide((Complex){1, 0}, result) : result;
+}
+
+static Complex complexTranspose(const Complex* args) {
+    return args[0];
+}
+
+complexptr complexFunction(functionptr function) {
+    static const struct {
+        const Function* function;
+        complexptr version;
+    } table[] = {
+        {&ADD, complexAdd},       {&SUBTRACT, complexSubtract}, {&MULTIPLY, complexMultiply},
+        {&DIVIDE, complexDivide}, {&NEGATE, complexNegate},     {&EQUAL, complexEqual},
+        {&NOT_EQUAL, complexNotEqual}, {&NOT, complexNot},
+        {&SQRT, complexSqrt},     {&EXP, complexExp},           {&LOG, complexLog},
+        {&SIN, complexSin},       {&COS, complexCos},           {&TAN, complexTan},
+        {&ABS, complexAbs},       {&POW, complexPow},           {&TRANSPOSE, complexTranspose},
+        {&DOT, complexMultiply},
+    };
+    for (u64 i = 0; i < sizeof table / sizeof *table; i++) {
+        if (table[i].function->ptr == function)
+            return table[i].version;
+    }
+    return null;
+}
+
+// Derivative rules, see partialsptr.
+
+void partialsAdd(double* args, double result, double* out) {
+    (void)args;
+    (void)result;
+    out[0] = 1;
+    out[1] = 1;
+}
+
+void partialsSubtract(double* args, double result, double* out) {
+    (void)args;
+    (void)result;
+    out[0] = 1;
+    out[1] = -1;
+}
+
+void partialsNegate(double* args, double result, double* out) {
+    (void)args;
+    (void)result;
+    out[0] = -1;
+}
+
+void partialsMultiply(double* args, double result, double* out) {
+    (void)result;
+    out[0] = args[1];
+    out[1] = args[0];
+}
+
+// d(a / b) = da / b - (a / b) * db / b
+void partialsDivide(double* args, double result, double* out) {
+    out[0] = 1 / args[1];
+    out[1] = -result / args[1];
+}
+
+// Only the selected operand matters, the condition is piecewise constant.
+void partialsSelect(double* args, double result, double* out) {
+    (void)result;
+    out[0] = 0;
+    out[1] = args[0] != 0;
+    out[2] = args[0] == 0;
+}
+
+void partialsSqrt(double* args, double result, double* out) {
+    (void)args;
+    out[0] = 0.5 / result;
+}
+
+void partialsExp(double* args, double result, double* out) {
+    (void)args;
+    out[0] = result;
+}
+
+void partialsLog(double* args, double result, double* out) {
+    (void)result;
+    out[0] = 1 / args[0];
+}
+
+void partialsSin(double* args, double result, double* out) {
+    (void)result;
+    out[0] = cos(args[0]);
+}
+
+void partialsCos(double* args, double result, double* out) {
+    (void)result;
+    out[0] = -sin(args[0]);
+}
+
+void partialsTan(double* args, double result, double* out) {
+    (void)args;
+    out[0] = 1 + result * result;
+}
+
+// The derivative at 0 is taken as 0.
+void partialsAbs(double* args, double result, double* out) {
+    (void)result;
+    out[0] = (args[0] > 0) - (args[0] < 0);
+}
+
+// d(a^b) = b * a^(b-1) da + a^b * ln(a) db. The second term is only defined for a > 0,
+// it is taken as 0 otherwise so that integer powers of negative numbers keep a derivative.
+void partialsPow(double* args, double result, double* out) {
+    out[0] = args[1] == 0 ? 0 : args[1] * pow(args[0], args[1] - 1);
+    out[1] = args[0] > 0 ? result * log(args[0]) : 0;
+}
+
+void partialsMin(double* args, double result, double* out) {
+    (void)result;
+    out[0] = args[0] <= args[1];
+    out[1] = args[0] > args[1];
+}
+
+void partialsMax(double* args, double result, double* out) {
+    (void)result;
+    out[0] = args[0] >= args[1];
+    out[1] = args[0] < args[1];
+}
+
+void partialsTranspose(double* args, double result, double* out) {
+    (void)args;
+    (void)result;
+    out[0] = 1;
+}
+
+const Function ADD = {funcAdd, 2, false, partialsAdd};
+const Function SUBTRACT = {funcSubtract, 2, false, partialsSubtract};
+const Function MULTIPLY = {funcMultiply, 2, false, partialsMultiply};
+const Function DIVIDE = {funcDivide, 2, false, partialsDivide};
+const Function NEGATE = {funcNegate, 1, false, partialsNegate};
+
+const Function EQUAL = {funcEqual, 2, false, null};
+const Function NOT_EQUAL = {funcNotEqual, 2, false, null};
+const Function LESS = {funcLess, 2, false, null};
+const Function LESS_EQUAL = {funcLessEqual, 2, false, null};
+const Function GREATER = {funcGreater, 2, false, null};
+const Function GREATER_EQUAL = {funcGreaterEqual, 2, false, null};
+
+const Function AND = {funcAnd, 2, true, null};
+const Function OR = {funcOr, 2, true, null};
+const Function NOT = {funcNot, 1, false, null};
+const Function SELECT = {funcSelect, 3, true, partialsSelect};
+const Function ASSIGN = {null, 2, false, null};
+
+const Function SQRT = {funcSqrt, 1, false, partialsSqrt};
+const Function EXP = {funcExp, 1, false, partialsExp};
+const Function LOG = {funcLog, 1, false, partialsLog};
+const Function SIN = {funcSin, 1, false, partialsSin};
+const Function COS = {funcCos, 1, false, partialsCos};
+const Function TAN = {funcTan, 1, false, partialsTan};
+const Function ABS = {funcAbs, 1, false, partialsAbs};
+const Function POW = {funcPow, 2, false, partialsPow};
+const Function MIN = {funcMin, 2, false, partialsMin};
+const Function MAX = {funcMax, 2, false, partialsMax};
+const Function TRANSPOSE = {funcTranspose, 1, false, partialsTranspose};
+const Function DOT = {funcDot, 2, false, partialsMultiply};
+const Function SUM = {funcSum, 4, true, null};
+const Function PROD = {funcProd, 4, true, null};
+const Function SOLVE = {funcSolve, 4, true, null};
+const Function MINIMIZE = {funcMinimize, 4, true, null};
+const Function CALL = {funcCall, 0, true, null};
+const Function IMAGINARY = {funcImaginary, 0, false, null};
@@ -0,0 +1,274 @@
+#include "grid.h"
+#include "error.h"
+#include "interpreter.h"
+#include "program.h"
+#include "thread-pool.h"
+#include "var-handler.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Points evaluated by one task, 32 KiB of doubles: a tile stays in the cache of the core computing it.
+#define TILE_POINTS 4096
+// Tiles computed before their values are written out, bounds the memory used by large grids.
+#define BATCH_TILES 64
+
+typedef struct grid_run {
+    const Grid* grid;
+    const Program* program;
+    u64 batchStart;
+    u64 batchPoints;
+    // Under PRECISION_F32 the points are computed over float lanes, into FLOAT_VALUES instead of VALUES.
+    double* values;
+    float* floatValues;
+    u64 faultyPoints;
+} GridRun;
+
+static bool parseAxis(const char* spec, u64 length, GridAxis* axis) {
+    const char* equal = memchr(spec, '=', length);
+    if (equal == null || equal == spec)
+        return false;
+    axis->name = spec;
+    axis->nameLength = equal - spec;
+    char* end;
+    axis->low = strtod(equal + 1, &end);
+    if (*end != ':')
+        return false;
+    axis->high = strtod(end + 1, &end);
+    if (*end != ':')
+        return false;
+    axis->step = strtod(end + 1, &end);
+    if (end != spec + length)
+        return false;
+    if (!isfinite(axis->low) || !isfinite(axis->high) || !(axis->step > 0) || axis->high < axis->low)
+        return false;
+    // The tolerance keeps the upper bound when it is a multiple of the step, despite rounding.
+    double count = floor((axis->high - axis->low) / axis->step * (1 + 1e-12)) + 1;
+    if (count >= (double)(1ul << 53))
+        return false;
+    axis->count = count;
+    return true;
+}
+
+bool gridParse(const char* spec, Grid* outGrid) {
+    outGrid->dimensions = 0;
+    outGrid->points = 1;
+    while (*spec != '\0') {
+        if (outGrid->dimensions == GRID_MAX_DIMENSIONS)
+            return false;
+        const char* comma = strchr(spec, ',');
+        u64 length = comma ? (u64)(comma - spec) : strlen(spec);
+        GridAxis* axis = outGrid->axes + outGrid->dimensions;
+        if (!parseAxis(spec, length, axis))
+            return false;
+        if (axis->count > (u64)-1 / outGrid->points)
+            return false;
+        outGrid->points *= axis->count;
+        outGrid->dimensions++;
+        spec += length + (comma != null);
+    }
+    return outGrid->dimensions > 0;
+}
+
+bool gridParseFormat(const char* name, GridFormat* outFormat) {
+    static const char* names[] = {[GRID_RAW] = "raw", [GRID_PGM] = "pgm", [GRID_CSV] = "csv"};
+    for (u32 i = 0; i < sizeof names / sizeof *names; i++) {
+        if (strcmp(names[i], name) == 0) {
+            *outFormat = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Evaluates the points of one tile, row segment by row segment: along a row only the last coordinate changes.
+static void evalTile(void* arg, u64 index) {
+    GridRun* run = arg;
+    const Grid* grid = run->grid;
+    const GridAxis* last = grid->axes + grid->dimensions - 1;
+    u64 begin = index * TILE_POINTS;
+    u64 end = begin + TILE_POINTS < run->batchPoints ? begin + TILE_POINTS : run->batchPoints;
+    u64 faulty = 0;
+
+    double params[GRID_MAX_DIMENSIONS];
+    u8 faults[PROGRAM_LANES];
+    for (u64 p = begin; p < end;) {
+        u64 point = run->batchStart + p;
+        u64 column = point % last->count;
+        u64 rest = point / last->count;
+        for (u32 k = grid->dimensions - 1; k > 0; k--) {
+            const GridAxis* axis = grid->axes + k - 1;
+            params[k - 1] = axis->low + (rest % axis->count) * axis->step;
+            rest /= axis->count;
+        }
+        u64 segment = last->count - column < end - p ? last->count - column : end - p;
+        for (u64 offset = 0; offset < segment; offset += PROGRAM_LANES) {
+            u32 lanes = segment - offset < PROGRAM_LANES ? segment - offset : PROGRAM_LANES;
+            LaneRange range = {last->low, last->step, column + offset, null, null};
+            if (run->floatValues != null)
+                programRunFloat(run->program, params, &range, lanes, run->floatValues + p + offset, faults);
+            else
+                programRun(run->program, params, &range, lanes, run->values + p + offset, faults);
+            for (u32 l = 0; l < lanes; l++) {
+                if (faults[l] == 0)
+                    continue;
+                if (run->floatValues != null)
+                    run->floatValues[p + offset + l] = NAN;
+                else
+                    run->values[p + offset + l] = NAN;
+                faulty++;
+            }
+        }
+        p += segment;
+    }
+    __atomic_add_fetch(&run->faultyPoints, faulty, __ATOMIC_RELAXED);
+}
+
+static double valueAt(const GridRun* run, u64 i) {
+    return run->floatValues != null ? run->floatValues[i] : run->values[i];
+}
+
+static void writeRaw(const GridRun* run, u64 count, FILE* out) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (run->floatValues != null)
+        fwrite(run->floatValues, sizeof(float), count, out);
+    else
+        fwrite(run->values, sizeof(double), count, out);
+#else
+    for (u64 i = 0; i < count; i++) {
+        if (run->floatValues != null) {
+            u32 bits;
+            memcpy(&bits, run->floatValues + i, sizeof bits);
+            bits = __builtin_bswap32(bits);
+            fwrite(&bits, sizeof bits, 1, out);
+        } else {
+            u64 bits;
+            memcpy(&bits, run->values + i, sizeof bits);
+            bits = __builtin_bswap64(bits);
+            fwrite(&bits, sizeof bits, 1, out);
+        }
+    }
+#endif
+}
+
+static void writePgm(const GridRun* run, u64 count, FILE* out) {
+    for (u64 i = 0; i < count; i++) {
+        double value = valueAt(run, i);
+        double v = value > 0 ? (value < 1 ? value : 1) : 0; // NaN is black
+        u32 level = v * 65535 + 0.5;
+        // 16-bit samples are big-endian.
+        fputc(level >> 8, out);
+        fputc(level & 0xff, out);
+    }
+}
+
+static void writeCsv(const GridRun* run, u64 count, FILE* out) {
+    const Grid* grid = run->grid;
+    for (u64 i = 0; i < count; i++) {
+        u64 rest = run->batchStart + i;
+        double coordinates[GRID_MAX_DIMENSIONS];
+        for (u32 k = grid->dimensions; k > 0; k--) {
+            const GridAxis* axis = grid->axes + k - 1;
+            coordinates[k - 1] = axis->low + (rest % axis->count) * axis->step;
+            rest /= axis->count;
+        }
+        for (u32 k = 0; k < grid->dimensions; k++) {
+            fprintf(out, "%.17g,", coordinates[k]);
+        }
+        fprintf(out, "%.17g\n", valueAt(run, i));
+    }
+}
+
+static bool writeHeader(const Grid* grid, FILE* out, GridFormat format, FILE* errStream) {
+    switch (format) {
+    case GRID_PGM:
+        if (grid->dimensions != 2) {
+            fprintf(errStream, "PGM output needs a grid of exactly 2 dimensions.\n");
+            return false;
+        }
+        fprintf(out, "P5\n%lu %lu\n65535\n", grid->axes[1].count, grid->axes[0].count);
+        break;
+    case GRID_CSV:
+        for (u32 k = 0; k < grid->dimensions; k++) {
+            fprintf(out, "%.*s,", (int)grid->axes[k].nameLength, grid->axes[k].name);
+        }
+        fputs("value\n", out);
+        break;
+    case GRID_RAW:
+        break;
+    }
+    return true;
+}
+
+// Parses EXPRESSION, with the axes declared as variables, and compiles it with them as parameters.
+static Program* compileExpression(const Grid* grid, const char* expression, FILE* errStream) {
+    u32 slots[GRID_MAX_DIMENSIONS];
+    for (u32 k = 0; k < grid->dimensions; k++) {
+        if (!varDeclare(grid->axes[k].name, grid->axes[k].nameLength, slots + k)) {
+            fprintf(errStream, "Could not declare the grid variable '%.*s'.\n", (int)grid->axes[k].nameLength,
+                    grid->axes[k].name);
+            return null;
+        }
+    }
+    TokenStream tokens;
+    tokenStreamInit(&tokens, expression);
+    EvalNode* tree = null;
+    if (tokenize(expression, &tokens))
+        tree = parse(&tokens);
+    Program* program = null;
+    if (tree != null)
+        program = programCompile(tree, slots, grid->dimensions);
+    if (getErrorCount() > 0)
+        printErrorsTo(errStream, expression);
+    else if (program == null)
+        fprintf(errStream, "Solvers and matrices cannot be tabulated over a grid.\n");
+    if (tree != null)
+        treeDestroy(tree);
+    tokenStreamDestroy(&tokens);
+    return program;
+}
+
+bool gridRun(const Grid* grid, const char* expression, FILE* out, GridFormat format, FILE* errStream) {
+    Program* program = compileExpression(grid, expression, errStream);
+    if (program == null)
+        return false;
+    u64 batchCapacity = (u64)TILE_POINTS * BATCH_TILES;
+    bool floats = getPrecision() == PRECISION_F32;
+    void* values = memAlloc(MEM_GENERAL, batchCapacity * (floats ? sizeof(float) : sizeof(double)));
+    if (values == null || !writeHeader(grid, out, format, errStream)) {
+        if (getErrorCount() > 0)
+            printErrorsTo(errStream, expression);
+        memFree(values);
+        programDestroy(program);
+        return false;
+    }
+
+    GridRun run = {grid, program, 0, 0, floats ? null : values, floats ? values : null, 0};
+    // Nothing more is computed once OUT failed.
+    for (run.batchStart = 0; run.batchStart < grid->points && !ferror(out); run.batchStart += batchCapacity) {
+        u64 remaining = grid->points - run.batchStart;
+        run.batchPoints = remaining < batchCapacity ? remaining : batchCapacity;
+        poolFor((run.batchPoints + TILE_POINTS - 1) / TILE_POINTS, evalTile, &run);
+        switch (format) {
+        case GRID_RAW:
+            writeRaw(&run, run.batchPoints, out);
+            break;
+        case GRID_PGM:
+            writePgm(&run, run.batchPoints, out);
+            break;
+        case GRID_CSV:
+            writeCsv(&run, run.batchPoints, out);
+            break;
+        }
+    }
+    bool written = fflush(out) == 0 && !ferror(out);
+    if (!written)
+        fprintf(errStream, "Could not write the values.\n");
+    else if (run.faultyPoints > 0)
+        fprintf(errStream, "%lu of %lu points could not be computed (division by zero or invalid range), written as NaN.\n",
+                run.faultyPoints, grid->points);
+    memFree(values);
+    programDestroy(program);
+    return written;
+}
@@ -1,100 +1,224 @@
 #include "./pinterpreter.h"
+#include "block.h"
 #include "error.h"
 #include "interpreter.h"
+#include "memory.h"
 #include "util.h"
 
 #include <stdlib.h>
 
-static bool isWhitespace(char c) {
-    return c == ' ';
+// Longer numbers are reported as unknown tokens, unless the arbitrary precision mode reads them.
+#define NUMBER_MAX_LENGTH 64
+
+// Character classes, one bit each so that a run can be made of several of them.
+enum {
+    CLASS_SPACE = 1,
+    CLASS_DIGIT = 2,
+    CLASS_DOT = 4,
+    CLASS_LETTER = 8,
+    CLASS_GENERIC = 16, // single character tokens
+    CLASS_OPERATOR = 32,
+    CLASS_END = 64,
+};
+
+static u8 classOf(char c) {
+    if (c == ' ' || c == '\t' || c == '\r')
+        return CLASS_SPACE;
+    if (c >= '0' && c <= '9')
+        return CLASS_DIGIT;
+    if (c == '.')
+        return CLASS_DOT;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+        return CLASS_LETTER;
+    if (c == '\n' || c == '\0')
+        return CLASS_END;
+    return identifierFromChar(c) != _IDENTIFIER_SIZE ? CLASS_GENERIC : CLASS_OPERATOR;
 }
 
-static bool isDigit(char c) {
-    return c >= '0' && c <= '9';
+/*
+ * Runs of spaces, digits and letters are measured a whole block at a time: the block is
+ * classified with byte comparisons, and the run ends at the first zero bit of the class mask.
+ * Blocks never extend past the end of the string.
+ */
+#ifdef BLOCK_BYTES
+// Bytes of V in [LOW, LOW + SPAN]: V - LOW wraps around below LOW, and only values up to SPAN saturate to 0.
+static inline Block blockInRange(Block v, char low, char span) {
+    return blockEq(blockSubSaturate(blockSub(v, blockSet(low)), blockSet(span)), blockZero());
 }
 
-static bool endToken(Identifier id, LexerCtx* ctx) {
+// Bit i is set if byte i of the block at STR is in one of CLASSES (spaces, digits, dots and letters only).
+static inline u32 classMask(const char* str, u8 classes) {
+    Block v = blockLoad(str);
+    Block in = blockZero();
+    if (classes & CLASS_SPACE) {
+        in = blockOr(in, blockEq(v, blockSet(' ')));
+        in = blockOr(in, blockOr(blockEq(v, blockSet('\t')), blockEq(v, blockSet('\r'))));
+    }
+    if (classes & CLASS_DIGIT)
+        in = blockOr(in, blockInRange(v, '0', 9));
+    if (classes & CLASS_DOT)
+        in = blockOr(in, blockEq(v, blockSet('.')));
+    if (classes & CLASS_LETTER) {
+        // Setting bit 5 turns upper case letters into lower case ones, and no other byte into a letter.
+        Block lower = blockOr(v, blockSet(0x20));
+        in = blockOr(in, blockOr(blockInRange(lower, 'a', 25), blockEq(v, blockSet('_'))));
+    }
+    return blockMask(in);
+}
+#endif
 
-    if(builderLength(&ctx->tokenBuilder) == 0)
-        return true;
-    StringBuilder* builder = &ctx->tokenBuilder;
-    char* str = builderCreateString(builder);
-    Token t;
-    bool ok = initToken(&t, id, str, ctx->tokenPos);
-    if (!ok) {
-        signalErrorNoToken(ERR_UNKNOWN_TOKEN, str, ctx->tokenPos);
-        free(str);
+// Length of the run of characters of STR in one of CLASSES, reading at most LENGTH characters.
+static u64 runLength(const char* str, u64 length, u8 classes) {
+    u64 n = 0;
+#ifdef BLOCK_BYTES
+    const u32 full = BLOCK_BYTES == 32 ? 0xffffffffu : 0xffffu;
+    for (; n + BLOCK_BYTES <= length; n += BLOCK_BYTES) {
+        u32 mask = classMask(str + n, classes);
+        if (mask != full)
+            return n + __builtin_ctz(~mask);
+    }
+#endif
+    while (n < length && (classOf(str[n]) & classes))
+        n++;
+    return n;
+}
+
+// Digits and dots, then an optional exponent: '1.5e-3'.
+static u64 numberLength(const char* str, u64 length) {
+    u64 n = runLength(str, length, CLASS_DIGIT | CLASS_DOT);
+    if (n < length && (str[n] == 'e' || str[n] == 'E')) {
+        u64 sign = n + 1 < length && (str[n + 1] == '+' || str[n + 1] == '-');
+        u64 digits = n + 1 + sign;
+        if (digits < length && classOf(str[digits]) == CLASS_DIGIT)
+            n = digits + runLength(str + digits, length - digits, CLASS_DIGIT);
+    }
+    return n;
+}
+
+static bool pushNumber(LexerCtx* ctx, u32 offset, u32 length) {
+    // strtod would read past the end of the token (e.g. exponents), give it its own copy.
+    char small[NUMBER_MAX_LENGTH + 1];
+    char* buffer = length > NUMBER_MAX_LENGTH ? memAlloc(MEM_LEXER, length + 1) : small;
+    if (buffer == null)
         return false;
-    } else {
-        darrayAdd(ctx->tokens, t);
+    memcpy(buffer, ctx->source + offset, length);
+    buffer[length] = '\0';
+    u32 literal;
+    Number value = {getPrecision() == PRECISION_F32 ? strtof(buffer, null) : strtod(buffer, null), 0, false};
+    // Literals made of digits only are also read exactly, if they fit in 64 bits.
+    value.exact = runLength(buffer, length, CLASS_DIGIT) == length;
+    for (u32 i = 0; value.exact && i < length; i++) {
+        value.exact = !__builtin_mul_overflow(value.integer, 10, &value.integer) &&
+                      !__builtin_add_overflow(value.integer, buffer[i] - '0', &value.integer);
     }
-    builderReset(builder);
-    return true;
+    if (buffer != small)
+        memFree(buffer);
+    if (!tokenStreamAddLiteral(ctx->tokens, value, &literal))
+        return false;
+    return tokenStreamPush(ctx->tokens, NUMBER, offset, length, literal);
 }
 
-bool setCurrentId(Identifier newID, Identifier* id, LexerCtx* ctx) {
-    bool success = true;
-    if (newID == *id)
+static void unknownToken(LexerCtx* ctx, u64 offset, u64 length) {
+    char symbol[ERR_SYMBOL_MAX];
+    u64 n = length < ERR_SYMBOL_MAX ? length : ERR_SYMBOL_MAX - 1;
+    memcpy(symbol, ctx->source + offset, n);
+    symbol[n] = '\0';
+    signalErrorNoToken(ERR_UNKNOWN_TOKEN, symbol, offset);
+}
+
+// Creates the token spanning [OFFSET, OFFSET + LENGTH) of the source.
+static bool emitToken(Identifier id, LexerCtx* ctx, u64 offset, u64 length) {
+    if (length == 0 || id == _IDENTIFIER_SIZE)
         return true;
-    endToken(*id, ctx);
-    ctx->tokenPos = ctx->position;
-    *id = newID;
-    return success;
+    // Tokens built after a failed allocation would be truncated garbage.
+    if (hasErrorOfType(ERR_ALLOC_FAIL))
+        return false;
+    const char* str = ctx->source + offset;
+    bool known = true;
+    bool ok;
+    u32 builtin;
+    switch (id) {
+    case NUMBER:
+        known = length <= NUMBER_MAX_LENGTH || getBigPrecision() > 0;
+        ok = known && pushNumber(ctx, offset, length);
+        break;
+    case NAME:
+        // Whether the name is valid depends on where it is used, the parser decides.
+        if (!builtinFromName(str, length, &builtin))
+            builtin = NO_BUILTIN;
+        ok = tokenStreamPush(ctx->tokens, NAME, offset, length, builtin);
+        break;
+    default:
+        ok = tokenStreamPush(ctx->tokens, id, offset, length, 0);
+        break;
+    }
+    if (!known)
+        unknownToken(ctx, offset, length);
+    return ok;
 }
 
-bool tokenize(const char* str, darray* tokenBuffer) {
+/*
+ * Operators are matched against the symbols of the kind expected at this point, with the longest match:
+ * prefix operators where an operand should start, infix ones right after an operand. In '2*-3', '*' is infix
+ * and '-' is a negation. If no symbol of that kind matches, the other kind is tried: the parser then reports
+ * the misplaced operator. Returns the number of characters consumed.
+ */
+static u64 lexOperator(LexerCtx* ctx, u64 rest) {
+    const char* at = ctx->source + ctx->position;
+    u64 count = tokenCount(ctx->tokens);
+    Identifier last = count > 0 ? tokenKind(ctx->tokens, count - 1) : OPERATOR;
+    bool prefix = last != NUMBER && last != NAME && last != RPAREN && last != RBRACKET;
+    u32 op;
+    u64 length = operatorMatch(at, rest, prefix, &op);
+    if (length == 0)
+        length = operatorMatch(at, rest, !prefix, &op);
+    if (length == 0) {
+        unknownToken(ctx, ctx->position, 1);
+        return 1;
+    }
+    if (!hasErrorOfType(ERR_ALLOC_FAIL))
+        tokenStreamPush(ctx->tokens, OPERATOR, ctx->position, length, op);
+    return length;
+}
+
+bool tokenize(const char* str, TokenStream* tokens) {
     LexerCtx ctx;
     ctx.position = 0;
-    ctx.tokenPos = 0;
-    initBuilder(&ctx.tokenBuilder);
-    ctx.tokens = tokenBuffer;
+    ctx.source = str;
+    ctx.tokens = tokens;
+    tokens->source = str;
 
-    char c;
+    // Each iteration consumes a whole token, or a whole run of whitespace.
     u64 len = strlen(str);
-    // The currentId keeps track of the type of the current token we are building
-    // We build a token by adding its characters, and then creating the token
-    // when we change token types
-    Identifier currentId = _IDENTIFIER_SIZE;
-    for (ctx.position = 0; ctx.position < len; ctx.position++) {
-        c = str[ctx.position];
-        if (c == '\n')
+    while (ctx.position < len && !hasErrorOfType(ERR_ALLOC_FAIL)) {
+        const char* at = str + ctx.position;
+        u64 rest = len - ctx.position;
+        u64 length;
+        switch (classOf(*at)) {
+        case CLASS_END:
+            return getErrorCount() == 0;
+        case CLASS_SPACE:
+            length = runLength(at, rest, CLASS_SPACE);
+            break;
+        case CLASS_GENERIC:
+            // Single character tokens: parentheses, statement separators...
+            length = 1;
+            emitToken(identifierFromChar(*at), &ctx, ctx.position, length);
+            break;
+        case CLASS_LETTER:
+            length = runLength(at, rest, CLASS_LETTER | CLASS_DIGIT);
+            emitToken(NAME, &ctx, ctx.position, length);
+            break;
+        case CLASS_DIGIT:
+        case CLASS_DOT:
+            length = numberLength(at, rest);
+            emitToken(NUMBER, &ctx, ctx.position, length);
+            break;
+        default:
+            length = lexOperator(&ctx, rest);
             break;
-
-        if (isWhitespace(c)) {
-            setCurrentId(_IDENTIFIER_SIZE, &currentId, &ctx);
-            continue;
-        }
-
-        if (c == '(') {
-            setCurrentId(LPAREN, &currentId, &ctx);
-            builderAppendc(&ctx.tokenBuilder, c);
-            endToken(currentId, &ctx);
-            continue;
-        }
-
-        if (c == ')') {
-            setCurrentId(RPAREN, &currentId, &ctx);
-            builderAppendc(&ctx.tokenBuilder, c);
-            endToken(currentId, &ctx);
-            continue;
-        }
-
-        if (isDigit(c) || c == '.') {
-            setCurrentId(NUMBER, &currentId, &ctx);
-            builderAppendc(&ctx.tokenBuilder, c);
-            continue;
-        }
-
-        if (isGeneric(getIdentifier(builderStringRef(&ctx.tokenBuilder)))) {
-            // builderDeleteAt(tokenBuilder, builderLength(tokenBuilder) - 1);
-            setCurrentId(_IDENTIFIER_SIZE, &currentId, &ctx);
-            continue;
         }
-
-        setCurrentId(OPERATOR, &currentId, &ctx);
-        builderAppendc(&ctx.tokenBuilder, c);
+        ctx.position += length;
     }
-    endToken(currentId, &ctx);
-    free(ctx.tokenBuilder.a);
     return getErrorCount() == 0;
 }
@@ -1,11 +1,24 @@
+#include "bignum.h"
+#include "bytecode.h"
+#include "columns.h"
 #include "context.h"
 #include "darray.h"
 #include "interpreter.h"
+#include "matrix.h"
 #include "string-builder.h"
 #include "token.h"
 #include "error.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "share.h"
+#include "thread-pool.h"
+#include "tier.h"
+#include "var-handler.h"
+#include "watch.h"
 
 #include <err.h>
+#include <getopt.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,9 +26,35 @@
 
 static Context context;
 
+static const struct option longOptions[] = {
+    {"verbose", no_argument, null, 'v'},
+    {"mem-cap", required_argument, null, 'm'},
+    {"mem-stats", no_argument, null, 's'},
+    {"pipeline", optional_argument, null, 'p'},
+    {"precision", required_argument, null, 'P'},
+    {"gradient", no_argument, null, 'g'},
+    {"complex", no_argument, null, 'z'},
+    {"threads", required_argument, null, 'j'},
+    {"grid", required_argument, null, 'G'},
+    {"columns", required_argument, null, 'c'},
+    {"format", required_argument, null, 'f'},
+    {"output", required_argument, null, 'o'},
+    {"emit", required_argument, null, 'E'},
+    {"load", required_argument, null, 'L'},
+    {"cache", required_argument, null, 'C'},
+    {"watch", required_argument, null, 'w'},
+    {"operators", required_argument, null, 'O'},
+    {"share", optional_argument, null, 'S'},
+    {"tier", optional_argument, null, 'T'},
+    {0, 0, 0, 0},
+};
+
 void handleOptions(int argc, char **argv) {
     int r;
-    while ((r = getopt(argc, argv, "v")) != -1) {
+    u64 bytes;
+    char* end;
+    bool gradient = false;
+    while ((r = getopt_long(argc, argv, "vm:sp::P:gzj:G:c:f:o:E:L:C:w:O:S::T::", longOptions, null)) != -1) {
         char c = r;
         if (c == '?') {
             err(ERRCODE_UNKNOWN_OPTION, "Unknown option '%c%c'.", '-', optopt);
@@ -23,8 +62,217 @@ void handleOptions(int argc, char **argv) {
         switch (c) {
         case 'v':
             context.verbose = 1;
+            break;
+        case 'm':
+            if (!memParseSize(optarg, &bytes))
+                errx(ERRCODE_UNKNOWN_OPTION, "Invalid memory cap '%s'.", optarg);
+            memSetCap(bytes);
+            break;
+        case 's':
+            context.memStats = 1;
+            break;
+        case 'p':
+            context.pipelineDepth = PIPELINE_DEFAULT_DEPTH;
+            if (optarg && ((context.pipelineDepth = strtoul(optarg, &end, 10)) == 0 ||
+                           context.pipelineDepth > PIPELINE_MAX_DEPTH || *end != '\0'))
+                errx(ERRCODE_UNKNOWN_OPTION, "Invalid pipeline depth '%s'.", optarg);
+            break;
+        case 'P':
+            if (strcmp(optarg, "f64") == 0)
+                setPrecision(PRECISION_F64);
+            else if (strcmp(optarg, "f32") == 0)
+                setPrecision(PRECISION_F32);
+            else if ((bytes = strtoul(optarg, &end, 10)) > 0 && bytes <= BIG_MAX_DIGITS && *end == '\0')
+                setBigPrecision(bytes);
+            else
+                errx(ERRCODE_UNKNOWN_OPTION, "Invalid precision '%s', expected 'f32', 'f64' or a number of digits.",
+                     optarg);
+            break;
+        case 'g':
+            setGradient(true);
+            gradient = true;
+            break;
+        case 'z':
+            setComplexMode(true);
+            break;
+        case 'j':
+            if ((bytes = strtoul(optarg, &end, 10)) == 0 || bytes > 1024 || *end != '\0')
+                errx(ERRCODE_UNKNOWN_OPTION, "Invalid thread count '%s'.", optarg);
+            context.threads = bytes;
+            break;
+        case 'G':
+            if (!gridParse(optarg, &context.grid))
+                errx(ERRCODE_UNKNOWN_OPTION, "Invalid grid '%s', expected e.g. 'x=0:1:1e-3,y=0:1:1e-3'.", optarg);
+            context.gridMode = 1;
+            break;
+        case 'c':
+            context.columns = optarg;
+            break;
+        case 'f':
+            if (!gridParseFormat(optarg, &context.gridFormat))
+                errx(ERRCODE_UNKNOWN_OPTION, "Invalid output format '%s', expected 'raw', 'pgm' or 'csv'.", optarg);
+            break;
+        case 'o':
+            context.output = optarg;
+            break;
+        case 'E':
+            context.emit = optarg;
+            break;
+        case 'L':
+            context.load = optarg;
+            break;
+        case 'C':
+            context.cacheDir = optarg;
+            break;
+        case 'w':
+            context.watch = optarg;
+            break;
+        case 'O':
+            context.operators = optarg;
+            break;
+        case 'S':
+            context.shareBudget = SHARE_DEFAULT_BUDGET;
+            if (optarg && (!memParseSize(optarg, &context.shareBudget) || context.shareBudget < shareMinBudget()))
+                errx(ERRCODE_UNKNOWN_OPTION, "Invalid sharing budget '%s'.", optarg);
+            break;
+        case 'T':
+            context.tierThreshold = TIER_DEFAULT_THRESHOLD;
+            if (optarg && ((bytes = strtoul(optarg, &end, 10)) == 0 || bytes > UINT32_MAX || *end != '\0'))
+                errx(ERRCODE_UNKNOWN_OPTION, "Invalid hotness threshold '%s'.", optarg);
+            if (optarg)
+                context.tierThreshold = bytes;
+            break;
         }
     }
+    if (context.gridMode && context.columns)
+        errx(ERRCODE_UNKNOWN_OPTION, "'--grid' and '--columns' cannot be used together.");
+    if (gradient && (context.emit || context.load || context.cacheDir || context.watch))
+        errx(ERRCODE_UNKNOWN_OPTION, "Compiled modules do not compute gradients, '--gradient' needs the interpreter.");
+    if (isComplexMode() && (gradient || context.emit || context.load || context.gridMode || context.columns))
+        errx(ERRCODE_UNKNOWN_OPTION, "'--complex' only works with the interpreter, without '--gradient'.");
+    if (getBigPrecision() > 0 && (gradient || isComplexMode() || context.emit || context.load || context.cacheDir ||
+                                  context.gridMode || context.columns))
+        errx(ERRCODE_UNKNOWN_OPTION, "Arbitrary precision only works with the interpreter, in real numbers.");
+    if (context.tierThreshold > 0 && (gradient || isComplexMode() || getBigPrecision() > 0 || context.shareBudget > 0))
+        errx(ERRCODE_UNKNOWN_OPTION, "'--tier' compiles statements to programs over real numbers, without sharing.");
+}
+
+// Lines before the last one are evaluated normally, e.g. to assign constants, only their errors are reported.
+// Returns the last line, the expression to tabulate, null if there is none.
+static char* readTabulated(darray* results) {
+    char* line = null;
+    char* expression = null;
+    u64 size = 0;
+    while (getline(&line, &size, stdin) > 0) {
+        if (expression != null) {
+            evaluate(expression, results);
+            for (u64 i = 0; i < darrayLength(results); i++) {
+                StatementResult* result = darrayGetPtr(results, i);
+                fwrite(result->errors, 1, result->errorsLength, stderr);
+            }
+            clearResults(results);
+            free(expression);
+        }
+        expression = line;
+        line = null;
+        size = 0;
+    }
+    free(line);
+    if (expression == null)
+        warnx("No expression to tabulate.");
+    return expression;
+}
+
+// The last line of the standard input is the expression tabulated over the grid.
+static bool runGridMode(darray* results) {
+    char* expression = readTabulated(results);
+    if (expression == null)
+        return false;
+    FILE* out = context.output ? fopen(context.output, "wb") : stdout;
+    bool success = false;
+    if (out == null)
+        warn("Could not open '%s'", context.output);
+    else
+        success = gridRun(&context.grid, expression, out, context.gridFormat, stderr);
+    if (out != null && out != stdout && fclose(out) != 0 && success) {
+        warn("Could not write '%s'", context.output);
+        success = false;
+    }
+    free(expression);
+    return success;
+}
+
+// The last line of the standard input is the expression evaluated for every row of the table.
+static bool runColumnsMode(darray* results) {
+    Table table;
+    if (!tableOpen(context.columns, &table, stderr))
+        return false;
+    char* expression = readTabulated(results);
+    FILE* out = null;
+    if (expression != null)
+        out = context.output ? fopen(context.output, "wb") : stdout;
+    bool success = false;
+    if (expression != null && out == null)
+        warn("Could not open '%s'", context.output);
+    else if (out != null)
+        success = columnsRun(&table, expression, out, stderr);
+    if (out != null && out != stdout && fclose(out) != 0 && success) {
+        warn("Could not write '%s'", context.output);
+        success = false;
+    }
+    free(expression);
+    tableClose(&table);
+    return success;
+}
+
+// Compiles every line of the standard input into a single module, nothing is evaluated.
+static bool runEmitMode() {
+    Module module;
+    moduleInit(&module);
+    char* line = null;
+    u64 size = 0;
+    u64 number = 0;
+    bool success = true;
+    while (success && getline(&line, &size, stdin) > 0) {
+        number++;
+        if (moduleCompileLine(&module, line))
+            continue;
+        success = false;
+        if (getErrorCount() > 0) {
+            fprintf(stderr, "Line %lu:\n", number);
+            printErrorsTo(stderr, line);
+        } else {
+            warnx("Line %lu cannot be compiled: solvers, matrices and user functions are only run by the interpreter.", number);
+        }
+    }
+    free(line);
+    if (success) {
+        FILE* out = fopen(context.emit, "wb");
+        success = out != null && moduleWrite(&module, null, 0, out);
+        success = (out == null || fclose(out) == 0) && success;
+        if (!success)
+            warn("Could not write the module '%s'", context.emit);
+    }
+    moduleDestroy(&module);
+    return success;
+}
+
+// Runs the lines of a module, printing their results like the REPL does.
+static bool runLoadMode(darray* results) {
+    Module module;
+    moduleInit(&module);
+    if (!moduleLoad(context.load, &module, null)) {
+        warnx("Could not load '%s': not a module of this version or precision.", context.load);
+        moduleDestroy(&module);
+        return false;
+    }
+    for (u64 i = 0; i < moduleLineCount(&module); i++) {
+        moduleEvaluateLine(&module, i, results);
+        printResults(stdout, stderr, results);
+        clearResults(results);
+    }
+    moduleDestroy(&module);
+    return true;
 }
 
 int main(int argc, char **argv) {
@@ -35,35 +283,93 @@ int main(int argc, char **argv) {
 
     initTokens();
     initOperators();
+    initFunctions();
+    if (context.operators && !loadOperators(context.operators, stderr))
+        errx(ERRCODE_UNKNOWN_OPTION, "Invalid operator file '%s'.", context.operators);
+    initVariables();
+    if (!initThreadPool(context.threads))
+        warnx("Could not start the thread pool, evaluating on a single thread.");
+    if (context.shareBudget > 0 && !initShare(context.shareBudget))
+        warnx("Could not allocate %lu bytes for shared subexpressions, evaluating without sharing.", context.shareBudget);
+    if (context.tierThreshold > 0 && !initTier(context.tierThreshold))
+        warnx("Could not start the compiler thread, evaluating without tiering.");
 
     char *line = null;
     u64 size;
+    int status = 0;
+    darray results;
+    initResults(&results);
+    if (context.gridMode) {
+        status = runGridMode(&results) ? 0 : ERRCODE_GENERAL;
+        goto end;
+    }
+    if (context.columns) {
+        status = runColumnsMode(&results) ? 0 : ERRCODE_GENERAL;
+        goto end;
+    }
+    if (context.emit) {
+        status = runEmitMode() ? 0 : ERRCODE_GENERAL;
+        goto end;
+    }
+    if (context.load) {
+        status = runLoadMode(&results) ? 0 : ERRCODE_GENERAL;
+        goto end;
+    }
+    if (context.watch) {
+        status = watchRun(context.watch, stdout, stderr) ? 0 : ERRCODE_GENERAL;
+        goto end;
+    }
+    // The cache is only used by the serial loop.
+    if (context.pipelineDepth > 0 && !context.verbose && !context.cacheDir) {
+        if (!runPipeline(stdin, stdout, stderr, context.pipelineDepth))
+            warnx("Could not start the pipeline, falling back to serial evaluation.");
+        else
+            goto end;
+    }
     while (getline(&line, &size, stdin) > 0) {
 
         if (context.verbose) {
             
         } else {
-            double result;
-            bool ok = evaluate(line, &result);
-            if (!ok) {
-                puts("\e[31mFailed to compute result.\e[0m");
-            } else {
-                printf("\e[32m=> %g\e[0m\n\n", result);
-            }
+            if (context.cacheDir)
+                evaluateCached(context.cacheDir, line, &results);
+            else
+                evaluate(line, &results);
+            printResults(stdout, stderr, &results);
+            clearResults(&results);
         }
     }
+end:
+    darrayEmpty(&results);
     free(line);
+    shutThreadPool();
+    shutShare();
+    if (isTierEnabled())
+        tierPrintStats(stderr);
+    shutTier();
+    shutUserFunctions();
+    shutVariables();
+    shutMatrices();
+    shutBig();
     shutTokens();
     shutErrorSystem();
-    return 0;
+    if (context.memStats)
+        memPrintStats();
+    return status;
 }
 
-void darrayPrintTokenPtr(darray *array) {
-    Token* t;
-    for (u64 i = 0; i < darrayLength(array); i++) {
-        t = darrayGetPtr(array, i);
-        printf("{id=%i, symbol='%s', value={number=%g, op={priority=%i, rightAssoc=%i}}, func={ptr=%p, arity=%u}",
-               t->identifier, t->symbol, t->value.number, t->value.operator.priority ,t->value.operator.rightAssociative, t->function.ptr, t->function.arity);
-        putchar('\n');
+void printTokenStream(TokenStream *tokens) {
+    for (u64 i = 0; i < tokenCount(tokens); i++) {
+        Identifier id = tokenKind(tokens, i);
+        printf("{id=%i, symbol='%.*s', offset=%u, payload=%u", id, (int)tokenLength(tokens, i),
+               tokens->source + tokenOffset(tokens, i), tokenOffset(tokens, i), tokenPayload(tokens, i));
+        if (id == NUMBER) {
+            printf(", number=%g", tokenNumber(tokens, i));
+        } else if (id == OPERATOR) {
+            const OperatorDesc* op = tokenOperator(tokens, i);
+            printf(", op={priority=%i, rightAssoc=%i}, func={ptr=%p, arity=%u}", op->operator.priority,
+                   op->operator.rightAssociative, op->function.ptr, op->function.arity);
+        }
+        puts("}");
     }
 }
@@ -0,0 +1,350 @@
+#include "matrix.h"
+#include "error.h"
+#include "memory.h"
+#include "var-handler.h"
+
+#include <string.h>
+
+// Matrices kept for reuse, per size class, by each thread.
+#define POOL_CLASSES 29
+#define POOL_DEPTH 4
+// Tile of the product: the rows of A and of B it reads stay in the cache while they are used.
+#define BLOCK_ROWS 64
+#define BLOCK_INNER 128
+#define BLOCK_COLUMNS 256
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define LANES 4
+typedef __m256d Lanes;
+#define lanesLoad(p) _mm256_loadu_pd(p)
+#define lanesStore(p, v) _mm256_storeu_pd(p, v)
+#define lanesSet(x) _mm256_set1_pd(x)
+#define lanesAdd(a, b) _mm256_add_pd(a, b)
+#define lanesMul(a, b) _mm256_mul_pd(a, b)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LANES 2
+typedef __m128d Lanes;
+#define lanesLoad(p) _mm_loadu_pd(p)
+#define lanesStore(p, v) _mm_storeu_pd(p, v)
+#define lanesSet(x) _mm_set1_pd(x)
+#define lanesAdd(a, b) _mm_add_pd(a, b)
+#define lanesMul(a, b) _mm_mul_pd(a, b)
+#endif
+
+static __thread Matrix* pool[POOL_CLASSES][POOL_DEPTH];
+static __thread u32 pooled[POOL_CLASSES];
+
+Matrix* matrixCreate(u32 rows, u32 columns) {
+    u64 count = (u64)rows * columns;
+    if (count == 0 || count > MATRIX_MAX_ELEMENTS) {
+        signalErrorNoToken(ERR_ALLOC_FAIL, null, -1);
+        return null;
+    }
+    u32 sizeClass = 0;
+    while ((1ul << sizeClass) < count)
+        sizeClass++;
+    Matrix* matrix;
+    if (pooled[sizeClass] > 0)
+        matrix = pool[sizeClass][--pooled[sizeClass]];
+    else
+        matrix = memAlloc(MEM_MATRIX, sizeof(Matrix) + (sizeof(double) << sizeClass));
+    if (matrix == null)
+        return null;
+    matrix->rows = rows;
+    matrix->columns = columns;
+    matrix->sizeClass = sizeClass;
+    matrix->data = (double*)(matrix + 1);
+    return matrix;
+}
+
+Matrix* matrixCopy(const Matrix* matrix) {
+    Matrix* copy = matrixCreate(matrix->rows, matrix->columns);
+    if (copy != null)
+        memcpy(copy->data, matrix->data, (u64)matrix->rows * matrix->columns * sizeof(double));
+    return copy;
+}
+
+void matrixDestroy(Matrix* matrix) {
+    if (matrix == null)
+        return;
+    if (pooled[matrix->sizeClass] < POOL_DEPTH)
+        pool[matrix->sizeClass][pooled[matrix->sizeClass]++] = matrix;
+    else
+        memFree(matrix);
+}
+
+void shutMatrices() {
+    for (u32 c = 0; c < POOL_CLASSES; c++) {
+        while (pooled[c] > 0)
+            memFree(pool[c][--pooled[c]]);
+    }
+}
+
+// ROW[j] += X * B[j] for j in [0, COUNT). The lanes do the same operations as the scalar loop,
+// in the same order, so the result does not depend on the instruction set.
+static void addScaledRow(double* restrict row, double x, const double* restrict b, u32 count) {
+    u32 j = 0;
+#ifdef LANES
+    Lanes scale = lanesSet(x);
+    for (; j + LANES <= count; j += LANES) {
+        lanesStore(row + j, lanesAdd(lanesLoad(row + j), lanesMul(scale, lanesLoad(b + j))));
+    }
+#endif
+    for (; j < count; j++) {
+        row[j] += x * b[j];
+    }
+}
+
+/*
+ * Blocked i-k-j product: a tile of OUT is updated with a row of A times a row of B at a time,
+ * the innermost loop running along rows of B and OUT. Every element still receives its terms in
+ * the order of the inner index, as with the naive triple loop.
+ */
+void matrixMultiply(const Matrix* a, const Matrix* b, Matrix* out) {
+    u32 n = a->rows;
+    u32 inner = a->columns;
+    u32 m = b->columns;
+    memset(out->data, 0, (u64)n * m * sizeof(double));
+    for (u32 i0 = 0; i0 < n; i0 += BLOCK_ROWS) {
+        u32 i1 = i0 + BLOCK_ROWS < n ? i0 + BLOCK_ROWS : n;
+        for (u32 k0 = 0; k0 < inner; k0 += BLOCK_INNER) {
+            u32 k1 = k0 + BLOCK_INNER < inner ? k0 + BLOCK_INNER : inner;
+            for (u32 j0 = 0; j0 < m; j0 += BLOCK_COLUMNS) {
+                u32 width = j0 + BLOCK_COLUMNS < m ? BLOCK_COLUMNS : m - j0;
+                for (u32 i = i0; i < i1; i++) {
+                    for (u32 k = k0; k < k1; k++) {
+                        addScaledRow(out->data + (u64)i * m + j0, a->data[(u64)i * inner + k],
+                                     b->data + (u64)k * m + j0, width);
+                    }
+                }
+            }
+        }
+    }
+    for (u64 e = 0; e < (u64)n * m; e++) {
+        out->data[e] = roundToPrecision(out->data[e]);
+    }
+}
+
+void matrixPrint(FILE* stream, const Matrix* matrix) {
+    fputc('[', stream);
+    for (u32 i = 0; i < matrix->rows; i++) {
+        for (u32 j = 0; j < matrix->columns; j++) {
+            fprintf(stream, "%s%g", j > 0 ? ", " : i > 0 ? "; " : "", matrix->data[(u64)i * matrix->columns + j]);
+        }
+    }
+    fputc(']', stream);
+}
+
+static bool isVariable(EvalNode* tree) {
+    return tree->kind == NAME && tree->function == null;
+}
+
+bool treeHasMatrices(EvalNode* tree) {
+    if (tree->kind == LBRACKET || (isVariable(tree) && varMatrix(tree->variable) != null))
+        return true;
+    for (u64 i = 0; i < tree->arity; i++) {
+        if (treeHasMatrices(treeChild(tree, i)))
+            return true;
+    }
+    return false;
+}
+
+/* ----- Evaluation ----- */
+
+// A number, or a matrix: either borrowed from a variable, or owned by the evaluation.
+typedef struct value {
+    Matrix* matrix;
+    bool owned;
+    double number;
+} Value;
+
+static void release(Value* value) {
+    if (value->owned)
+        matrixDestroy(value->matrix);
+}
+
+static u64 elementCount(const Matrix* matrix) {
+    return (u64)matrix->rows * matrix->columns;
+}
+
+static bool sameShape(const Matrix* a, const Matrix* b) {
+    return a->rows == b->rows && a->columns == b->columns;
+}
+
+static bool evalValue(EvalNode* tree, Value* out);
+
+static bool evalNumber(EvalNode* tree, double* out) {
+    Value value;
+    if (!evalValue(tree, &value))
+        return false;
+    if (value.matrix != null) {
+        release(&value);
+        signalErrorNoToken(ERR_MATRIX_OPERAND, null, -1);
+        return false;
+    }
+    *out = value.number;
+    return true;
+}
+
+static bool evalLiteral(EvalNode* tree, Value* out) {
+    Matrix* matrix = matrixCreate(tree->rows, tree->arity / tree->rows);
+    if (matrix == null)
+        return false;
+    for (u64 i = 0; i < tree->arity; i++) {
+        if (!evalNumber(treeChild(tree, i), matrix->data + i)) {
+            matrixDestroy(matrix);
+            return false;
+        }
+    }
+    *out = (Value){matrix, true, 0};
+    return true;
+}
+
+static bool transpose(Value* arg, Value* out) {
+    const Matrix* m = arg->matrix;
+    Matrix* result = matrixCreate(m->columns, m->rows);
+    if (result == null)
+        return false;
+    for (u32 i = 0; i < m->rows; i++) {
+        for (u32 j = 0; j < m->columns; j++) {
+            result->data[(u64)j * m->rows + i] = m->data[(u64)i * m->columns + j];
+        }
+    }
+    *out = (Value){result, true, 0};
+    return true;
+}
+
+static bool dot(Value* args, Value* out) {
+    if (args[0].matrix == null && args[1].matrix == null) {
+        *out = (Value){null, false, roundToPrecision(args[0].number * args[1].number)};
+        return true;
+    }
+    if (args[0].matrix == null || args[1].matrix == null ||
+        elementCount(args[0].matrix) != elementCount(args[1].matrix)) {
+        signalErrorNoToken(ERR_MATRIX_SHAPE, null, -1);
+        return false;
+    }
+    double sum = 0;
+    for (u64 e = 0; e < elementCount(args[0].matrix); e++) {
+        sum += args[0].matrix->data[e] * args[1].matrix->data[e];
+    }
+    *out = (Value){null, false, roundToPrecision(sum)};
+    return true;
+}
+
+static bool multiply(Value* args, Value* out) {
+    const Matrix* a = args[0].matrix;
+    const Matrix* b = args[1].matrix;
+    if (a->columns != b->rows) {
+        signalErrorNoToken(ERR_MATRIX_SHAPE, null, -1);
+        return false;
+    }
+    Matrix* result = matrixCreate(a->rows, b->columns);
+    if (result == null)
+        return false;
+    matrixMultiply(a, b, result);
+    *out = (Value){result, true, 0};
+    return true;
+}
+
+// FUNCTION applied to each element, numbers standing for all elements. The result is written over
+// an operand of the evaluation if there is one, instead of a new matrix.
+static bool elementWise(functionptr function, Value* args, u32 arity, Value* out) {
+    const Matrix* shape = null;
+    i32 reused = -1;
+    for (u32 i = 0; i < arity; i++) {
+        if (args[i].matrix == null)
+            continue;
+        if (shape != null && !sameShape(shape, args[i].matrix)) {
+            signalErrorNoToken(ERR_MATRIX_SHAPE, null, -1);
+            return false;
+        }
+        shape = args[i].matrix;
+        if (reused < 0 && args[i].owned)
+            reused = i;
+    }
+    double operands[arity];
+    // Conditionals may have selected numbers only.
+    if (shape == null) {
+        for (u32 i = 0; i < arity; i++) {
+            operands[i] = args[i].number;
+        }
+        *out = (Value){null, false, roundToPrecision(function(operands))};
+        return true;
+    }
+    Matrix* result = reused >= 0 ? args[reused].matrix : matrixCreate(shape->rows, shape->columns);
+    if (result == null)
+        return false;
+    for (u64 e = 0; e < elementCount(shape) && getErrorCount() == 0; e++) {
+        for (u32 i = 0; i < arity; i++) {
+            operands[i] = args[i].matrix != null ? args[i].matrix->data[e] : args[i].number;
+        }
+        result->data[e] = roundToPrecision(function(operands));
+    }
+    if (reused >= 0)
+        args[reused].owned = false;
+    *out = (Value){result, true, 0};
+    return true;
+}
+
+static bool evalValue(EvalNode* tree, Value* out) {
+    *out = (Value){null, false, 0};
+    if (getErrorCount() > 0)
+        return false;
+    if (tree->kind == LBRACKET)
+        return evalLiteral(tree, out);
+    if (isVariable(tree)) {
+        out->matrix = varMatrix(tree->variable);
+        out->number = varGet(tree->variable);
+        return true;
+    }
+    if (tree->kind == NUMBER || !treeHasMatrices(tree)) {
+        out->number = treeEval(tree);
+        return getErrorCount() == 0;
+    }
+    if (tree->function == SELECT.ptr) {
+        double condition;
+        return evalNumber(treeChild(tree, 0), &condition) && evalValue(treeChild(tree, condition != 0 ? 1 : 2), out);
+    }
+    if (tree->lazy) {
+        signalErrorNoToken(ERR_MATRIX_OPERAND, null, -1);
+        return false;
+    }
+    Value args[tree->arity];
+    u32 evaluated = 0;
+    bool ok = true;
+    for (; ok && evaluated < tree->arity; evaluated++) {
+        ok = evalValue(treeChild(tree, evaluated), args + evaluated);
+    }
+    if (ok) {
+        if (tree->function == DOT.ptr)
+            ok = dot(args, out);
+        else if (tree->function == TRANSPOSE.ptr && args[0].matrix != null)
+            ok = transpose(args, out);
+        else if (tree->function == MULTIPLY.ptr && args[0].matrix != null && args[1].matrix != null)
+            ok = multiply(args, out);
+        else
+            ok = elementWise(tree->function, args, tree->arity, out);
+    }
+    for (u32 i = 0; i < evaluated; i++) {
+        release(args + i);
+    }
+    if (ok && getErrorCount() > 0) {
+        release(out);
+        ok = false;
+    }
+    return ok;
+}
+
+Matrix* treeEvalMatrix(EvalNode* tree, double* outValue) {
+    Value value;
+    if (!evalValue(tree, &value))
+        return null;
+    if (value.matrix == null) {
+        *outValue = value.number;
+        return null;
+    }
+    return value.owned ? value.matrix : matrixCopy(value.matrix);
+}
@@ -0,0 +1,265 @@
+#include "memory.h"
+#include "error.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BLOCK_MAGIC 0x7a7f11e5
+
+// Prepended to every block, 16 bytes so that the user pointer keeps malloc's alignment.
+typedef struct block_header {
+    u64 size;
+    u32 subsystem;
+    u32 magic;
+} BlockHeader;
+
+typedef struct bytes {
+    u64 live;
+    u64 peak;
+} Bytes;
+
+typedef struct counters {
+    u64 allocations;
+    u64 frees;
+    u64 failures;
+} Counters;
+
+static void* defaultAlloc(u64 size, void* userData) {
+    (void)userData;
+    return malloc(size);
+}
+
+static void* defaultRealloc(void* ptr, u64 oldSize, u64 newSize, void* userData) {
+    (void)oldSize;
+    (void)userData;
+    return realloc(ptr, newSize);
+}
+
+static void defaultFree(void* ptr, u64 size, void* userData) {
+    (void)size;
+    (void)userData;
+    free(ptr);
+}
+
+static const Allocator DEFAULT_ALLOCATOR = {defaultAlloc, defaultRealloc, defaultFree, null};
+static Allocator backend = {defaultAlloc, defaultRealloc, defaultFree, null};
+
+static const char* subsystemNames[_MEM_SUBSYSTEM_SIZE] = {
+    [MEM_GENERAL] = "general", [MEM_DARRAY] = "darray", [MEM_STRING] = "string",
+    [MEM_TREE] = "tree",       [MEM_LEXER] = "lexer",   [MEM_ERROR] = "error",
+    [MEM_PROGRAM] = "program", [MEM_MATRIX] = "matrix", [MEM_SHARE] = "share",
+    [MEM_BIG] = "big",         [MEM_TIER] = "tier",
+};
+
+// Per-subsystem counts are sharded per thread, so that the hot path only does plain (non locked) updates.
+// A shard is owned by a single thread, except the last one which is shared by all threads past MAX_SHARDS.
+#define MAX_SHARDS 64
+
+typedef struct shard {
+    Counters counters[_MEM_SUBSYSTEM_SIZE];
+} __attribute__((aligned(64))) Shard;
+
+static Shard shards[MAX_SHARDS];
+static u32 shardCount = 0;
+static __thread Shard* localShard = null;
+static __thread bool sharedShard = false;
+
+// Live and peak bytes are global: blocks are often freed by another thread than the one which allocated them,
+// the live bytes of a shard would not mean anything. The total is what the cap applies to.
+static Bytes bytes[_MEM_SUBSYSTEM_SIZE];
+static Bytes total;
+static u64 cap = 0;
+
+void memSetAllocator(const Allocator* allocator) {
+    backend = allocator ? *allocator : DEFAULT_ALLOCATOR;
+}
+
+void memSetCap(u64 bytes) {
+    __atomic_store_n(&cap, bytes, __ATOMIC_RELAXED);
+}
+
+u64 memGetCap() {
+    return __atomic_load_n(&cap, __ATOMIC_RELAXED);
+}
+
+static Counters* localCounters(MemSubsystem subsystem) {
+    if (localShard == null) {
+        u32 index = __atomic_fetch_add(&shardCount, 1, __ATOMIC_RELAXED);
+        sharedShard = index >= MAX_SHARDS - 1;
+        localShard = shards + (sharedShard ? MAX_SHARDS - 1 : index);
+    }
+    return localShard->counters + subsystem;
+}
+
+// Adds DELTA to a shard counter. Only the shared shard needs an atomic update.
+static void bump(u64* counter, u64 delta) {
+    if (sharedShard)
+        __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+static void raisePeak(u64* peak, u64 live) {
+    u64 current = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (current < live &&
+           !__atomic_compare_exchange_n(peak, &current, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Reserves DELTA more live bytes for SUBSYSTEM, failing if it would exceed the cap.
+static bool reserve(MemSubsystem subsystem, u64 delta) {
+    u64 limit = memGetCap();
+    u64 newTotal = __atomic_add_fetch(&total.live, delta, __ATOMIC_RELAXED);
+    if (limit != 0 && subsystem != MEM_ERROR && newTotal > limit) {
+        __atomic_sub_fetch(&total.live, delta, __ATOMIC_RELAXED);
+        return false;
+    }
+    raisePeak(&total.peak, newTotal);
+    raisePeak(&bytes[subsystem].peak, __atomic_add_fetch(&bytes[subsystem].live, delta, __ATOMIC_RELAXED));
+    return true;
+}
+
+static void release(MemSubsystem subsystem, u64 delta) {
+    __atomic_sub_fetch(&bytes[subsystem].live, delta, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&total.live, delta, __ATOMIC_RELAXED);
+}
+
+static void fail(MemSubsystem subsystem) {
+    bump(&localCounters(subsystem)->failures, 1);
+    // Reporting the failure allocates in the error subsystem, which never fails because of the cap.
+    if (subsystem != MEM_ERROR)
+        signalErrorNoToken(ERR_ALLOC_FAIL, null, -1);
+}
+
+void* memAlloc(MemSubsystem subsystem, u64 size) {
+    if (!reserve(subsystem, size)) {
+        fail(subsystem);
+        return null;
+    }
+    BlockHeader* header = backend.alloc(sizeof *header + size, backend.userData);
+    if (header == null) {
+        release(subsystem, size);
+        fail(subsystem);
+        return null;
+    }
+    header->size = size;
+    header->subsystem = subsystem;
+    header->magic = BLOCK_MAGIC;
+    bump(&localCounters(subsystem)->allocations, 1);
+    return header + 1;
+}
+
+void* memRealloc(MemSubsystem subsystem, void* ptr, u64 newSize) {
+    if (ptr == null)
+        return memAlloc(subsystem, newSize);
+
+    BlockHeader* header = (BlockHeader*)ptr - 1;
+    MemSubsystem owner = header->subsystem;
+    u64 oldSize = header->size;
+    if (newSize > oldSize && !reserve(owner, newSize - oldSize)) {
+        fail(owner);
+        return null;
+    }
+    BlockHeader* newHeader =
+        backend.realloc(header, sizeof *header + oldSize, sizeof *header + newSize, backend.userData);
+    if (newHeader == null) {
+        if (newSize > oldSize)
+            release(owner, newSize - oldSize);
+        fail(owner);
+        return null;
+    }
+    if (newSize < oldSize)
+        release(owner, oldSize - newSize);
+    newHeader->size = newSize;
+    return newHeader + 1;
+}
+
+void memFree(void* ptr) {
+    if (ptr == null)
+        return;
+    BlockHeader* header = (BlockHeader*)ptr - 1;
+    MemSubsystem owner = header->subsystem;
+    u64 size = header->size;
+    header->magic = 0;
+    release(owner, size);
+    bump(&localCounters(owner)->frees, 1);
+    backend.free(header, sizeof *header + size, backend.userData);
+}
+
+void memGetStats(MemSubsystem subsystem, MemStats* out) {
+    *out = (MemStats){0};
+    out->live = __atomic_load_n(&bytes[subsystem].live, __ATOMIC_RELAXED);
+    out->peak = __atomic_load_n(&bytes[subsystem].peak, __ATOMIC_RELAXED);
+    u32 count = __atomic_load_n(&shardCount, __ATOMIC_RELAXED);
+    for (u32 i = 0; i < count && i < MAX_SHARDS; i++) {
+        Counters* c = shards[i].counters + subsystem;
+        out->allocations += __atomic_load_n(&c->allocations, __ATOMIC_RELAXED);
+        out->frees += __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+        out->failures += __atomic_load_n(&c->failures, __ATOMIC_RELAXED);
+    }
+}
+
+void memGetTotalStats(MemStats* out) {
+    MemStats stats;
+    *out = (MemStats){0};
+    for (u32 i = 0; i < _MEM_SUBSYSTEM_SIZE; i++) {
+        memGetStats(i, &stats);
+        out->allocations += stats.allocations;
+        out->frees += stats.frees;
+        out->failures += stats.failures;
+    }
+    out->live = __atomic_load_n(&total.live, __ATOMIC_RELAXED);
+    out->peak = __atomic_load_n(&total.peak, __ATOMIC_RELAXED);
+}
+
+void memPrintStats() {
+    MemStats stats;
+    fprintf(stderr, "%-10s %12s %12s %12s %12s %10s\n", "subsystem", "live", "peak", "allocs", "frees", "failures");
+    for (u32 i = 0; i < _MEM_SUBSYSTEM_SIZE; i++) {
+        memGetStats(i, &stats);
+        fprintf(stderr, "%-10s %12lu %12lu %12lu %12lu %10lu\n", subsystemNames[i], stats.live, stats.peak,
+                stats.allocations, stats.frees, stats.failures);
+    }
+    memGetTotalStats(&stats);
+    fprintf(stderr, "%-10s %12lu %12lu %12lu %12lu %10lu\n", "total", stats.live, stats.peak, stats.allocations,
+            stats.frees, stats.failures);
+    if (memGetCap() != 0)
+        fprintf(stderr, "cap: %lu bytes\n", memGetCap());
+}
+
+bool memParseSize(const char* str, u64* outBytes) {
+    // strtoul would take "-5" for 2^64 - 5.
+    if (!isdigit((unsigned char)*str))
+        return false;
+    char* end;
+    errno = 0;
+    u64 value = strtoul(str, &end, 10);
+    if (errno == ERANGE)
+        return false;
+    u32 shift = 0;
+    switch (*end) {
+    case 'k':
+    case 'K':
+        shift = 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        end++;
+        break;
+    }
+    if (*end != '\0' || value > UINT64_MAX >> shift)
+        return false;
+    value <<= shift;
+    *outBytes = value;
+    return true;
+}
@@ -1,31 +1,261 @@
 #include "token.h"
 #include "util.h"
 
-#define DEF_OP(name, _symbol, _priority, _rightAssociative) Token* op##name = operators + OPERATOR_##name;\
-    op##name->identifier = OPERATOR;\
-    op##name->symbol = _symbol;\
-    op##name->value.operator.priority = _priority;\
-    op##name->value.operator.rightAssociative = _rightAssociative;\
-    op##name->function = name
+#include <stdlib.h>
+#include <string.h>
 
+#define DEF_OP(name, _symbol, _priority, _rightAssociative, _prefix)                                                   \
+    DEF_OP_AS(name, _symbol, _priority, _rightAssociative, _prefix, name)
+// For operators computed by a builtin.
+#define DEF_OP_AS(name, _symbol, _priority, _rightAssociative, _prefix, _function)                                     \
+    registerPredefined(OPERATOR_##name, _symbol, (Operator){_priority, _rightAssociative, _prefix}, _function)
 
-static Token operators[_OPERATOR_SIZE];
+// A symbol prefix of the trie holds the operators it names: each symbol names up to two, one of each kind.
+typedef struct trie_node {
+    u32 firstChild; // 0 if there is none: the root is never a child
+    u32 nextSibling;
+    u32 infix;
+    u32 prefix;
+    char c;
+} TrieNode;
+
+#define MAX_TRIE_NODES (MAX_OPERATORS * OPERATOR_MAX_LENGTH + 1)
+
+static OperatorDesc operators[MAX_OPERATORS];
+static char symbols[MAX_OPERATORS][OPERATOR_MAX_LENGTH + 1];
+static u32 operatorCount = 0;
+static TrieNode trie[MAX_TRIE_NODES];
+static u32 trieSize = 0;
+
+// Characters of the source which are lexed as operators.
+static bool isSymbolChar(char c) {
+    if (c <= ' ' || c >= 127 || c == '.' || c == '_' || identifierFromChar(c) != _IDENTIFIER_SIZE)
+        return false;
+    return !(c >= '0' && c <= '9') && !(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z');
+}
+
+static u32 trieChild(u32 node, char c) {
+    for (u32 child = trie[node].firstChild; child != 0; child = trie[child].nextSibling) {
+        if (trie[child].c == c)
+            return child;
+    }
+    return 0;
+}
+
+// Returns the node of SYMBOL, creating the missing ones.
+static u32 trieInsert(const char* symbol, u64 length) {
+    u32 node = 0;
+    for (u64 i = 0; i < length; i++) {
+        u32 child = trieChild(node, symbol[i]);
+        if (child == 0) {
+            child = trieSize++;
+            trie[child] = (TrieNode){0, trie[node].firstChild, NO_OPERATOR, NO_OPERATOR, symbol[i]};
+            trie[node].firstChild = child;
+        }
+        node = child;
+    }
+    return node;
+}
+
+bool registerOperator(const char* symbol, u64 length, Operator op, Function function) {
+    if (operatorCount == MAX_OPERATORS || length == 0 || length > OPERATOR_MAX_LENGTH)
+        return false;
+    for (u64 i = 0; i < length; i++) {
+        if (!isSymbolChar(symbol[i]))
+            return false;
+    }
+    u32 existing;
+    if (operatorFromSymbol(symbol, length, op.prefix, &existing))
+        return false;
+    u32 node = trieInsert(symbol, length);
+    u32 index = operatorCount++;
+    memcpy(symbols[index], symbol, length);
+    symbols[index][length] = '\0';
+    operators[index] = (OperatorDesc){symbols[index], op, function};
+    if (op.prefix)
+        trie[node].prefix = index;
+    else
+        trie[node].infix = index;
+    return true;
+}
+
+// Predefined operators keep the index of their OperatorType.
+static void registerPredefined(u32 index, const char* symbol, Operator op, Function function) {
+    operatorCount = index;
+    registerOperator(symbol, strlen(symbol), op, function);
+}
 
 void initOperators() {
-    DEF_OP(ADD, "+", 2, false);
-    DEF_OP(SUBTRACT, "-", 2, false);
-    DEF_OP(MULTIPLY, "*", 3, false);
-    DEF_OP(DIVIDE, "/", 3, false);
-}
-
-bool operatorFromSymbol(const char *str, Token* newToken) {
-    for (u64 i = 0; i < _OPERATOR_SIZE; i++) {
-        if (streq(operators[i].symbol, str)) {
-            Token* op = operators + i;
-            newToken->function = op->function;
-            newToken->value.operator = op->value.operator;
-            return true;
+    operatorCount = 0;
+    trieSize = 1;
+    trie[0] = (TrieNode){0, 0, NO_OPERATOR, NO_OPERATOR, '\0'};
+    DEF_OP(OR, "||", 2, false, false);
+    DEF_OP(AND, "&&", 3, false, false);
+    DEF_OP(EQUAL, "==", 4, false, false);
+    DEF_OP(NOT_EQUAL, "!=", 4, false, false);
+    DEF_OP(LESS, "<", 5, false, false);
+    DEF_OP(LESS_EQUAL, "<=", 5, false, false);
+    DEF_OP(GREATER, ">", 5, false, false);
+    DEF_OP(GREATER_EQUAL, ">=", 5, false, false);
+    DEF_OP(ADD, "+", 6, false, false);
+    DEF_OP(SUBTRACT, "-", 6, false, false);
+    DEF_OP(MULTIPLY, "*", 7, false, false);
+    DEF_OP(DIVIDE, "/", 7, false, false);
+    // Prefix operators bind tighter than infix ones, but not than '**': -2 ** 2 is -(2 ** 2).
+    DEF_OP(NOT, "!", 8, true, true);
+    DEF_OP(NEGATE, "-", 8, true, true);
+    DEF_OP_AS(POWER, "**", 9, true, false, POW);
+    // Only allowed as 'name = expression', the parser rejects it anywhere else.
+    DEF_OP(ASSIGN, "=", 0, true, false);
+    operatorCount = _OPERATOR_SIZE;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ul
+#define FNV_PRIME 0x100000001b3ul
+
+static u64 hashBytes(u64 hash, const void* bytes, u64 length) {
+    for (u64 i = 0; i < length; i++) {
+        hash = (hash ^ ((const u8*)bytes)[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Function pointers change from one run to the other, names do not: the builtin computing FUNCTION,
+// or else the predefined operator.
+static const char* implementationName(functionptr function) {
+    for (u32 i = 0; i < getBuiltinCount(); i++) {
+        if (getBuiltin(i)->function.ptr == function)
+            return getBuiltin(i)->name;
+    }
+    for (u32 i = 0; i < _OPERATOR_SIZE; i++) {
+        if (operators[i].function.ptr == function)
+            return operators[i].symbol;
+    }
+    return "";
+}
+
+u64 hashOperators() {
+    u64 hash = FNV_OFFSET;
+    for (u32 i = 0; i < operatorCount; i++) {
+        const OperatorDesc* desc = operators + i;
+        const char* implementation = implementationName(desc->function.ptr);
+        u8 fields[3] = {desc->operator.priority, desc->operator.rightAssociative, desc->operator.prefix};
+        // Lengths are hashed too, so that symbols and names cannot run into each other.
+        u64 lengths[2] = {strlen(desc->symbol), strlen(implementation)};
+        hash = hashBytes(hash, lengths, sizeof lengths);
+        hash = hashBytes(hash, desc->symbol, lengths[0]);
+        hash = hashBytes(hash, fields, sizeof fields);
+        hash = hashBytes(hash, implementation, lengths[1]);
+    }
+    return hash;
+}
+
+const OperatorDesc* getOperator(u32 index) {
+    return operators + index;
+}
+
+bool operatorFromSymbol(const char* str, u64 length, bool prefix, u32* outIndex) {
+    u32 node = 0;
+    for (u64 i = 0; i < length; i++) {
+        node = trieChild(node, str[i]);
+        if (node == 0)
+            return false;
+    }
+    u32 index = prefix ? trie[node].prefix : trie[node].infix;
+    if (length == 0 || index == NO_OPERATOR)
+        return false;
+    *outIndex = index;
+    return true;
+}
+
+u64 operatorMatch(const char* str, u64 length, bool prefix, u32* outIndex) {
+    u64 matched = 0;
+    u32 node = 0;
+    for (u64 i = 0; i < length; i++) {
+        node = trieChild(node, str[i]);
+        if (node == 0)
+            break;
+        u32 index = prefix ? trie[node].prefix : trie[node].infix;
+        if (index != NO_OPERATOR) {
+            matched = i + 1;
+            *outIndex = index;
         }
     }
-    return false;
+    return matched;
+}
+
+// Splits LINE at spaces and tabs, into at most MAX fields. Returns the number of fields.
+static u32 splitFields(char* line, char** fields, u32 max) {
+    u32 count = 0;
+    char* saved;
+    for (char* field = strtok_r(line, " \t\r\n", &saved); field != null; field = strtok_r(null, " \t\r\n", &saved)) {
+        if (count == max)
+            return max + 1;
+        fields[count++] = field;
+    }
+    return count;
+}
+
+// Finds the implementation of an operator: a builtin, or another operator of the same kind.
+static bool findImplementation(const char* name, bool prefix, Function* outFunction) {
+    u32 index;
+    u32 arity = prefix ? 1 : 2;
+    if (builtinFromName(name, strlen(name), &index)) {
+        *outFunction = getBuiltin(index)->function;
+    } else if (operatorFromSymbol(name, strlen(name), prefix, &index)) {
+        *outFunction = operators[index].function;
+    } else {
+        return false;
+    }
+    // Lazy builtins bind variables or need their arguments unevaluated, they cannot be operators.
+    // '&&' and '||' are the exception, the tree walker short-circuits them whatever their symbol.
+    return outFunction->arity == arity && (!outFunction->lazy || outFunction->ptr == AND.ptr ||
+                                           outFunction->ptr == OR.ptr);
+}
+
+static bool parseOperator(char* line, u64 number, const char* path, FILE* errStream) {
+    char* fields[5];
+    u32 count = splitFields(line, fields, 5);
+    if (count == 0 || fields[0][0] == '#')
+        return true;
+    char* end;
+    long priority = count == 5 ? strtol(fields[1], &end, 10) : 0;
+    if (count != 5 || *end != '\0' || priority < 2 || priority > 100 ||
+        (strcmp(fields[2], "left") != 0 && strcmp(fields[2], "right") != 0) ||
+        (strcmp(fields[3], "prefix") != 0 && strcmp(fields[3], "infix") != 0)) {
+        fprintf(errStream, "%s:%lu: expected 'symbol priority left|right prefix|infix implementation'.\n", path,
+                number);
+        return false;
+    }
+    Operator op = {priority, strcmp(fields[2], "right") == 0, strcmp(fields[3], "prefix") == 0};
+    Function function;
+    if (!findImplementation(fields[4], op.prefix, &function)) {
+        fprintf(errStream, "%s:%lu: '%s' is not a function or %s operator taking %u operand(s).\n", path, number,
+                fields[4], op.prefix ? "prefix" : "infix", op.prefix ? 1 : 2);
+        return false;
+    }
+    if (!registerOperator(fields[0], strlen(fields[0]), op, function)) {
+        fprintf(errStream, "%s:%lu: cannot define the operator '%s' (invalid or taken symbol, or too many operators).\n",
+                path, number, fields[0]);
+        return false;
+    }
+    return true;
+}
+
+bool loadOperators(const char* path, FILE* errStream) {
+    FILE* file = fopen(path, "r");
+    if (file == null) {
+        fprintf(errStream, "Could not open the operator file '%s'.\n", path);
+        return false;
+    }
+    char* line = null;
+    size_t size = 0;
+    u64 number = 0;
+    bool ok = true;
+    while (ok && getline(&line, &size, file) > 0) {
+        ok = parseOperator(line, ++number, path, errStream);
+    }
+    free(line);
+    fclose(file);
+    return ok;
 }
@@ -1,35 +1,79 @@
 #include "interpreter.h"
+#include "bignum.h"
 #include "darray.h"
 #include "error.h"
+#include "matrix.h"
+#include "share.h"
+#include "solver.h"
+#include "tier.h"
 #include "util.h"
+#include "var-handler.h"
 
 #include "./pinterpreter.h"
 #include <stdlib.h>
 
+static bool gradient = false;
+
+// In complex mode, 'i' is the imaginary unit, not a name.
+static bool isImaginaryUnit(const TokenStream* tokens, u64 index) {
+    return isComplexMode() && tokenLength(tokens, index) == 1 && tokens->source[tokenOffset(tokens, index)] == 'i';
+}
+
+// The latest definition of the user function named by the token at INDEX.
+static bool findCallee(const TokenStream* tokens, u32 index, u32* outFunction) {
+    return userFunctionFromName(tokens->source + tokenOffset(tokens, index), tokenLength(tokens, index), outFunction);
+}
+
 static bool popOperator(ParsingCtx* ctx) {
-    Token* t;
+    u32 t;
     darrayPop(&ctx->operatorStack, &t);
-    EvalNode* node = treeCreate(t);
+    if (tokenKind(ctx->tokens, t) == QUESTION) {
+        // A '?' without its ':'.
+        signalError(ERR_INVALID_EXPR, ctx->tokens, t);
+        return false;
+    }
+    u32 callee;
+    bool call = tokenKind(ctx->tokens, t) == NAME && tokenPayload(ctx->tokens, t) == NO_BUILTIN;
+    if (call)
+        findCallee(ctx->tokens, t, &callee);
+    EvalNode* node = call ? treeCreateCall(ctx->tokens, t, callee) : treeCreate(ctx->tokens, t);
+    if (node == null)
+        return false;
     for (u64 i = node->arity; i > 0; i--) {
         EvalNode* n;
         if (!darrayRemove(&ctx->outputQueue, darrayLength(&ctx->outputQueue) - i, &n)) {
             // Operator is missing an operand !
-            signalError(ERR_OP_MISSING_OPERAND, t);
+            signalError(ERR_OP_MISSING_OPERAND, ctx->tokens, t);
+            treeDestroy(node);
+            return false;
+        }
+        if (!treeAddChild(node, n)) {
+            treeDestroy(n);
             treeDestroy(node);
             return false;
         }
-        treeAddChild(node, n);
     }
-    darrayAdd(&ctx->outputQueue, node);
+    if (call)
+        node = treeInlineCall(node);
+    if (!darrayAdd(&ctx->outputQueue, node)) {
+        treeDestroy(node);
+        return false;
+    }
     return true;
 }
 
-static bool handleOperator(Token* token, ParsingCtx* ctx) {
-    Operator* op = &token->value.operator;
-    Token* t2;
-    while (darrayPeek(&ctx->operatorStack, &t2) && t2->identifier == OPERATOR) {
-        Operator* o2 = &t2->value.operator;
-        if (o2->priority < op->priority || (o2->priority == op->priority && !op->rightAssociative))
+static bool handleOperator(u32 token, ParsingCtx* ctx) {
+    if (tokenPayload(ctx->tokens, token) == OPERATOR_ASSIGN) {
+        // Assignments are split off by evaluateStatements, any '=' left is misplaced.
+        signalError(ERR_INVALID_EXPR, ctx->tokens, token);
+        return false;
+    }
+    const Operator* op = &tokenOperator(ctx->tokens, token)->operator;
+    u32 t2;
+    // A prefix operator has no left operand, nothing before it can be complete yet.
+    while (!op->prefix && darrayPeek(&ctx->operatorStack, &t2) && tokenKind(ctx->tokens, t2) == OPERATOR) {
+        const Operator* o2 = &tokenOperator(ctx->tokens, t2)->operator;
+        if (o2->priority < op->priority || (o2->priority == op->priority && op->rightAssociative))
             break;
         if (!popOperator(ctx))
             return false;
@@ -38,20 +82,256 @@ static bool handleOperator(Token* token, ParsingCtx* ctx) {
     return true;
 }
 
-// The parameter 't' is only used for error reporting
-static bool handleParen(ParsingCtx* ctx, Token* parenToken) {
-    Token* t;
-    while (darrayPeek(&ctx->operatorStack, &t) && t->identifier != LPAREN) {
+// '?' has a lower priority than all operators, and is right associative: pending conditionals stay on the stack.
+static bool handleQuestion(u32 token, ParsingCtx* ctx) {
+    u32 t;
+    while (darrayPeek(&ctx->operatorStack, &t) && tokenKind(ctx->tokens, t) == OPERATOR) {
+        if (!popOperator(ctx))
+            return false;
+    }
+    darrayAdd(&ctx->operatorStack, token);
+    return true;
+}
+
+// Completes the innermost pending '?': the ':' replaces it on the stack, and becomes the 3-operand conditional.
+static bool handleColon(u32 token, ParsingCtx* ctx) {
+    u32 t;
+    while (darrayPeek(&ctx->operatorStack, &t) &&
+           (tokenKind(ctx->tokens, t) == OPERATOR || tokenKind(ctx->tokens, t) == COLON)) {
+        if (!popOperator(ctx))
+            return false;
+    }
+    if (!darrayPeek(&ctx->operatorStack, &t) || tokenKind(ctx->tokens, t) != QUESTION) {
+        signalError(ERR_INVALID_EXPR, ctx->tokens, token);
+        return false;
+    }
+    darrayPop(&ctx->operatorStack, null);
+    darrayAdd(&ctx->operatorStack, token);
+    return true;
+}
+
+// Pops everything down to the innermost '(' or '[', which must be OPENER.
+// The parameter 'token' is only used for error reporting
+static bool popToOpener(ParsingCtx* ctx, u32 token, Identifier opener) {
+    u32 t;
+    while (darrayPeek(&ctx->operatorStack, &t) && tokenKind(ctx->tokens, t) != LPAREN &&
+           tokenKind(ctx->tokens, t) != LBRACKET) {
         if (!popOperator(ctx)) {
-            signalError(ERR_MISMATCH_PAREN, t);
+            signalError(ERR_MISMATCH_PAREN, ctx->tokens, t);
             return false;
         }
     }
-    if (darrayLength(&ctx->operatorStack) == 0) {
-        signalError(ERR_MISMATCH_PAREN, parenToken);
+    if (!darrayPeek(&ctx->operatorStack, &t) || tokenKind(ctx->tokens, t) != opener) {
+        signalError(ERR_MISMATCH_PAREN, ctx->tokens, token);
         return false;
     }
+    return true;
+}
+
+// Kind of the innermost pending '(' or '[', _IDENTIFIER_SIZE if there is none.
+static Identifier innermostOpener(ParsingCtx* ctx) {
+    const u32* stack = ctx->operatorStack.a;
+    for (u64 i = darrayLength(&ctx->operatorStack); i > 0; i--) {
+        Identifier id = tokenKind(ctx->tokens, stack[i - 1]);
+        if (id == LPAREN || id == LBRACKET)
+            return id;
+    }
+    return _IDENTIFIER_SIZE;
+}
+
+static MatrixShape* currentShape(ParsingCtx* ctx) {
+    return darrayGetPtr(&ctx->shapes, darrayLength(&ctx->shapes) - 1);
+}
+
+// Every element of a matrix literal is a single operand.
+static bool endElement(ParsingCtx* ctx, u32 token) {
+    MatrixShape* shape = currentShape(ctx);
+    if (darrayLength(&ctx->outputQueue) != shape->queued + 1) {
+        signalError(ERR_INVALID_EXPR, ctx->tokens, token);
+        return false;
+    }
+    shape->queued++;
+    return true;
+}
+
+// Closes a row of the innermost matrix literal, at a ';' or at its ']'.
+static bool endRow(ParsingCtx* ctx, u32 token) {
+    if (!popToOpener(ctx, token, LBRACKET) || !endElement(ctx, token))
+        return false;
+    MatrixShape* shape = currentShape(ctx);
+    if (shape->rows > 0 && shape->rowCommas + 1 != shape->columns) {
+        signalError(ERR_MATRIX_SHAPE, ctx->tokens, token);
+        return false;
+    }
+    shape->columns = shape->rowCommas + 1;
+    shape->rowCommas = 0;
+    shape->rows++;
+    return true;
+}
+
+static bool handleComma(ParsingCtx* ctx, u32 commaToken) {
+    if (innermostOpener(ctx) == LBRACKET) {
+        if (!popToOpener(ctx, commaToken, LBRACKET) || !endElement(ctx, commaToken))
+            return false;
+        currentShape(ctx)->rowCommas++;
+        return true;
+    }
+    if (!popToOpener(ctx, commaToken, LPAREN))
+        return false;
+    u32* commas = darrayGetPtr(&ctx->argCounts, darrayLength(&ctx->argCounts) - 1);
+    (*commas)++;
+    return true;
+}
+
+// ';' only reaches the parser inside matrix literals, see statementEnd.
+static bool handleSemi(ParsingCtx* ctx, u32 token) {
+    if (innermostOpener(ctx) != LBRACKET) {
+        signalError(ERR_INVALID_EXPR, ctx->tokens, token);
+        return false;
+    }
+    return endRow(ctx, token);
+}
+
+static bool handleLBracket(ParsingCtx* ctx, u32 token) {
+    MatrixShape shape = {0, 0, 0, darrayLength(&ctx->outputQueue)};
+    return darrayAdd(&ctx->operatorStack, token) && darrayAdd(&ctx->shapes, shape);
+}
+
+// The elements of the literal become the children of its '[' node.
+static bool handleRBracket(ParsingCtx* ctx, u32 token) {
+    if (!endRow(ctx, token))
+        return false;
+    MatrixShape shape;
+    u32 bracket;
+    darrayPop(&ctx->shapes, &shape);
+    darrayPop(&ctx->operatorStack, &bracket);
+    EvalNode* node = treeCreate(ctx->tokens, bracket);
+    if (node == null)
+        return false;
+    u32 count = shape.rows * shape.columns;
+    u64 first = darrayLength(&ctx->outputQueue) - count;
+    EvalNode** queue = ctx->outputQueue.a;
+    u32 added = 0;
+    while (added < count && treeAddChild(node, queue[first + added]))
+        added++;
+    for (u32 i = added; i < count; i++) {
+        treeDestroy(queue[first + i]);
+    }
+    ctx->outputQueue.length = first;
+    node->arity = count;
+    node->rows = shape.rows;
+    if (added < count || !darrayAdd(&ctx->outputQueue, node)) {
+        treeDestroy(node);
+        return false;
+    }
+    return true;
+}
+
+// The parameter 'parenToken' is only used for error reporting
+static bool handleParen(ParsingCtx* ctx, u32 parenToken) {
+    if (!popToOpener(ctx, parenToken, LPAREN))
+        return false;
     darrayPop(&ctx->operatorStack, null);
+    u32 commas;
+    darrayPop(&ctx->argCounts, &commas);
+
+    // Closing the argument list of a function call
+    u32 t;
+    if (darrayPeek(&ctx->operatorStack, &t) && tokenKind(ctx->tokens, t) == NAME) {
+        u32 arity;
+        if (tokenPayload(ctx->tokens, t) != NO_BUILTIN) {
+            arity = getBuiltin(tokenPayload(ctx->tokens, t))->function.arity;
+        } else {
+            u32 callee;
+            findCallee(ctx->tokens, t, &callee);
+            arity = getUserFunction(callee)->arity;
+        }
+        if (commas + 1 != arity) {
+            signalError(ERR_FUNC_MISSING_OPERAND, ctx->tokens, t);
+            darrayPop(&ctx->operatorStack, null);
+            return false;
+        }
+        return popOperator(ctx);
+    }
+    if (commas > 0) {
+        signalError(ERR_INVALID_EXPR, ctx->tokens, parenToken);
+        return false;
+    }
+    return true;
+}
+
+// Returns the first token of the argument INDEX of the call whose arguments start at BEGIN.
+static u32 argumentStart(TokenStream* tokens, u32 begin, u32 end, u32 index) {
+    u32 depth = 0;
+    u32 t = begin;
+    for (; t < end && index > 0; t++) {
+        Identifier id = tokenKind(tokens, t);
+        if (id == LPAREN || id == LBRACKET)
+            depth++;
+        else if ((id == RPAREN || id == RBRACKET) && depth-- == 0)
+            return end;
+        else if (id == COMMA && depth == 0)
+            index--;
+    }
+    return t;
+}
+
+// Some builtins bind a variable, named by one of their arguments: the index of sum(i, a, b, expr),
+// the unknown of solve(expr, x, low, high)... It is declared before the call is parsed, so that the other
+// arguments can refer to it, even those before it.
+static bool declareBound(ParsingCtx* ctx, u32 token, u32 end) {
+    if (token + 1 >= end || tokenKind(ctx->tokens, token) != NAME || tokenKind(ctx->tokens, token + 1) != COMMA ||
+        isImaginaryUnit(ctx->tokens, token)) {
+        signalError(ERR_INVALID_EXPR, ctx->tokens, token < end ? token : token - 1);
+        return false;
+    }
+    u32 slot;
+    if (!varDeclare(ctx->tokens->source + tokenOffset(ctx->tokens, token), tokenLength(ctx->tokens, token), &slot)) {
+        if (!hasErrorOfType(ERR_ALLOC_FAIL))
+            signalError(ERR_TOO_MANY_VARS, ctx->tokens, token);
+        return false;
+    }
+    return true;
+}
+
+// A name is a function call if it is followed by '(', a variable otherwise.
+static bool handleName(ParsingCtx* ctx, u32 token, u32 end) {
+    bool call = token + 1 < end && tokenKind(ctx->tokens, token + 1) == LPAREN;
+    if (call) {
+        if (tokenPayload(ctx->tokens, token) == NO_BUILTIN) {
+            u32 callee;
+            if (!findCallee(ctx->tokens, token, &callee)) {
+                signalError(ERR_UNKNOWN_TOKEN, ctx->tokens, token);
+                return false;
+            }
+            darrayAdd(&ctx->operatorStack, token);
+            return true;
+        }
+        i32 bound = boundArgument(getBuiltin(tokenPayload(ctx->tokens, token))->function.ptr);
+        if (bound >= 0 && !declareBound(ctx, argumentStart(ctx->tokens, token + 2, end, bound), end))
+            return false;
+        darrayAdd(&ctx->operatorStack, token);
+        return true;
+    }
+    EvalNode* node;
+    u32 slot;
+    if (isImaginaryUnit(ctx->tokens, token)) {
+        node = treeCreate(ctx->tokens, token);
+        if (node != null)
+            node->function = IMAGINARY.ptr;
+    } else if (varFind(ctx->tokens->source + tokenOffset(ctx->tokens, token), tokenLength(ctx->tokens, token),
+                       &slot)) {
+        node = treeCreateVariable(ctx->tokens, token, slot);
+    } else {
+        signalError(ERR_UNKNOWN_VARIABLE, ctx->tokens, token);
+        return false;
+    }
+    if (node == null)
+        return false;
+    if (!darrayAdd(&ctx->outputQueue, node)) {
+        treeDestroy(node);
+        return false;
+    }
     return true;
 }
 
@@ -59,81 +339,406 @@ static void freeTree(void* ptr) {
     treeDestroy(*(EvalNode**)ptr);
 }
 
-EvalNode* parse(darray* tokens) {
+EvalNode* parseRange(TokenStream* tokens, u64 begin, u64 end) {
     if (getErrorCount() > 0)
         return null;
     ParsingCtx ctx;
-    darrayInit(&ctx.operatorStack, 4, sizeof(Token*));
-    darrayInit(&ctx.outputQueue, 4, sizeof(Token*));
+    ctx.tokens = tokens;
+    darrayInit(&ctx.operatorStack, 4, sizeof(u32));
+    darrayInit(&ctx.outputQueue, 4, sizeof(EvalNode*));
+    darrayInit(&ctx.argCounts, 4, sizeof(u32));
+    darrayInit(&ctx.shapes, 1, sizeof(MatrixShape));
 
-    Token* t;
-    for (u64 i = 0; i < darrayLength(tokens); i++) {
-        t = darrayGetPtr(tokens, i);
-        Identifier id = t->identifier;
+    // Only the kinds are needed to drive the loop, operator descriptors are looked up on demand.
+    const u8* kinds = tokens->kinds.a;
+    for (u32 t = begin; t < end; t++) {
+        // Past an allocation failure, the stacks are incomplete and every other error would be bogus.
+        if (hasErrorOfType(ERR_ALLOC_FAIL))
+            break;
+        // Same for errors in matrix literals: the elements of the literal are left on the queue.
+        if (getErrorCount() > 0 && darrayLength(&ctx.shapes) > 0)
+            break;
+        Identifier id = kinds[t];
         EvalNode* node;
         switch (id) {
         case NUMBER:
-            node = treeCreate(t);
-            darrayAdd(&ctx.outputQueue, node);
+            node = treeCreate(tokens, t);
+            if (node != null && !darrayAdd(&ctx.outputQueue, node))
+                treeDestroy(node);
+            break;
+        case NAME:
+            handleName(&ctx, t, end);
             break;
         case OPERATOR:
             handleOperator(t, &ctx);
             break;
+        case QUESTION:
+            handleQuestion(t, &ctx);
+            break;
+        case COLON:
+            handleColon(t, &ctx);
+            break;
         case LPAREN:
             darrayAdd(&ctx.operatorStack, t);
+            darrayAdd(&ctx.argCounts, (u32)0);
+            break;
+        case COMMA:
+            handleComma(&ctx, t);
             break;
         case RPAREN:
             handleParen(&ctx, t);
             break;
+        case SEMI:
+            handleSemi(&ctx, t);
+            break;
+        case LBRACKET:
+            handleLBracket(&ctx, t);
+            break;
+        case RBRACKET:
+            handleRBracket(&ctx, t);
+            break;
         default:
-            exit(3);
+            signalError(ERR_UNKNOWN_TOKEN, tokens, t);
             break;
         }
     }
-    Token* op;
-    while (darrayPeek(&ctx.operatorStack, &op)) {
-        if (op->identifier == LPAREN) {
-            signalError(ERR_MISMATCH_PAREN, op);
+    u32 op;
+    bool abandoned = hasErrorOfType(ERR_ALLOC_FAIL) || (getErrorCount() > 0 && darrayLength(&ctx.shapes) > 0);
+    while (!abandoned && darrayPeek(&ctx.operatorStack, &op)) {
+        if (tokenKind(tokens, op) == LPAREN || tokenKind(tokens, op) == LBRACKET) {
+            signalError(ERR_MISMATCH_PAREN, tokens, op);
             break;
         }
         popOperator(&ctx);
     }
-    EvalNode* node;
-    if (darrayLength(&ctx.outputQueue) > 1) {
+    EvalNode* node = null;
+    if (!abandoned && darrayLength(&ctx.outputQueue) > 1) {
         darrayGet(&ctx.outputQueue, 1, &node);
-        signalError(ERR_INVALID_EXPR, node->token);
+        signalError(ERR_INVALID_EXPR, tokens, node->token);
     }
     darrayGet(&ctx.outputQueue, 0, &node);
+    if (node != null && getErrorCount() == 0)
+        treeMeasure(node);
     if (getErrorCount() > 0) {
         //In this case, destroy all tree nodes we created
         //or else MEMORY LEAKS 
+        //The operator stack only holds token indices.
         darrayClearDeep(&ctx.outputQueue, &freeTree);
-        darrayClearDeep(&ctx.operatorStack, &freeTree);
+        darrayClear(&ctx.operatorStack);
         node = null;
     }
     darrayEmpty(&ctx.operatorStack);
     darrayEmpty(&ctx.outputQueue);
+    darrayEmpty(&ctx.argCounts);
+    darrayEmpty(&ctx.shapes);
     return node;
 }
 
-bool evaluate(const char* expression, double* outResult) {
+EvalNode* parse(TokenStream* tokens) {
+    return parseRange(tokens, 0, tokenCount(tokens));
+}
+
+u64 statementEnd(TokenStream* tokens, u64 begin) {
+    const u8* kinds = tokens->kinds.a;
+    u64 length = tokenCount(tokens);
+    // ';' also separates the rows of matrix literals.
+    u64 depth = 0;
+    for (; begin < length && (kinds[begin] != SEMI || depth > 0); begin++) {
+        if (kinds[begin] == LBRACKET)
+            depth++;
+        else if (kinds[begin] == RBRACKET && depth > 0)
+            depth--;
+    }
+    return begin;
+}
+
+// 'name = expression'
+static bool isAssignment(TokenStream* tokens, u64 begin, u64 end) {
+    return end - begin >= 2 && tokenKind(tokens, begin) == NAME && tokenKind(tokens, begin + 1) == OPERATOR &&
+           tokenPayload(tokens, begin + 1) == OPERATOR_ASSIGN;
+}
+
+// Declares the variable assigned by the statement starting at BEGIN, and returns its slot.
+static u32 declareTarget(TokenStream* tokens, u64 begin, u64 end) {
+    u32 slot;
+    if (isImaginaryUnit(tokens, begin)) {
+        signalError(ERR_INVALID_EXPR, tokens, begin);
+        return NO_TARGET;
+    }
+    if (!varDeclare(tokens->source + tokenOffset(tokens, begin), tokenLength(tokens, begin), &slot)) {
+        if (!hasErrorOfType(ERR_ALLOC_FAIL))
+            signalError(ERR_TOO_MANY_VARS, tokens, begin);
+        return NO_TARGET;
+    }
+    if (end == begin + 2) {
+        // Nothing to assign.
+        signalError(ERR_INVALID_EXPR, tokens, begin + 1);
+        return NO_TARGET;
+    }
+    return slot;
+}
+
+// 'name(a, b...) = expression', where NAME is not a builtin.
+static bool isDefinition(TokenStream* tokens, u64 begin, u64 end) {
+    if (end - begin < 5 || tokenKind(tokens, begin) != NAME || tokenPayload(tokens, begin) != NO_BUILTIN ||
+        tokenKind(tokens, begin + 1) != LPAREN)
+        return false;
+    u64 t = begin + 2;
+    while (t + 2 < end && tokenKind(tokens, t) == NAME && tokenKind(tokens, t + 1) == COMMA)
+        t += 2;
+    return t + 2 < end && tokenKind(tokens, t) == NAME && tokenKind(tokens, t + 1) == RPAREN &&
+           tokenKind(tokens, t + 2) == OPERATOR && tokenPayload(tokens, t + 2) == OPERATOR_ASSIGN;
+}
+
+// The parameters are declared as variables, and the function before its body is parsed, so that it can call itself.
+static void parseDefinition(TokenStream* tokens, u64 begin, u64 end) {
+    u32 params[USER_FUNCTION_MAX_ARITY];
+    u32 arity = 0;
+    u64 t = begin + 2;
+    for (; tokenKind(tokens, t) == NAME; t += 2) {
+        u32 slot;
+        if (arity == USER_FUNCTION_MAX_ARITY || isImaginaryUnit(tokens, t)) {
+            signalError(ERR_INVALID_EXPR, tokens, t);
+            return;
+        }
+        if (!varDeclare(tokens->source + tokenOffset(tokens, t), tokenLength(tokens, t), &slot)) {
+            if (!hasErrorOfType(ERR_ALLOC_FAIL))
+                signalError(ERR_TOO_MANY_VARS, tokens, t);
+            return;
+        }
+        for (u32 i = 0; i < arity; i++) {
+            if (params[i] == slot) {
+                signalError(ERR_INVALID_EXPR, tokens, t);
+                return;
+            }
+        }
+        params[arity++] = slot;
+    }
+    // T is on the '='.
+    if (end == t + 1) {
+        signalError(ERR_INVALID_EXPR, tokens, t);
+        return;
+    }
+    u32 index;
+    if (!userFunctionDefine(tokens->source + tokenOffset(tokens, begin), tokenLength(tokens, begin), arity, params,
+                            &index))
+        return;
+    EvalNode* body = parseRange(tokens, t + 1, end);
+    if (body == null)
+        userFunctionUndefine();
+    else
+        getUserFunction(index)->body = body;
+}
+
+EvalNode* parseStatement(TokenStream* tokens, u64 begin, u64 end, u32* outTarget) {
+    *outTarget = NO_TARGET;
+    if (isDefinition(tokens, begin, end)) {
+        *outTarget = FUNCTION_TARGET;
+        parseDefinition(tokens, begin, end);
+        return null;
+    }
+    if (!isAssignment(tokens, begin, end))
+        return parseRange(tokens, begin, end);
+    *outTarget = declareTarget(tokens, begin, end);
+    return parseRange(tokens, begin + 2, end);
+}
+
+// Evaluates ROOT in dual numbers, keeping the partial derivatives with respect to all declared variables.
+static double evalGradient(EvalNode* root, StatementResult* result) {
+    u32 variables = varCount();
+    double dual[1 + variables];
+    treeEvalDual(root, variables, dual);
+    if (getErrorCount() > 0 || variables == 0)
+        return dual[0];
+    result->gradient = memAlloc(MEM_GENERAL, variables * sizeof(double));
+    if (result->gradient == null)
+        return dual[0];
+    memcpy(result->gradient, dual + 1, variables * sizeof(double));
+    result->gradientLength = variables;
+    return dual[0];
+}
+
+static double evalComplex(EvalNode* root, StatementResult* result) {
+    Complex value = treeEvalComplex(root);
+    result->imaginary = value.im;
+    return value.re;
+}
+
+static double evalBig(EvalNode* root, StatementResult* result) {
+    result->big = treeEvalBig(root);
+    return result->big != null ? bigToDouble(result->big) : 0;
+}
+
+static void failStatement(StatementResult* result, const char* expression) {
+    result->ok = false;
+    result->errors = formatErrors(expression, &result->errorsLength);
+}
+
+// A statement of the line, between the two passes of evaluateStatements.
+typedef struct statement {
+    EvalNode* root;
+    u32 target;
+    // Counted statement, see tierCount. Null if tiering is disabled.
+    TierEntry* tier;
+    // Run by its program, ROOT is null until the program fails.
+    bool hot;
+    u64 begin;
+    u64 end;
+} Statement;
+
+bool evaluateStatements(const char* expression, TokenStream* tokens, darray* results) {
     bool success = true;
-    darray tokenBuffer;
-    darrayInit(&tokenBuffer, 4, sizeof(Token));
-    tokenize(expression, &tokenBuffer);
-    EvalNode* tree = parse(&tokenBuffer);
-    double result = treeEval(tree);
-    *outResult = result;
-    if (tree)
-        treeDestroy(tree);
+    u64 length = tokenCount(tokens);
+    u64 first = darrayLength(results);
+
+    // Lexing errors cannot be attributed to a statement, so they fail the whole line.
+    if (getErrorCount() > 0) {
+        StatementResult result = {0, false, null, 0, null, 0, null, 0, false, 0, null, 0, null};
+        failStatement(&result, expression);
+        if (!darrayAdd(results, result))
+            free(result.errors);
+        return false;
+    }
+
+    // First pass: build one tree per non-empty statement.
+    // Assigned variables are declared right away, so that the following statements can refer to them.
+    // Compiled statements are not parsed: statements of the same shape were, their variables are declared.
+    darray statements;
+    darrayInitIn(&statements, 4, sizeof(Statement), MEM_TREE);
+    for (u64 begin = 0; begin <= length; begin++) {
+        u64 end = statementEnd(tokens, begin);
+        if (end > begin) {
+            StatementResult result = {0, true, null, 0, null, 0, null, 0, false, 0, null, 0, null};
+            Statement statement = {null, NO_TARGET, tierCount(tokens, begin, end), false, begin, end};
+            statement.hot = statement.tier != null && tierIsHot(statement.tier);
+            if (!statement.hot)
+                statement.root = parseStatement(tokens, begin, end, &statement.target);
+            if (getErrorCount() > 0) {
+                failStatement(&result, expression);
+                success = false;
+            } else if (statement.target == FUNCTION_TARGET) {
+                // Definitions have no value.
+                begin = end;
+                continue;
+            }
+            // Every statement has its result: the second pass reads them side by side.
+            bool added = darrayAdd(results, result);
+            if (added && !darrayAdd(&statements, statement)) {
+                darrayPop(results, null);
+                added = false;
+            }
+            if (!added) {
+                free(result.errors);
+                if (statement.root)
+                    treeDestroy(statement.root);
+                success = false;
+                break;
+            }
+        }
+        begin = end;
+    }
+
+    // Second pass: evaluate them in order.
+    for (u64 i = 0; i < darrayLength(&statements); i++) {
+        Statement* statement = darrayGetPtr(&statements, i);
+        StatementResult* result = darrayGetPtr(results, first + i);
+        if (statement->hot) {
+            if (tierRun(statement->tier, tokens, statement->begin, result))
+                continue;
+            // The interpreter reports where the program failed, and evaluates matrices.
+            statement->root = parseStatement(tokens, statement->begin, statement->end, &statement->target);
+            if (getErrorCount() > 0) {
+                failStatement(result, expression);
+                success = false;
+            }
+        }
+        EvalNode* root = statement->root;
+        if (root == null)
+            continue;
+        // Integer statements are computed exactly first, gradients need dual numbers.
+        // Matrices have neither.
+        bool matrices = treeHasMatrices(root);
+        result->exact = !gradient && !matrices && treeEvalExact(root, &result->integer);
+        if (matrices)
+            result->matrix = treeEvalMatrix(root, &result->value);
+        else if (result->exact)
+            result->value = roundToPrecision((double)result->integer);
+        else if (getBigPrecision() > 0)
+            result->value = evalBig(root, result);
+        else
+            result->value = gradient         ? evalGradient(root, result)
+                            : isComplexMode()  ? evalComplex(root, result)
+                            : isShareEnabled() ? treeEvalShared(root)
+                                               : treeEvalParallel(root);
+        result->notes = formatSolverReports(&result->notesLength);
+        u32 target = statement->target;
+        // The variable gets its own copy, the result is printed later.
+        Matrix* copy = result->matrix != null && target != NO_TARGET ? matrixCopy(result->matrix) : null;
+        if (getErrorCount() > 0) {
+            matrixDestroy(copy);
+            failStatement(result, expression);
+            success = false;
+        } else if (copy != null) {
+            varSetMatrix(target, copy);
+        } else if (result->big != null && target != NO_TARGET) {
+            Big* copy = bigClone(result->big);
+            if (copy != null)
+                varSetBig(target, copy);
+        } else if (target != NO_TARGET) {
+            varSetNumber(target, (Number){result->value, result->integer, result->exact});
+            varSetImaginary(target, result->imaginary);
+        }
+        // Statements run often enough are compiled, their tree goes to the compiler thread.
+        bool promoted = statement->tier != null && !statement->hot && !matrices && result->ok &&
+                        tierPromote(statement->tier, root, target, statement->begin);
+        if (!promoted)
+            treeDestroy(root);
+    }
+    darrayEmpty(&statements);
+
+    // Statements could not be recorded, e.g. because of the memory cap.
     if (getErrorCount() > 0) {
-        printErrors(expression);
-        success = false;
+        StatementResult result = {0, false, null, 0, null, 0, null, 0, false, 0, null, 0, null};
+        failStatement(&result, expression);
+        if (!darrayAdd(results, result))
+            free(result.errors);
     }
-    for (u64 i = 0; i < darrayLength(&tokenBuffer); i++) {
-        Token* t = darrayGetPtr(&tokenBuffer, i);
-        free(t->symbol);
+    return success;
+}
+
+bool tokensUseFunctions(const TokenStream* tokens) {
+    for (u64 t = 0; t + 1 < tokenCount(tokens); t++) {
+        if (tokenKind(tokens, t) == NAME && tokenPayload(tokens, t) == NO_BUILTIN && tokenKind(tokens, t + 1) == LPAREN)
+            return true;
+    }
+    return false;
+}
+
+void setGradient(bool enabled) {
+    gradient = enabled;
+}
+
+void initResults(darray* results) {
+    darrayInit(results, 4, sizeof(StatementResult));
+}
+
+void clearResults(darray* results) {
+    for (u64 i = 0; i < darrayLength(results); i++) {
+        StatementResult* result = darrayGetPtr(results, i);
+        free(result->errors);
+        free(result->notes);
+        memFree(result->gradient);
+        matrixDestroy(result->matrix);
+        memFree(result->big);
     }
-    darrayEmpty(&tokenBuffer);
+    darrayClear(results);
+}
+
+bool evaluate(const char* expression, darray* results) {
+    TokenStream tokens;
+    tokenStreamInit(&tokens, expression);
+    tokenize(expression, &tokens);
+    bool success = evaluateStatements(expression, &tokens, results);
+    tokenStreamDestroy(&tokens);
     return success;
 }
@@ -1,17 +1,23 @@
 #include "token.h"
-#include "string-builder.h"
 
 typedef struct LexerCtx {
-    darray* tokens; //Token*
+    TokenStream* tokens;
+    const char* source;
     u64 position;
-    u64 tokenPos;
-    StringBuilder tokenBuilder;
 } LexerCtx;
 
+// Matrix literal being parsed.
+typedef struct MatrixShape {
+    u32 rows;      // complete rows so far
+    u32 columns;   // elements of the first row
+    u32 rowCommas; // ',' seen in the current row
+    u32 queued;    // length of the output queue after the previous element
+} MatrixShape;
+
 typedef struct ParsingCtx {
-    darray* tokens; //Token*
-    darray operatorStack; //Token**
+    TokenStream* tokens;
+    darray operatorStack; //u32, token indices
     darray outputQueue; //EvalNode**
+    darray argCounts; //u32, number of ',' seen at each parenthesis level
+    darray shapes; //MatrixShape, one per pending '['
 } ParsingCtx;
-
-bool setCurrentId(Identifier newID, Identifier* id, LexerCtx* ctx);
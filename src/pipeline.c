@@ -0,0 +1,168 @@
+#include "pipeline.h"
+#include "bignum.h"
+#include "error.h"
+#include "interpreter.h"
+#include "matrix.h"
+#include "memory.h"
+#include "ring.h"
+#include "var-handler.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef struct job {
+    char* line;
+    TokenStream tokens;
+    // Error reports are formatted by the stage that found them, and printed by the output stage.
+    darray results; // StatementResult
+    bool lexed;
+} Job;
+
+typedef struct pipeline {
+    FILE* in;
+    FILE* out;
+    FILE* errStream;
+    Ring lexed;     // Job*, reader -> evaluator
+    Ring evaluated; // Job*, evaluator -> writer
+} Pipeline;
+
+void printResults(FILE* stream, FILE* errStream, darray* results) {
+    bool lastOk = false;
+    for (u64 i = 0; i < darrayLength(results); i++) {
+        StatementResult* result = darrayGetPtr(results, i);
+        if (result->errorsLength > 0) {
+            fflush(stream);
+            fwrite(result->errors, 1, result->errorsLength, errStream);
+        }
+        if (!result->ok) {
+            fputs("\e[31mFailed to compute result.\e[0m\n", stream);
+        } else {
+            if (result->matrix != null) {
+                fputs("\e[32m=> ", stream);
+                matrixPrint(stream, result->matrix);
+                fputs("\e[0m", stream);
+            } else if (result->big != null) {
+                fputs("\e[32m=> ", stream);
+                bigPrint(stream, result->big);
+                fputs("\e[0m", stream);
+            } else if (result->exact)
+                fprintf(stream, "\e[32m=> %ld\e[0m", result->integer);
+            else if (result->imaginary != 0)
+                fprintf(stream, "\e[32m=> %g %c %gi\e[0m", result->value, signbit(result->imaginary) ? '-' : '+',
+                        fabs(result->imaginary));
+            else
+                fprintf(stream, "\e[32m=> %g\e[0m", result->value);
+            // Slots below gradientLength were declared before the statement was evaluated, their names are set.
+            for (u32 v = 0; v < result->gradientLength; v++) {
+                fprintf(stream, "%sd/d%s = %g", v == 0 ? "  (" : ", ", varName(v), result->gradient[v]);
+            }
+            fputs(result->gradientLength > 0 ? ")\n" : "\n", stream);
+        }
+        if (result->notesLength > 0) {
+            // Without its final line feed, so that the next line does not start dimmed.
+            fputs("\e[2m", stream);
+            fwrite(result->notes, 1, result->notesLength - 1, stream);
+            fputs("\e[0m\n", stream);
+        }
+        lastOk = result->ok;
+    }
+    if (lastOk)
+        fputc('\n', stream);
+}
+
+static void destroyJob(Job* job) {
+    tokenStreamDestroy(&job->tokens);
+    clearResults(&job->results);
+    darrayEmpty(&job->results);
+    free(job->line);
+    memFree(job);
+}
+
+static void* readStage(void* arg) {
+    Pipeline* p = arg;
+    initErrorSystem();
+    while (true) {
+        Job* job = memAlloc(MEM_GENERAL, sizeof *job);
+        if (job == null) {
+            // Nothing can be evaluated anymore, report and stop reading.
+            printErrors("");
+            break;
+        }
+        job->line = null;
+        job->lexed = true;
+        size_t size = 0;
+        if (getline(&job->line, &size, p->in) <= 0) {
+            free(job->line);
+            memFree(job);
+            break;
+        }
+        tokenStreamInit(&job->tokens, job->line);
+        initResults(&job->results);
+        if (!tokenize(job->line, &job->tokens)) {
+            // Lexing errors are pending in this thread, they must be formatted here.
+            job->lexed = false;
+            evaluateStatements(job->line, &job->tokens, &job->results);
+        }
+        ringPush(&p->lexed, job);
+    }
+    ringPush(&p->lexed, null);
+    shutErrorSystem();
+    return null;
+}
+
+static void* evaluateStage(void* arg) {
+    Pipeline* p = arg;
+    initErrorSystem();
+    Job* job;
+    while ((job = ringPop(&p->lexed)) != null) {
+        if (job->lexed)
+            evaluateStatements(job->line, &job->tokens, &job->results);
+        // The tokens are only needed until the errors have been formatted.
+        tokenStreamDestroy(&job->tokens);
+        ringPush(&p->evaluated, job);
+    }
+    ringPush(&p->evaluated, null);
+    shutMatrices();
+    shutErrorSystem();
+    return null;
+}
+
+static void writeStage(Pipeline* p) {
+    Job* job;
+    while ((job = ringPop(&p->evaluated)) != null) {
+        printResults(p->out, p->errStream, &job->results);
+        destroyJob(job);
+    }
+}
+
+bool runPipeline(FILE* in, FILE* out, FILE* errStream, u64 depth) {
+    Pipeline p = {in, out, errStream, {0}, {0}};
+    if (!ringInit(&p.lexed, depth))
+        return false;
+    if (!ringInit(&p.evaluated, depth)) {
+        ringDestroy(&p.lexed);
+        return false;
+    }
+
+    // The reader is started last: once it runs, the input is consumed, and must be evaluated by the pipeline.
+    pthread_t reader, evaluator;
+    bool started = false;
+    if (pthread_create(&evaluator, null, evaluateStage, &p) == 0) {
+        if (pthread_create(&reader, null, readStage, &p) == 0) {
+            started = true;
+            // The calling thread is the output stage.
+            writeStage(&p);
+            pthread_join(reader, null);
+        } else {
+            // Nothing was read: stop the evaluator, the caller evaluates the input serially.
+            ringPush(&p.lexed, null);
+            writeStage(&p);
+        }
+        pthread_join(evaluator, null);
+    }
+
+    ringDestroy(&p.lexed);
+    ringDestroy(&p.evaluated);
+    return started;
+}
@@ -0,0 +1,211 @@
+// Body of programRun, included by program.c once per type of lanes:
+//  - RUN_NAME, the name of the function
+//  - RUN_REAL, the type of the lanes
+//  - RUN_COLUMNS, the field of LaneRange holding columns of RUN_REAL
+//  - RUN_ROUNDS, defined if results must be rounded to the current precision after each instruction
+// Parameters, and the arguments of calls and reductions, are doubles in both.
+
+void RUN_NAME(const Program* program, const double* params, const LaneRange* range, u32 lanes, RUN_REAL* out,
+              u8* outFaults) {
+    RUN_REAL values[program->maxDepth][PROGRAM_LANES];
+    u8 faults[program->maxDepth][PROGRAM_LANES];
+    const Instruction* code = program->code.a;
+    const Number* constants = program->constants.a;
+    u32 top = 0; // number of values on the stack
+
+    for (u64 pc = 0; pc < program->code.length; pc++) {
+        const Instruction* in = code + pc;
+        // Operands are the ARITY values on top of the stack, the result replaces the first one.
+        u32 base = top - in->arity;
+        RUN_REAL* r = values[base];
+        u8* f = faults[base];
+        const RUN_REAL* a = values[base];
+        const RUN_REAL* b = values[base + 1];
+        const RUN_REAL* x = values[base + 2];
+        const u8* fb = faults[base + 1];
+        const u8* fx = faults[base + 2];
+
+        switch (in->opcode) {
+        case OP_CONST:
+        case OP_VARIABLE:
+        case OP_PARAM: {
+            if (in->opcode == OP_PARAM && range->RUN_COLUMNS != null) {
+                for (u32 l = 0; l < lanes; l++) {
+                    r[l] = range->RUN_COLUMNS[in->operand][range->index + l];
+                    f[l] = 0;
+                }
+                break;
+            }
+            // The own index is the only parameter which is not in PARAMS.
+            bool own = in->opcode == OP_PARAM && in->operand == program->params - 1;
+            double v = in->opcode == OP_CONST      ? constants[in->operand].value
+                       : in->opcode == OP_VARIABLE ? varGet(in->operand)
+                       : own                       ? 0
+                                                   : params[in->operand];
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = own ? range->origin + (range->index + l) * range->step : v;
+                f[l] = 0;
+            }
+            break;
+        }
+        case OP_ADD:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] + b[l];
+                f[l] |= fb[l];
+            }
+            break;
+        case OP_SUBTRACT:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] - b[l];
+                f[l] |= fb[l];
+            }
+            break;
+        case OP_MULTIPLY:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] * b[l];
+                f[l] |= fb[l];
+            }
+            break;
+        case OP_DIVIDE:
+            // Same result as funcDivide, 0 when dividing by zero.
+            for (u32 l = 0; l < lanes; l++) {
+                bool zero = b[l] == 0;
+                r[l] = zero ? 0 : a[l] / b[l];
+                f[l] |= fb[l] | (zero ? FAULT_DIV_BY_ZERO : 0);
+            }
+            break;
+        case OP_EQUAL:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] == b[l];
+                f[l] |= fb[l];
+            }
+            break;
+        case OP_NOT_EQUAL:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] != b[l];
+                f[l] |= fb[l];
+            }
+            break;
+        case OP_LESS:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] < b[l];
+                f[l] |= fb[l];
+            }
+            break;
+        case OP_LESS_EQUAL:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] <= b[l];
+                f[l] |= fb[l];
+            }
+            break;
+        case OP_GREATER:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] > b[l];
+                f[l] |= fb[l];
+            }
+            break;
+        case OP_GREATER_EQUAL:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] >= b[l];
+                f[l] |= fb[l];
+            }
+            break;
+        // The right operand of && and || only counts, faults included, when the left one does not decide.
+        case OP_AND:
+            for (u32 l = 0; l < lanes; l++) {
+                bool decided = a[l] == 0;
+                r[l] = !decided & (b[l] != 0);
+                f[l] |= decided ? 0 : fb[l];
+            }
+            break;
+        case OP_OR:
+            for (u32 l = 0; l < lanes; l++) {
+                bool decided = a[l] != 0;
+                r[l] = decided | (b[l] != 0);
+                f[l] |= decided ? 0 : fb[l];
+            }
+            break;
+        case OP_NOT:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = a[l] == 0;
+            }
+            break;
+        case OP_NEGATE:
+            for (u32 l = 0; l < lanes; l++) {
+                r[l] = -a[l];
+            }
+            break;
+        case OP_SELECT:
+            for (u32 l = 0; l < lanes; l++) {
+                bool c = a[l] != 0;
+                r[l] = c ? b[l] : x[l];
+                f[l] |= c ? fb[l] : fx[l];
+            }
+            break;
+        case OP_CALL:
+            for (u32 l = 0; l < lanes; l++) {
+                double args[in->arity];
+                u8 fault = 0;
+                for (u32 i = 0; i < in->arity; i++) {
+                    args[i] = values[base + i][l];
+                    fault |= faults[base + i][l];
+                }
+                r[l] = in->function(args);
+                f[l] = fault;
+            }
+            break;
+        case OP_INVOKE: {
+            // The arguments are the columns of the callee's parameters.
+            const Program* callee = getUserFunction(in->operand)->program;
+            const RUN_REAL* columns[in->arity];
+            u8 fault[PROGRAM_LANES] = {0};
+            for (u32 i = 0; i < in->arity; i++) {
+                columns[i] = values[base + i];
+                for (u32 l = 0; l < lanes; l++) {
+                    fault[l] |= faults[base + i][l];
+                }
+            }
+            RUN_NAME(callee, null, &(LaneRange){.RUN_COLUMNS = columns}, lanes, r, f);
+            for (u32 l = 0; l < lanes; l++) {
+                f[l] |= fault[l];
+            }
+            break;
+        }
+        case OP_SUM:
+        case OP_PROD: {
+            // Nested reductions run serially, the outer one is already spread over the threads.
+            // Programs without parameters are statements, only run from the top level: theirs can use the pool.
+            const Program* body = ((Program**)program->subprograms.a)[in->operand];
+            ReduceKind kind = in->opcode == OP_SUM ? REDUCE_SUM : REDUCE_PROD;
+            double inner[body->params];
+            if (program->params > 1 && range->RUN_COLUMNS == null)
+                memcpy(inner, params, (program->params - 1) * sizeof(double));
+            for (u32 l = 0; l < lanes; l++) {
+                for (u32 k = 0; range->RUN_COLUMNS != null && k < program->params; k++) {
+                    inner[k] = range->RUN_COLUMNS[k][range->index + l];
+                }
+                if (program->params > 0 && range->RUN_COLUMNS == null)
+                    inner[program->params - 1] = range->origin + (range->index + l) * range->step;
+                u8 fault = f[l] | fb[l];
+                r[l] = programReduce(body, kind, inner, a[l], b[l], program->params == 0, &fault);
+                f[l] = fault;
+            }
+            break;
+        }
+        }
+#ifdef RUN_ROUNDS
+        // Loads, negations and comparisons give exact results.
+        if (in->opcode != OP_NOT && in->opcode != OP_NEGATE && in->opcode > OP_PARAM)
+            roundLanes(r, lanes);
+#endif
+        top = base + 1;
+    }
+
+    memcpy(out, values[0], lanes * sizeof(RUN_REAL));
+    memcpy(outFaults, faults[0], lanes);
+}
+
+#undef RUN_NAME
+#undef RUN_REAL
+#undef RUN_COLUMNS
+#undef RUN_ROUNDS
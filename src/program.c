@@ -0,0 +1,469 @@
+#include "program.h"
+#include "error.h"
+#include "thread-pool.h"
+#include "util.h"
+#include "var-handler.h"
+
+#include <math.h>
+#include <stdint.h>
+
+// Terms evaluated into one buffer, then reduced pairwise.
+#define BLOCK_TERMS 1024
+// Upper bound on the number of chunks a reduction is split into, each chunk being one task of the pool.
+#define MAX_CHUNKS 1024
+// Beyond this, consecutive indices are not all representable anymore.
+#define MAX_TERMS (1ul << 53)
+
+typedef struct compiler {
+    Program* program;
+    const u32* bound;
+    u32 boundCount;
+    u32 depth;
+    // Compiling on another thread: nothing but the tree is read, see programCompileDetached.
+    bool detached;
+    darray* literals; // ProgramLiteral, null if they are not recorded
+} Compiler;
+
+static bool compileNode(Compiler* c, EvalNode* tree);
+static Program* compile(EvalNode* tree, const u32* bound, u32 boundCount, bool detached, darray* literals);
+
+Program* programCreate(u32 params) {
+    Program* program = memAlloc(MEM_PROGRAM, sizeof *program);
+    if (program == null)
+        return null;
+    darrayInitIn(&program->code, 16, sizeof(Instruction), MEM_PROGRAM);
+    darrayInitIn(&program->constants, 4, sizeof(Number), MEM_PROGRAM);
+    darrayInitIn(&program->subprograms, 1, sizeof(Program*), MEM_PROGRAM);
+    program->maxDepth = 0;
+    program->params = params;
+    return program;
+}
+
+void programDestroy(Program* program) {
+    if (program == null)
+        return;
+    for (u64 i = 0; i < darrayLength(&program->subprograms); i++) {
+        programDestroy(((Program**)program->subprograms.a)[i]);
+    }
+    darrayEmpty(&program->code);
+    darrayEmpty(&program->constants);
+    darrayEmpty(&program->subprograms);
+    memFree(program);
+}
+
+// Appends an instruction popping ARITY values and pushing one.
+static bool emit(Compiler* c, Opcode opcode, u32 arity, u32 operand, functionptr function) {
+    Instruction instruction = {opcode, arity, operand, function};
+    if (!darrayAdd(&c->program->code, instruction))
+        return false;
+    c->depth = c->depth + 1 - arity;
+    if (c->depth > c->program->maxDepth)
+        c->program->maxDepth = c->depth;
+    return true;
+}
+
+Opcode programOpcode(functionptr function) {
+    static const struct {
+        const Function* function;
+        Opcode opcode;
+    } table[] = {
+        {&ADD, OP_ADD},         {&SUBTRACT, OP_SUBTRACT},   {&MULTIPLY, OP_MULTIPLY},
+        {&DIVIDE, OP_DIVIDE},   {&EQUAL, OP_EQUAL},         {&NOT_EQUAL, OP_NOT_EQUAL},
+        {&LESS, OP_LESS},       {&LESS_EQUAL, OP_LESS_EQUAL}, {&GREATER, OP_GREATER},
+        {&GREATER_EQUAL, OP_GREATER_EQUAL}, {&AND, OP_AND}, {&OR, OP_OR},
+        {&NOT, OP_NOT},         {&SELECT, OP_SELECT},       {&SUM, OP_SUM},
+        {&PROD, OP_PROD},       {&NEGATE, OP_NEGATE},
+    };
+    for (u64 i = 0; i < sizeof table / sizeof *table; i++) {
+        if (table[i].function->ptr == function)
+            return table[i].opcode;
+    }
+    return OP_CALL;
+}
+
+// Whether PROGRAM, or a function it calls, reads the variable in SLOT.
+static bool programReads(const Program* program, u32 slot) {
+    const Instruction* code = program->code.a;
+    for (u64 pc = 0; pc < program->code.length; pc++) {
+        if (code[pc].opcode == OP_VARIABLE && code[pc].operand == slot)
+            return true;
+        if (code[pc].opcode == OP_INVOKE && programReads(getUserFunction(code[pc].operand)->program, slot))
+            return true;
+    }
+    for (u64 i = 0; i < program->subprograms.length; i++) {
+        if (programReads(((Program**)program->subprograms.a)[i], slot))
+            return true;
+    }
+    return false;
+}
+
+// Calls run the program of the callee, which reads variables, not the parameters of the caller: the callee must not
+// read the variables bound around the call, which are only set when the call is walked.
+static bool compileCall(Compiler* c, EvalNode* tree) {
+    // Callees are compiled on their first call, by the thread evaluating the statements.
+    if (c->detached)
+        return false;
+    const Program* callee = userFunctionProgram(tree->variable);
+    if (callee == null)
+        return false;
+    for (u32 k = 0; k < c->boundCount; k++) {
+        if (programReads(callee, c->bound[k]))
+            return false;
+    }
+    for (u64 i = 0; i < tree->arity; i++) {
+        if (!compileNode(c, treeChild(tree, i)))
+            return false;
+    }
+    return emit(c, OP_INVOKE, tree->arity, tree->variable, null);
+}
+
+// Reductions: the bounds are computed by the enclosing program, the body becomes a subprogram
+// with one more parameter, its own index.
+static bool compileReduction(Compiler* c, EvalNode* tree, Opcode opcode) {
+    if (!compileNode(c, treeChild(tree, 1)) || !compileNode(c, treeChild(tree, 2)))
+        return false;
+    u32 bound[c->boundCount + 1];
+    memcpy(bound, c->bound, c->boundCount * sizeof(u32));
+    bound[c->boundCount] = treeChild(tree, 0)->variable;
+    Program* body = compile(treeChild(tree, 3), bound, c->boundCount + 1, c->detached, c->literals);
+    if (body == null)
+        return false;
+    u32 index = darrayLength(&c->program->subprograms);
+    if (!darrayAdd(&c->program->subprograms, body)) {
+        programDestroy(body);
+        return false;
+    }
+    return emit(c, opcode, 2, index, null);
+}
+
+static bool compileNode(Compiler* c, EvalNode* tree) {
+    // Programs only compute numbers.
+    if (tree->kind == LBRACKET)
+        return false;
+    if (tree->kind == NUMBER) {
+        u32 index = darrayLength(&c->program->constants);
+        ProgramLiteral literal = {c->program, index, tree->token};
+        if (c->literals != null && !darrayAdd(c->literals, literal))
+            return false;
+        return darrayAdd(&c->program->constants, tree->literal) && emit(c, OP_CONST, 0, index, null);
+    }
+    if (tree->kind == NAME && tree->function == null) {
+        // Innermost reductions first, their index shadows the outer ones.
+        for (u32 k = c->boundCount; k > 0; k--) {
+            if (c->bound[k - 1] == tree->variable)
+                return emit(c, OP_PARAM, 0, k - 1, null);
+        }
+        return (c->detached || varMatrix(tree->variable) == null) && emit(c, OP_VARIABLE, 0, tree->variable, null);
+    }
+    // Solvers iterate until convergence, which does not fit in lanes.
+    if (isSolver(tree->function))
+        return false;
+    if (tree->function == CALL.ptr)
+        return compileCall(c, tree);
+    Opcode opcode = programOpcode(tree->function);
+    if (opcode == OP_SUM || opcode == OP_PROD)
+        return compileReduction(c, tree, opcode);
+    for (u64 i = 0; i < tree->arity; i++) {
+        if (!compileNode(c, treeChild(tree, i)))
+            return false;
+    }
+    return emit(c, opcode, tree->arity, 0, tree->function);
+}
+
+static Program* compile(EvalNode* tree, const u32* bound, u32 boundCount, bool detached, darray* literals) {
+    Program* program = programCreate(boundCount);
+    if (program == null)
+        return null;
+    Compiler c = {program, bound, boundCount, 0, detached, literals};
+    if (!compileNode(&c, tree)) {
+        programDestroy(program);
+        return null;
+    }
+    return program;
+}
+
+Program* programCompile(EvalNode* tree, const u32* bound, u32 boundCount) {
+    return compile(tree, bound, boundCount, false, null);
+}
+
+Program* programCompileDetached(EvalNode* tree, darray* literals) {
+    return compile(tree, null, 0, true, literals);
+}
+
+bool programReadsMatrices(const Program* program) {
+    const Instruction* code = program->code.a;
+    for (u64 pc = 0; pc < program->code.length; pc++) {
+        if (code[pc].opcode == OP_VARIABLE && varMatrix(code[pc].operand) != null)
+            return true;
+    }
+    for (u64 i = 0; i < program->subprograms.length; i++) {
+        if (programReadsMatrices(((Program**)program->subprograms.a)[i]))
+            return true;
+    }
+    return false;
+}
+
+static double combine(ReduceKind kind, double a, double b) {
+    return roundToPrecision(kind == REDUCE_SUM ? a + b : a * b);
+}
+
+// Reduces VALUES in place, pairing neighbours until a single value is left.
+static double pairwise(ReduceKind kind, double* values, u64 count) {
+    if (count == 0)
+        return kind == REDUCE_SUM ? 0 : 1;
+    while (count > 1) {
+        u64 half = count / 2;
+        for (u64 i = 0; i < half; i++) {
+            values[i] = combine(kind, values[2 * i], values[2 * i + 1]);
+        }
+        if (count % 2 != 0)
+            values[half] = values[count - 1];
+        count -= half;
+    }
+    return values[0];
+}
+
+static void roundLanes(double* values, u32 lanes) {
+    if (getPrecision() != PRECISION_F32)
+        return;
+    for (u32 l = 0; l < lanes; l++) {
+        values[l] = (float)values[l];
+    }
+}
+
+#define RUN_NAME programRun
+#define RUN_REAL double
+#define RUN_COLUMNS columns
+#define RUN_ROUNDS
+#include "./program-run.h"
+
+// Float lanes are computed in floats directly: + - * / of floats are correctly rounded, results of calls and
+// reductions are rounded when they are stored.
+#define RUN_NAME programRunFloat
+#define RUN_REAL float
+#define RUN_COLUMNS floatColumns
+#include "./program-run.h"
+
+// Square and multiply, every step checked for overflow.
+static bool integerPower(i64 base, i64 exponent, i64* out) {
+    if (exponent < 0)
+        return false;
+    i64 result = 1;
+    while (true) {
+        if ((exponent & 1) && __builtin_mul_overflow(result, base, &result))
+            return false;
+        exponent >>= 1;
+        if (exponent == 0)
+            break;
+        // Squaring can only overflow when the result would too, unless |base| <= 1.
+        if (__builtin_mul_overflow(base, base, &base))
+            return false;
+    }
+    *out = result;
+    return true;
+}
+
+bool integerApply(Opcode opcode, functionptr function, const i64* args, i64* out) {
+    switch (opcode) {
+    case OP_ADD:
+        return !__builtin_add_overflow(args[0], args[1], out);
+    case OP_SUBTRACT:
+        return !__builtin_sub_overflow(args[0], args[1], out);
+    case OP_MULTIPLY:
+        return !__builtin_mul_overflow(args[0], args[1], out);
+    case OP_DIVIDE:
+        // Division by zero is reported by the floating-point evaluation.
+        if (args[1] == 0 || (args[0] == INT64_MIN && args[1] == -1) || args[0] % args[1] != 0)
+            return false;
+        *out = args[0] / args[1];
+        return true;
+    case OP_NEGATE:
+        return !__builtin_sub_overflow(0, args[0], out);
+    case OP_EQUAL:
+        *out = args[0] == args[1];
+        return true;
+    case OP_NOT_EQUAL:
+        *out = args[0] != args[1];
+        return true;
+    case OP_LESS:
+        *out = args[0] < args[1];
+        return true;
+    case OP_LESS_EQUAL:
+        *out = args[0] <= args[1];
+        return true;
+    case OP_GREATER:
+        *out = args[0] > args[1];
+        return true;
+    case OP_GREATER_EQUAL:
+        *out = args[0] >= args[1];
+        return true;
+    case OP_AND:
+        *out = args[0] != 0 && args[1] != 0;
+        return true;
+    case OP_OR:
+        *out = args[0] != 0 || args[1] != 0;
+        return true;
+    case OP_NOT:
+        *out = args[0] == 0;
+        return true;
+    case OP_SELECT:
+        *out = args[0] != 0 ? args[1] : args[2];
+        return true;
+    case OP_CALL:
+        if (function == ABS.ptr) {
+            *out = args[0];
+            return args[0] >= 0 || !__builtin_sub_overflow(0, args[0], out);
+        }
+        if (function == MIN.ptr) {
+            *out = args[0] < args[1] ? args[0] : args[1];
+            return true;
+        }
+        if (function == MAX.ptr) {
+            *out = args[0] > args[1] ? args[0] : args[1];
+            return true;
+        }
+        if (function == POW.ptr)
+            return integerPower(args[0], args[1], out);
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool programRunExact(const Program* program, i64* out) {
+    i64 values[program->maxDepth];
+    bool exact[program->maxDepth];
+    const Instruction* code = program->code.a;
+    const Number* constants = program->constants.a;
+    u32 top = 0;
+
+    for (u64 pc = 0; pc < program->code.length; pc++) {
+        const Instruction* in = code + pc;
+        u32 base = top - in->arity;
+        i64* a = values + base;
+        bool* e = exact + base;
+        switch (in->opcode) {
+        case OP_CONST:
+            *a = constants[in->operand].integer;
+            *e = constants[in->operand].exact;
+            break;
+        case OP_VARIABLE: {
+            Number variable = varGetNumber(in->operand);
+            *a = variable.integer;
+            *e = variable.exact;
+            break;
+        }
+        // Like the lanes, the operand which is not selected does not count.
+        case OP_AND:
+        case OP_OR: {
+            bool decided = e[0] && (a[0] != 0) == (in->opcode == OP_OR);
+            e[0] = decided || (e[0] && e[1]);
+            a[0] = decided ? in->opcode == OP_OR : a[1] != 0;
+            break;
+        }
+        case OP_SELECT: {
+            u32 chosen = a[0] != 0 ? 1 : 2;
+            e[0] = e[0] && e[chosen];
+            a[0] = a[chosen];
+            break;
+        }
+        default: {
+            bool all = true;
+            for (u32 i = 0; i < in->arity; i++) {
+                all &= e[i];
+            }
+            i64 result = 0;
+            e[0] = all && integerApply(in->opcode, in->function, a, &result);
+            a[0] = result;
+            break;
+        }
+        }
+        top = base + 1;
+    }
+    *out = values[0];
+    return exact[0];
+}
+
+typedef struct reduction {
+    const Program* body;
+    ReduceKind kind;
+    const double* params;
+    double first;
+    u64 count;
+    u64 chunkSize;
+    double* partials;
+    u8* faults;
+} Reduction;
+
+// Reduces the COUNT terms starting at index FIRST, splitting at multiples of BLOCK_TERMS.
+static double reduceTerms(Reduction* r, double first, u64 count, u8* faults) {
+    if (count > BLOCK_TERMS) {
+        u64 half = (count / 2 + BLOCK_TERMS - 1) / BLOCK_TERMS * BLOCK_TERMS;
+        double left = reduceTerms(r, first, half, faults);
+        return combine(r->kind, left, reduceTerms(r, first + half, count - half, faults));
+    }
+    double terms[BLOCK_TERMS];
+    float floatTerms[BLOCK_TERMS];
+    bool floats = getPrecision() == PRECISION_F32;
+    u8 termFaults[PROGRAM_LANES];
+    for (u64 offset = 0; offset < count; offset += PROGRAM_LANES) {
+        u32 lanes = count - offset < PROGRAM_LANES ? count - offset : PROGRAM_LANES;
+        LaneRange range = {first, 1, offset, null, null};
+        if (floats)
+            programRunFloat(r->body, r->params, &range, lanes, floatTerms + offset, termFaults);
+        else
+            programRun(r->body, r->params, &range, lanes, terms + offset, termFaults);
+        for (u32 l = 0; l < lanes; l++) {
+            *faults |= termFaults[l];
+        }
+    }
+    for (u64 i = 0; floats && i < count; i++) {
+        terms[i] = floatTerms[i];
+    }
+    return pairwise(r->kind, terms, count);
+}
+
+static void reduceChunk(void* arg, u64 index) {
+    Reduction* r = arg;
+    u64 begin = index * r->chunkSize;
+    u64 count = r->count - begin < r->chunkSize ? r->count - begin : r->chunkSize;
+    r->faults[index] = 0;
+    r->partials[index] = reduceTerms(r, r->first + begin, count, r->faults + index);
+}
+
+double programReduce(const Program* body, ReduceKind kind, const double* params, double first, double last,
+                     bool parallel, u8* outFaults) {
+    if (!isfinite(first) || !isfinite(last) || last - first >= MAX_TERMS) {
+        *outFaults |= FAULT_RANGE;
+        return 0;
+    }
+    u64 count = last >= first ? (u64)(last - first) + 1 : 0;
+    // The chunking only depends on the number of terms, never on the number of threads.
+    u64 chunkSize = (count + MAX_CHUNKS - 1) / MAX_CHUNKS;
+    chunkSize = (chunkSize + BLOCK_TERMS - 1) / BLOCK_TERMS * BLOCK_TERMS;
+    if (chunkSize == 0)
+        chunkSize = BLOCK_TERMS;
+    u64 chunks = (count + chunkSize - 1) / chunkSize;
+
+    double partials[MAX_CHUNKS];
+    u8 faults[MAX_CHUNKS];
+    Reduction r = {body, kind, params, first, count, chunkSize, partials, faults};
+    if (parallel) {
+        poolFor(chunks, reduceChunk, &r);
+    } else {
+        for (u64 i = 0; i < chunks; i++) {
+            reduceChunk(&r, i);
+        }
+    }
+    for (u64 i = 0; i < chunks; i++) {
+        *outFaults |= faults[i];
+    }
+    return pairwise(kind, partials, chunks);
+}
+
+void signalFaults(u8 faults) {
+    if (faults & FAULT_DIV_BY_ZERO)
+        signalErrorNoToken(ERR_DIV_BY_ZERO, null, -1);
+    if (faults & FAULT_RANGE)
+        signalErrorNoToken(ERR_INVALID_RANGE, null, -1);
+}
@@ -0,0 +1,85 @@
+#include "ring.h"
+#include "memory.h"
+
+#include <sched.h>
+#include <time.h>
+
+#define SPIN_LIMIT 64
+#define YIELD_LIMIT 128
+#define MAX_SLEEP_NS 1000000
+
+bool ringInit(Ring* ring, u64 capacity) {
+    // Larger capacities cannot be rounded up.
+    if (capacity > 1ul << 63)
+        return false;
+    u64 size = 2;
+    while (size < capacity)
+        size <<= 1;
+    ring->slots = memAlloc(MEM_GENERAL, size * sizeof(void*));
+    if (ring->slots == null)
+        return false;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->cachedHead = 0;
+    ring->cachedTail = 0;
+    return true;
+}
+
+void ringDestroy(Ring* ring) {
+    memFree(ring->slots);
+    ring->slots = null;
+}
+
+bool ringTryPush(Ring* ring, void* item) {
+    u64 tail = ring->tail;
+    if (tail - ring->cachedHead > ring->mask) {
+        ring->cachedHead = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->cachedHead > ring->mask)
+            return false;
+    }
+    ring->slots[tail & ring->mask] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool ringTryPop(Ring* ring, void** outItem) {
+    u64 head = ring->head;
+    if (head == ring->cachedTail) {
+        ring->cachedTail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->cachedTail)
+            return false;
+    }
+    *outItem = ring->slots[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Called while waiting on the other side of the ring. The wait gets longer the more we wait,
+// so that an idle pipeline (e.g. waiting on a terminal) does not burn a core.
+static void backoff(u64* attempts) {
+    u64 n = (*attempts)++;
+    if (n < SPIN_LIMIT) {
+        __builtin_ia32_pause();
+    } else if (n < YIELD_LIMIT) {
+        sched_yield();
+    } else {
+        u64 ns = (n - YIELD_LIMIT + 1) * 1000;
+        struct timespec ts = {0, ns > MAX_SLEEP_NS ? MAX_SLEEP_NS : ns};
+        nanosleep(&ts, null);
+    }
+}
+
+void ringPush(Ring* ring, void* item) {
+    u64 attempts = 0;
+    while (!ringTryPush(ring, item))
+        backoff(&attempts);
+}
+
+void* ringPop(Ring* ring) {
+    u64 attempts = 0;
+    void* item;
+    while (!ringTryPop(ring, &item))
+        backoff(&attempts);
+    return item;
+}
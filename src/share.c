@@ -0,0 +1,211 @@
+#include "share.h"
+#include "error.h"
+#include "memory.h"
+#include "var-handler.h"
+
+// Values are stored in buckets of a few entries, the bucket of a key being picked by its first half.
+#define SHARE_WAYS 4
+// Smaller subtrees are cheaper to evaluate than to look up, unless they bind variables, as reductions do.
+#define SHARE_MIN_NODES 8
+
+typedef struct share_entry {
+    u64 key[2];
+    double value;
+    u64 used; // tick of the last lookup or store, 0 for empty entries
+} ShareEntry;
+
+typedef struct node_key {
+    u64 key[2];
+    bool shareable;
+} NodeKey;
+
+static ShareEntry* table = null;
+static u64 bucketCount = 0;
+static u64 tick = 0;
+
+u64 shareMinBudget() {
+    return SHARE_WAYS * sizeof(ShareEntry);
+}
+
+bool initShare(u64 budget) {
+    u64 bucketSize = shareMinBudget();
+    if (budget < bucketSize)
+        return false;
+    bucketCount = 1;
+    while (bucketCount * 2 <= budget / bucketSize) {
+        bucketCount *= 2;
+    }
+    table = memAlloc(MEM_SHARE, bucketCount * bucketSize);
+    if (table == null) {
+        clearErrors();
+        bucketCount = 0;
+        return false;
+    }
+    for (u64 i = 0; i < bucketCount * SHARE_WAYS; i++) {
+        table[i].used = 0;
+    }
+    return true;
+}
+
+void shutShare() {
+    memFree(table);
+    table = null;
+    bucketCount = 0;
+}
+
+bool isShareEnabled() {
+    return table != null;
+}
+
+// Two independent hashes make 128-bit keys: distinct subtrees practically never collide.
+static const u64 SEEDS[2] = {0xcbf29ce484222325ul, 0x84222325cbf29ce4ul};
+static const u64 MULTIPLIERS[2] = {0x9e3779b97f4a7c15ul, 0xff51afd7ed558ccdul};
+
+static void mix(u64* key, u64 word) {
+    for (int k = 0; k < 2; k++) {
+        u64 h = (key[k] ^ word) * MULTIPLIERS[k];
+        key[k] = h ^ (h >> 32);
+    }
+}
+
+static u64 bits(double value) {
+    union {
+        double value;
+        u64 bits;
+    } u = {value};
+    return u.bits;
+}
+
+static bool keyLess(const NodeKey* a, const NodeKey* b) {
+    return a->key[0] != b->key[0] ? a->key[0] < b->key[0] : a->key[1] < b->key[1];
+}
+
+// Hashes the subtree of TREE into KEYS, which holds its nodes in preorder starting at INDEX.
+// Outside the nodes binding variables, a variable hashes as its value, like the literal it equals. Inside, which
+// variable it is matters too: the bound ones do not have their current value.
+static void hashTree(EvalNode* tree, NodeKey* keys, u64 index, bool bound) {
+    NodeKey* node = keys + index;
+    node->key[0] = SEEDS[0];
+    node->key[1] = SEEDS[1];
+    node->shareable = true;
+    if (tree->kind == NUMBER || (tree->kind == NAME && tree->function == null)) {
+        bool variable = tree->kind == NAME;
+        if (variable && bound)
+            mix(node->key, (u64)tree->variable + 1);
+        mix(node->key, bits(variable ? varGet(tree->variable) : tree->literal.value));
+        return;
+    }
+    bound |= isReduction(tree->function);
+    // Solvers report notes, call bodies read variables which are not leaves, matrices are not evaluated here.
+    node->shareable = !isSolver(tree->function) && tree->function != CALL.ptr && tree->kind != LBRACKET;
+    mix(node->key, (u64)tree->function);
+    mix(node->key, tree->arity);
+    u64 children[tree->arity];
+    u64 child = index + 1;
+    for (u64 i = 0; i < tree->arity; i++) {
+        EvalNode* subtree = treeChild(tree, i);
+        hashTree(subtree, keys, child, bound);
+        node->shareable &= keys[child].shareable;
+        children[i] = child;
+        child += subtree->size;
+    }
+    // a + b and b + a are the same value, even in floating point.
+    bool commutative = (tree->function == ADD.ptr || tree->function == MULTIPLY.ptr) && tree->arity == 2;
+    if (commutative && keyLess(keys + children[1], keys + children[0])) {
+        u64 first = children[0];
+        children[0] = children[1];
+        children[1] = first;
+    }
+    for (u64 i = 0; i < tree->arity; i++) {
+        mix(node->key, keys[children[i]].key[0]);
+        mix(node->key, keys[children[i]].key[1]);
+    }
+}
+
+static ShareEntry* bucketOf(const NodeKey* key) {
+    return table + (key->key[0] & (bucketCount - 1)) * SHARE_WAYS;
+}
+
+static ShareEntry* lookup(const NodeKey* key) {
+    ShareEntry* bucket = bucketOf(key);
+    for (u32 i = 0; i < SHARE_WAYS; i++) {
+        if (bucket[i].used != 0 && bucket[i].key[0] == key->key[0] && bucket[i].key[1] == key->key[1]) {
+            bucket[i].used = ++tick;
+            return bucket + i;
+        }
+    }
+    return null;
+}
+
+// Takes the empty entry of the bucket, or evicts its least recently used one.
+static void store(const NodeKey* key, double value) {
+    ShareEntry* bucket = bucketOf(key);
+    ShareEntry* victim = bucket;
+    for (u32 i = 1; i < SHARE_WAYS && victim->used != 0; i++) {
+        if (bucket[i].used < victim->used)
+            victim = bucket + i;
+    }
+    *victim = (ShareEntry){{key->key[0], key->key[1]}, value, ++tick};
+}
+
+// Walks TREE like treeEval does, looking its subtrees up first. Nodes binding variables are evaluated whole:
+// their subtrees are not looked up, the bound variables do not have the values they were hashed with.
+static double evalShared(EvalNode* tree, const NodeKey* keys, u64 index) {
+    if (getErrorCount() > 0)
+        return 0;
+    const NodeKey* key = keys + index;
+    bool shared = key->shareable && (tree->size >= SHARE_MIN_NODES || tree->binds);
+    if (shared) {
+        ShareEntry* entry = lookup(key);
+        if (entry != null)
+            return entry->value;
+    }
+    double value;
+    if (tree->arity == 0 || isReduction(tree->function) || isSolver(tree->function) || tree->function == CALL.ptr) {
+        value = treeEval(tree);
+    } else {
+        u64 children[tree->arity];
+        children[0] = index + 1;
+        for (u64 i = 1; i < tree->arity; i++) {
+            children[i] = children[i - 1] + treeChild(tree, i - 1)->size;
+        }
+        if (tree->lazy) {
+            // AND, OR and SELECT: only the operands that decide the result are evaluated.
+            double first = evalShared(treeChild(tree, 0), keys, children[0]);
+            if (getErrorCount() > 0)
+                return 0;
+            if (tree->function == AND.ptr)
+                value = first != 0 && evalShared(treeChild(tree, 1), keys, children[1]) != 0;
+            else if (tree->function == OR.ptr)
+                value = first != 0 || evalShared(treeChild(tree, 1), keys, children[1]) != 0;
+            else
+                value = evalShared(treeChild(tree, first != 0 ? 1 : 2), keys, children[first != 0 ? 1 : 2]);
+        } else {
+            double args[tree->arity];
+            for (u64 i = 0; i < tree->arity; i++) {
+                args[i] = evalShared(treeChild(tree, i), keys, children[i]);
+                if (getErrorCount() > 0)
+                    return 0;
+            }
+            value = roundToPrecision(tree->function(args));
+        }
+    }
+    if (shared && getErrorCount() == 0)
+        store(key, value);
+    return value;
+}
+
+double treeEvalShared(EvalNode* tree) {
+    if (tree == null || table == null || getErrorCount() > 0)
+        return treeEval(tree);
+    NodeKey* keys = memAlloc(MEM_SHARE, tree->size * sizeof(NodeKey));
+    if (keys == null) {
+        // Allocation failures are not errors of the expression.
+        clearErrors();
+        return treeEvalParallel(tree);
+    }
+    hashTree(tree, keys, 0, false);
+    double value = evalShared(tree, keys, 0);
+    memFree(keys);
+    return value;
+}
@@ -0,0 +1,301 @@
+#include "solver.h"
+#include "error.h"
+#include "var-handler.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Reports are per thread, like errors.
+static __thread darray* reports = null;
+
+typedef struct objective {
+    EvalNode* tree;
+    const Program* program;
+    u32 slot;
+    u8 faults;
+} Objective;
+
+static void report(const char* command, const char* method, u32 iterations, bool converged, double x, double value) {
+    if (reports == null) {
+        reports = darrayCreateIn(2, sizeof(SolverReport), MEM_GENERAL);
+        if (reports == null)
+            return;
+    }
+    SolverReport r = {command, method, iterations, converged, x, value};
+    darrayAdd(reports, r);
+}
+
+char* formatSolverReports(u64* outLength) {
+    *outLength = 0;
+    if (reports == null || darrayLength(reports) == 0)
+        return null;
+    char* buffer = null;
+    size_t length = 0;
+    FILE* stream = open_memstream(&buffer, &length);
+    if (stream == null)
+        return null;
+    for (u64 i = 0; i < darrayLength(reports); i++) {
+        SolverReport* r = darrayGetPtr(reports, i);
+        fprintf(stream, "%s: x = %.17g, f(x) = %g, %s, ", r->command, r->x, r->value, r->method);
+        if (r->converged)
+            fprintf(stream, "converged in %u iterations\n", r->iterations);
+        else
+            fprintf(stream, "did not converge after %u iterations\n", r->iterations);
+    }
+    fclose(stream);
+    darrayClear(reports);
+    *outLength = length;
+    return buffer;
+}
+
+// Smooth trees only use differentiable functions: Newton's method can rely on their derivative.
+static bool isSmooth(EvalNode* tree) {
+    if (tree->kind == NUMBER || (tree->kind == NAME && tree->function == null))
+        return true;
+    if (!isReduction(tree->function) && (tree->lazy || tree->partials == null))
+        return false;
+    for (u64 i = 0; i < tree->arity; i++) {
+        if (!isSmooth(treeChild(tree, i)))
+            return false;
+    }
+    return true;
+}
+
+static double evalAt(Objective* o, double x) {
+    if (o->program == null) {
+        double saved = varGet(o->slot);
+        varSet(o->slot, x);
+        double value = treeEval(o->tree);
+        varSet(o->slot, saved);
+        return value;
+    }
+    double value;
+    u8 faults;
+    LaneRange range = {x, 0, 0, null, null};
+    programRun(o->program, null, &range, 1, &value, &faults);
+    o->faults |= faults;
+    return value;
+}
+
+// Value and derivative in a single dual evaluation.
+static double evalWithDerivative(Objective* o, double x, double* outDerivative) {
+    double dual[o->slot + 2];
+    double saved = varGet(o->slot);
+    varSet(o->slot, x);
+    treeEvalDual(o->tree, o->slot + 1, dual);
+    varSet(o->slot, saved);
+    *outDerivative = dual[1 + o->slot];
+    return dual[0];
+}
+
+// Relative to X, and absolute relative to WIDTH, the width of the initial bracket: roots at 0 have no scale of
+// their own.
+static double tolerance(double x, double width) {
+    return 4 * DBL_EPSILON * fabs(x) + DBL_EPSILON * width;
+}
+
+static bool failed(Objective* o) {
+    if (o->faults != 0)
+        signalFaults(o->faults);
+    return getErrorCount() > 0;
+}
+
+// Newton's method, falling back to bisection whenever the step would leave the bracket [LOW, HIGH]
+// or would not shrink it fast enough. F(LOW) < 0 < F(HIGH) or the opposite.
+static double newton(Objective* o, double low, double high, double fLow) {
+    // Orient the bracket so that f(below) < 0 < f(above).
+    double below = fLow < 0 ? low : high;
+    double above = fLow < 0 ? high : low;
+    double x = 0.5 * (low + high);
+    double width = fabs(high - low);
+    double step = width;
+    double previousStep = step;
+    double df;
+    double f = evalWithDerivative(o, x, &df);
+    for (u32 i = 1; i <= SOLVER_MAX_ITERATIONS; i++) {
+        if (getErrorCount() > 0)
+            return 0;
+        if (f == 0) {
+            report("solve", "newton", i, true, x, f);
+            return x;
+        }
+        bool outside = ((x - above) * df - f) * ((x - below) * df - f) > 0;
+        if (outside || !isfinite(df) || fabs(2 * f) > fabs(previousStep * df)) {
+            previousStep = step;
+            step = 0.5 * (above - below);
+            x = below + step;
+        } else {
+            previousStep = step;
+            step = f / df;
+            x -= step;
+        }
+        if (fabs(step) <= tolerance(x, width)) {
+            f = evalWithDerivative(o, x, &df);
+            report("solve", "newton", i, true, x, f);
+            return x;
+        }
+        f = evalWithDerivative(o, x, &df);
+        if (f < 0)
+            below = x;
+        else
+            above = x;
+    }
+    report("solve", "newton", SOLVER_MAX_ITERATIONS, false, x, f);
+    return x;
+}
+
+// Brent's method: inverse quadratic interpolation or secant steps, bisection when they do not converge.
+static double brentRoot(Objective* o, double a, double b, double fa, double fb) {
+    double c = b, fc = fb, d = b - a, e = d;
+    double width = fabs(b - a);
+    for (u32 i = 1; i <= SOLVER_MAX_ITERATIONS; i++) {
+        if ((fb > 0) == (fc > 0)) {
+            // The root is between a and b, c takes the role of the other end.
+            c = a;
+            fc = fa;
+            d = e = b - a;
+        }
+        if (fabs(fc) < fabs(fb)) {
+            a = b;
+            b = c;
+            c = a;
+            fa = fb;
+            fb = fc;
+            fc = fa;
+        }
+        double tol = tolerance(b, width);
+        double middle = 0.5 * (c - b);
+        if (fabs(middle) <= tol || fb == 0) {
+            report("solve", "brent", i, true, b, fb);
+            return b;
+        }
+        if (fabs(e) >= tol && fabs(fa) > fabs(fb)) {
+            double s = fb / fa, p, q;
+            if (a == c) {
+                p = 2 * middle * s;
+                q = 1 - s;
+            } else {
+                double r = fb / fc;
+                q = fa / fc;
+                p = s * (2 * middle * q * (q - r) - (b - a) * (r - 1));
+                q = (q - 1) * (r - 1) * (s - 1);
+            }
+            if (p > 0)
+                q = -q;
+            p = fabs(p);
+            if (2 * p < fmin(3 * middle * q - fabs(tol * q), fabs(e * q))) {
+                e = d;
+                d = p / q;
+            } else {
+                d = middle;
+                e = d;
+            }
+        } else {
+            d = middle;
+            e = d;
+        }
+        a = b;
+        fa = fb;
+        b += fabs(d) > tol ? d : copysign(tol, middle);
+        fb = evalAt(o, b);
+        if (o->faults != 0 || getErrorCount() > 0)
+            return 0;
+    }
+    report("solve", "brent", SOLVER_MAX_ITERATIONS, false, b, fb);
+    return b;
+}
+
+double solveRoot(EvalNode* f, const Program* program, u32 slot, double low, double high) {
+    Objective o = {f, program, slot, 0};
+    if (!isfinite(low) || !isfinite(high) || high < low) {
+        signalErrorNoToken(ERR_INVALID_RANGE, null, -1);
+        return 0;
+    }
+    double fLow = evalAt(&o, low);
+    double fHigh = evalAt(&o, high);
+    if (failed(&o))
+        return 0;
+    if (fLow == 0 || fHigh == 0) {
+        report("solve", "bracket", 0, true, fLow == 0 ? low : high, 0);
+        return fLow == 0 ? low : high;
+    }
+    if ((fLow > 0) == (fHigh > 0)) {
+        signalErrorNoToken(ERR_NOT_BRACKETED, null, -1);
+        return 0;
+    }
+    double x = isSmooth(f) ? newton(&o, low, high, fLow) : brentRoot(&o, low, high, fLow, fHigh);
+    return failed(&o) ? 0 : x;
+}
+
+// Golden section search, accelerated by parabolic interpolation through the three best points.
+double minimizeFunction(EvalNode* f, const Program* program, u32 slot, double low, double high) {
+    const double golden = 0.3819660112501051; // (3 - sqrt(5)) / 2
+    Objective o = {f, program, slot, 0};
+    if (!isfinite(low) || !isfinite(high) || high < low) {
+        signalErrorNoToken(ERR_INVALID_RANGE, null, -1);
+        return 0;
+    }
+    double a = low, b = high;
+    double x = a + golden * (b - a), w = x, v = x;
+    double fx = evalAt(&o, x), fw = fx, fv = fx;
+    double d = 0, e = 0;
+    for (u32 i = 1; i <= SOLVER_MAX_ITERATIONS; i++) {
+        if (failed(&o))
+            return 0;
+        double middle = 0.5 * (a + b);
+        // Minima can only be located to about the square root of the precision, minima at 0 to the width.
+        double tol = sqrt(DBL_EPSILON) * fabs(x) + DBL_EPSILON * (high - low);
+        if (fabs(x - middle) <= 2 * tol - 0.5 * (b - a)) {
+            report("minimize", "brent", i, true, x, fx);
+            return x;
+        }
+        bool parabolic = false;
+        if (fabs(e) > tol) {
+            double r = (x - w) * (fx - fv);
+            double q = (x - v) * (fx - fw);
+            double p = (x - v) * q - (x - w) * r;
+            q = 2 * (q - r);
+            if (q > 0)
+                p = -p;
+            q = fabs(q);
+            if (fabs(p) < fabs(0.5 * q * e) && p > q * (a - x) && p < q * (b - x)) {
+                e = d;
+                d = p / q;
+                double u = x + d;
+                if (u - a < 2 * tol || b - u < 2 * tol)
+                    d = copysign(tol, middle - x);
+                parabolic = true;
+            }
+        }
+        if (!parabolic) {
+            e = (x >= middle ? a : b) - x;
+            d = golden * e;
+        }
+        double u = fabs(d) >= tol ? x + d : x + copysign(tol, d);
+        double fu = evalAt(&o, u);
+        if (fu <= fx) {
+            if (u >= x)
+                a = x;
+            else
+                b = x;
+            v = w, fv = fw;
+            w = x, fw = fx;
+            x = u, fx = fu;
+        } else {
+            if (u < x)
+                a = u;
+            else
+                b = u;
+            if (fu <= fw || w == x) {
+                v = w, fv = fw;
+                w = u, fw = fu;
+            } else if (fu <= fv || v == x || v == w) {
+                v = u, fv = fu;
+            }
+        }
+    }
+    report("minimize", "brent", SOLVER_MAX_ITERATIONS, false, x, fx);
+    return failed(&o) ? 0 : x;
+}
@@ -1,23 +1,26 @@
 #include "string-builder.h"
 
-#include <stdlib.h>
-
 StringBuilder* createBuilder() {
-    return darrayCreate(4, sizeof(char));
+    StringBuilder* builder = darrayCreateIn(4, sizeof(char), MEM_STRING);
+    if (builder != null)
+        darrayAdd(builder, '\0');
+    return builder;
 }
 
 void initBuilder(StringBuilder *builder) {
-    darrayInit(builder, 4, sizeof(char));
+    darrayInitIn(builder, 4, sizeof(char), MEM_STRING);
     darrayAdd(builder, '\0');
 }
 
 void destroyBuilder(StringBuilder *builder) {
     darrayDestroy(builder);
-    free(builder);
 }
 
 void builderAppendc(StringBuilder *builder, char c) {
-    darrayInsert(builder, c, darrayLength(builder) - 1)
+    // The terminator is missing if a previous allocation failed.
+    if (darrayLength(builder) == 0 && !darrayAdd(builder, '\0'))
+        return;
+    darrayInsert(builder, c, darrayLength(builder) - 1);
 }
 
 void builderAppends(StringBuilder *builder, char* str) {
@@ -64,7 +67,8 @@ void builderDeleteAt(StringBuilder *builder, u64 index) {
 }
 
 u64 builderLength(StringBuilder *builder) {
-    return darrayLength(builder) - 1;
+    u64 length = darrayLength(builder);
+    return length == 0 ? 0 : length - 1;
 }
 
 void builderReset(StringBuilder *builder) {
@@ -73,12 +77,14 @@ void builderReset(StringBuilder *builder) {
 }
 
 const char *builderStringRef(StringBuilder *builder) {
+    if (darrayLength(builder) == 0)
+        return "";
     return (char*)builder->a;
 }
 
 char *builderCreateString(StringBuilder *builder) {
     u64 len = builderLength(builder);
-    char* str = malloc(sizeof *str * (len + 1));
+    char* str = memAlloc(MEM_STRING, sizeof *str * (len + 1));
     if(str == null)
         return null;
     for (u64 i = 0; i < len; i++) {
@@ -0,0 +1,145 @@
+#include "thread-pool.h"
+#include "error.h"
+#include "memory.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct loop {
+    taskfn task;
+    void* arg;
+    u64 count;
+    u64 next; // next task to hand out
+} Loop;
+
+typedef struct pool {
+    pthread_t* workers;
+    u32 workerCount;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     // a loop was started, or the pool is shutting down
+    pthread_cond_t finished; // the last active worker left the loop
+    // Serializes callers of poolFor, only one loop runs at a time.
+    pthread_mutex_t callers;
+    Loop* loop;
+    // Workers inside the current loop. The loop lives on the caller's stack, it must outlast them.
+    u32 active;
+    u64 generation;
+    bool stopping;
+} Pool;
+
+static Pool pool;
+static bool running = false;
+
+// Runs tasks of LOOP until there are none left to hand out.
+static void work(Loop* loop) {
+    u64 index;
+    while ((index = __atomic_fetch_add(&loop->next, 1, __ATOMIC_RELAXED)) < loop->count) {
+        loop->task(loop->arg, index);
+    }
+}
+
+static void* workerMain(void* arg) {
+    (void)arg;
+    initErrorSystem();
+    u64 seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    while (true) {
+        while (!pool.stopping && pool.generation == seen)
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        if (pool.stopping)
+            break;
+        seen = pool.generation;
+        Loop* loop = pool.loop;
+        if (loop == null)
+            continue;
+        pool.active++;
+        pthread_mutex_unlock(&pool.lock);
+        work(loop);
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.active == 0)
+            pthread_cond_signal(&pool.finished);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    shutErrorSystem();
+    return null;
+}
+
+bool initThreadPool(u32 threads) {
+    if (running)
+        return true;
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    pool.workerCount = 0;
+    pool.loop = null;
+    pool.active = 0;
+    pool.generation = 0;
+    pool.stopping = false;
+    pool.workers = null;
+    if (threads > 1) {
+        pool.workers = memAlloc(MEM_GENERAL, (threads - 1) * sizeof(pthread_t));
+        if (pool.workers == null)
+            return false;
+    }
+    pthread_mutex_init(&pool.lock, null);
+    pthread_mutex_init(&pool.callers, null);
+    pthread_cond_init(&pool.wake, null);
+    pthread_cond_init(&pool.finished, null);
+    running = true;
+    for (u32 i = 0; i + 1 < threads; i++) {
+        if (pthread_create(pool.workers + i, null, workerMain, null) != 0)
+            break;
+        pool.workerCount++;
+    }
+    return true;
+}
+
+void shutThreadPool() {
+    if (!running)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (u32 i = 0; i < pool.workerCount; i++) {
+        pthread_join(pool.workers[i], null);
+    }
+    memFree(pool.workers);
+    pool.workers = null;
+    pthread_mutex_destroy(&pool.lock);
+    pthread_mutex_destroy(&pool.callers);
+    pthread_cond_destroy(&pool.wake);
+    pthread_cond_destroy(&pool.finished);
+    running = false;
+}
+
+u32 poolThreadCount() {
+    return running ? pool.workerCount + 1 : 1;
+}
+
+void poolFor(u64 count, taskfn task, void* arg) {
+    Loop loop = {task, arg, count, 0};
+    if (!running || pool.workerCount == 0 || count <= 1) {
+        for (u64 i = 0; i < count; i++) {
+            task(arg, i);
+        }
+        return;
+    }
+    pthread_mutex_lock(&pool.callers);
+    pthread_mutex_lock(&pool.lock);
+    pool.loop = &loop;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    work(&loop);
+
+    // Once the calling thread ran out of tasks, only workers still running one can be active.
+    pthread_mutex_lock(&pool.lock);
+    pool.loop = null;
+    while (pool.active > 0)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.callers);
+}
@@ -0,0 +1,322 @@
+#include "tier.h"
+#include "bytecode.h"
+#include "error.h"
+#include "memory.h"
+#include "program.h"
+#include "ring.h"
+#include "util.h"
+#include "var-handler.h"
+
+#include <pthread.h>
+#include <string.h>
+
+// Statements waiting for the compiler thread, or waiting to be picked up once compiled.
+#define TIER_QUEUE_DEPTH 64
+// Beyond this many shapes, statements of new shapes are walked without being counted.
+#define TIER_MAX_STATEMENTS (1u << 16)
+
+typedef enum {
+    TIER_COLD,   // walked, and counted
+    TIER_QUEUED, // walked, while the compiler thread has its tree
+    TIER_HOT,    // run by its program
+    TIER_WALKED, // cannot be compiled, walked for good
+} TierState;
+
+struct tier_entry {
+    u64 hash;
+    u64 runs;
+    Program* program;
+    u32 target;
+    u8 state;
+    // ProgramLiteral of PROGRAM, their token counted from the first token of the statement.
+    darray literals;
+    u64 keyLength;
+    char key[]; // kind, length and characters of every token, numbers having no characters
+};
+
+typedef struct compile_job {
+    TierEntry* entry;
+    EvalNode* tree;   // owned by the compiler thread until it is compiled
+    u64 begin;        // first token of the statement of TREE
+    Program* program; // null if the tree cannot be compiled
+    darray literals;  // ProgramLiteral of PROGRAM
+} CompileJob;
+
+typedef struct tier_stats {
+    u64 walked;    // runs walked by the interpreter
+    u64 compiled;  // runs of compiled statements
+    u64 fallbacks; // runs of compiled statements which had to be walked
+    u64 promoted;  // statements compiled
+    u64 refused;   // statements which cannot be compiled
+} TierStats;
+
+static bool enabled = false;
+static u32 threshold;
+// Open addressing with linear probing, at most half full.
+static TierEntry** table = null;
+static u64 capacity = 0;
+static u64 count = 0;
+// Key of the statement being counted, reused from one statement to the next.
+static char* key = null;
+static u64 keyCapacity = 0;
+
+static Ring requests; // CompileJob*, evaluating thread -> compiler thread, null stops it
+static Ring compiled; // CompileJob*, compiler thread -> evaluating thread
+static u32 pending = 0;
+static pthread_t compiler;
+static TierStats stats;
+
+static void* compilerMain(void* arg) {
+    (void)arg;
+    initErrorSystem();
+    CompileJob* job;
+    while ((job = ringPop(&requests)) != null) {
+        job->program = programCompileDetached(job->tree, &job->literals);
+        treeDestroy(job->tree);
+        job->tree = null;
+        ProgramLiteral* literals = job->literals.a;
+        for (u64 i = 0; job->program != null && i < job->literals.length; i++) {
+            literals[i].token -= job->begin;
+        }
+        if (job->program == null)
+            darrayEmpty(&job->literals);
+        // Allocation failures only leave the statement to the interpreter.
+        clearErrors();
+        ringPush(&compiled, job);
+    }
+    shutErrorSystem();
+    return null;
+}
+
+bool initTier(u32 hotness) {
+    capacity = 64;
+    table = memAlloc(MEM_TIER, capacity * sizeof(TierEntry*));
+    if (table == null) {
+        clearErrors();
+        return false;
+    }
+    memset(table, 0, capacity * sizeof(TierEntry*));
+    // Room for the jobs in flight, and for the null stopping the compiler thread.
+    if (ringInit(&requests, 2 * TIER_QUEUE_DEPTH)) {
+        if (ringInit(&compiled, TIER_QUEUE_DEPTH)) {
+            if (pthread_create(&compiler, null, compilerMain, null) == 0) {
+                threshold = hotness;
+                enabled = true;
+                return true;
+            }
+            ringDestroy(&compiled);
+        }
+        ringDestroy(&requests);
+    }
+    memFree(table);
+    table = null;
+    return false;
+}
+
+static void pickUp(CompileJob* job) {
+    TierEntry* entry = job->entry;
+    entry->program = job->program;
+    entry->literals = job->literals;
+    entry->state = job->program != null ? TIER_HOT : TIER_WALKED;
+    if (job->program != null)
+        stats.promoted++;
+    else
+        stats.refused++;
+    memFree(job);
+    pending--;
+}
+
+void shutTier() {
+    if (!enabled)
+        return;
+    ringPush(&requests, null);
+    pthread_join(compiler, null);
+    CompileJob* job;
+    while (ringTryPop(&compiled, (void**)&job)) {
+        pickUp(job);
+    }
+    for (u64 i = 0; i < capacity; i++) {
+        if (table[i] != null) {
+            programDestroy(table[i]->program);
+            darrayEmpty(&table[i]->literals);
+        }
+        memFree(table[i]);
+    }
+    memFree(table);
+    memFree(key);
+    ringDestroy(&requests);
+    ringDestroy(&compiled);
+    table = null;
+    key = null;
+    capacity = count = keyCapacity = 0;
+    enabled = false;
+}
+
+bool isTierEnabled() {
+    return enabled;
+}
+
+// Writes the key of the statement [BEGIN, END) of TOKENS to KEY, and returns its length. 0 if memory ran out.
+static u64 buildKey(const TokenStream* tokens, u64 begin, u64 end) {
+    u64 length = 0;
+    for (u64 t = begin; t < end; t++) {
+        length += 1 + sizeof(u32) + (tokenKind(tokens, t) != NUMBER ? tokenLength(tokens, t) : 0);
+    }
+    if (length > keyCapacity) {
+        char* grown = memRealloc(MEM_TIER, key, length);
+        if (grown == null) {
+            clearErrors();
+            return 0;
+        }
+        key = grown;
+        keyCapacity = length;
+    }
+    char* out = key;
+    for (u64 t = begin; t < end; t++) {
+        // Statements differing only by their literals share their entry, their program binds the literals.
+        u32 tokenSize = tokenKind(tokens, t) != NUMBER ? tokenLength(tokens, t) : 0;
+        *out++ = tokenKind(tokens, t);
+        memcpy(out, &tokenSize, sizeof(u32));
+        memcpy(out + sizeof(u32), tokens->source + tokenOffset(tokens, t), tokenSize);
+        out += sizeof(u32) + tokenSize;
+    }
+    return length;
+}
+
+static bool callsFunctions(const TokenStream* tokens, u64 begin, u64 end) {
+    for (u64 t = begin; t + 1 < end; t++) {
+        if (tokenKind(tokens, t) == NAME && tokenPayload(tokens, t) == NO_BUILTIN && tokenKind(tokens, t + 1) == LPAREN)
+            return true;
+    }
+    return false;
+}
+
+static bool grow() {
+    u64 grownCapacity = 2 * capacity;
+    TierEntry** grown = memAlloc(MEM_TIER, grownCapacity * sizeof(TierEntry*));
+    if (grown == null) {
+        clearErrors();
+        return false;
+    }
+    memset(grown, 0, grownCapacity * sizeof(TierEntry*));
+    for (u64 i = 0; i < capacity; i++) {
+        if (table[i] == null)
+            continue;
+        u64 slot = table[i]->hash & (grownCapacity - 1);
+        while (grown[slot] != null)
+            slot = (slot + 1) & (grownCapacity - 1);
+        grown[slot] = table[i];
+    }
+    memFree(table);
+    table = grown;
+    capacity = grownCapacity;
+    return true;
+}
+
+// Entry of the statement keyed by the LENGTH bytes of KEY, created if it is not counted yet.
+static TierEntry* findEntry(u64 length) {
+    u64 hash = hashSource(key, length);
+    u64 slot = hash & (capacity - 1);
+    for (; table[slot] != null; slot = (slot + 1) & (capacity - 1)) {
+        TierEntry* entry = table[slot];
+        if (entry->hash == hash && entry->keyLength == length && memcmp(entry->key, key, length) == 0)
+            return entry;
+    }
+    if (count == TIER_MAX_STATEMENTS)
+        return null;
+    TierEntry* entry = memAlloc(MEM_TIER, sizeof(TierEntry) + length);
+    if (entry == null) {
+        clearErrors();
+        return null;
+    }
+    *entry = (TierEntry){hash, 0, null, NO_TARGET, TIER_COLD, {0, sizeof(ProgramLiteral), 0, null, MEM_TIER}, length};
+    memcpy(entry->key, key, length);
+    table[slot] = entry;
+    count++;
+    if (2 * count > capacity)
+        grow();
+    return entry;
+}
+
+TierEntry* tierCount(const TokenStream* tokens, u64 begin, u64 end) {
+    if (!enabled)
+        return null;
+    CompileJob* job;
+    while (ringTryPop(&compiled, (void**)&job)) {
+        pickUp(job);
+    }
+    u64 length = callsFunctions(tokens, begin, end) ? 0 : buildKey(tokens, begin, end);
+    TierEntry* entry = length > 0 ? findEntry(length) : null;
+    if (entry == null) {
+        stats.walked++;
+        return null;
+    }
+    entry->runs++;
+    if (entry->state != TIER_HOT)
+        stats.walked++;
+    return entry;
+}
+
+bool tierIsHot(const TierEntry* entry) {
+    return entry->state == TIER_HOT;
+}
+
+bool tierPromote(TierEntry* entry, EvalNode* root, u32 target, u64 begin) {
+    if (entry->state != TIER_COLD || entry->runs < threshold || pending == TIER_QUEUE_DEPTH)
+        return false;
+    CompileJob* job = memAlloc(MEM_TIER, sizeof(CompileJob));
+    if (job == null) {
+        clearErrors();
+        return false;
+    }
+    *job = (CompileJob){entry, root, begin, null, {0, sizeof(ProgramLiteral), 0, null, MEM_TIER}};
+    if (!ringTryPush(&requests, job)) {
+        memFree(job);
+        return false;
+    }
+    entry->target = target;
+    entry->state = TIER_QUEUED;
+    pending++;
+    return true;
+}
+
+bool tierRun(TierEntry* entry, const TokenStream* tokens, u64 begin, StatementResult* result) {
+    const ProgramLiteral* literals = entry->literals.a;
+    for (u64 i = 0; i < entry->literals.length; i++) {
+        Number* constants = literals[i].program->constants.a;
+        constants[literals[i].constant] = tokenLiteral(tokens, begin + literals[i].token);
+    }
+    LaneRange range = {0, 0, 0, null, null};
+    u8 faults = 0;
+    double value = 0;
+    i64 integer = 0;
+    bool exact = false;
+    bool matrices = programReadsMatrices(entry->program);
+    if (!matrices) {
+        exact = programRunExact(entry->program, &integer);
+        if (exact)
+            value = roundToPrecision((double)integer);
+        else
+            programRun(entry->program, null, &range, 1, &value, &faults);
+    }
+    if (matrices || faults != 0 || getErrorCount() > 0) {
+        clearErrors();
+        stats.fallbacks++;
+        stats.walked++;
+        return false;
+    }
+    result->value = value;
+    result->exact = exact;
+    result->integer = integer;
+    if (entry->target != NO_TARGET)
+        varSetNumber(entry->target, (Number){value, integer, exact});
+    stats.compiled++;
+    return true;
+}
+
+void tierPrintStats(FILE* stream) {
+    fprintf(stream, "tier: %lu shapes counted, %lu compiled, %lu not compilable, %u being compiled\n", count,
+            stats.promoted, stats.refused, pending);
+    fprintf(stream, "tier: %lu runs walked, %lu runs compiled, %lu compiled runs walked again\n", stats.walked,
+            stats.compiled, stats.fallbacks);
+}
@@ -4,73 +4,136 @@
 
 #include "error.h"
 
-#include <stdlib.h>
-
 // for use inside 'initTokens'.
-#define DEF_TOKEN(id, _symbol, _value, _function)                                                                      \
-    t.identifier = id;                                                                                                 \
-    t.symbol = _symbol;                                                                                                \
-    t.value._value;                                                                                                  \
-    t.function = _function;                                                                                            \
-    _darrayAdd(&prebuilt, &t)
+#define DEF_TOKEN(id, _symbol)                                                                                         \
+    symbols[id] = _symbol;                                                                                             \
+    charIdentifiers[(u8)_symbol[0]] = id
 
 // Can't put this inside 'function.c', because it would not be a compile-time constant anymore.
-const Function NONE = {null, 0};
+const Function NONE = {null, 0, false, null};
+
+static const char* symbols[_IDENTIFIER_SIZE];
+// Single character tokens, indexed by character. _IDENTIFIER_SIZE for all other characters.
+static u8 charIdentifiers[256];
+
+void tokenStreamInit(TokenStream* stream, const char* source) {
+    stream->source = source;
+    darrayInitIn(&stream->kinds, 16, sizeof(u8), MEM_LEXER);
+    darrayInitIn(&stream->offsets, 16, sizeof(u32), MEM_LEXER);
+    darrayInitIn(&stream->lengths, 16, sizeof(u32), MEM_LEXER);
+    darrayInitIn(&stream->payloads, 16, sizeof(u32), MEM_LEXER);
+    darrayInitIn(&stream->literals, 8, sizeof(Number), MEM_LEXER);
+}
+
+void tokenStreamDestroy(TokenStream* stream) {
+    darrayEmpty(&stream->kinds);
+    darrayEmpty(&stream->offsets);
+    darrayEmpty(&stream->lengths);
+    darrayEmpty(&stream->payloads);
+    darrayEmpty(&stream->literals);
+}
+
+void tokenStreamReset(TokenStream* stream, const char* source) {
+    stream->source = source;
+    darrayClear(&stream->kinds);
+    darrayClear(&stream->offsets);
+    darrayClear(&stream->lengths);
+    darrayClear(&stream->payloads);
+    darrayClear(&stream->literals);
+}
+
+bool tokenStreamPush(TokenStream* stream, Identifier kind, u32 offset, u32 length, u32 payload) {
+    u8 k = kind;
+    // Keep the arrays the same length: a token is only pushed if all of its fields were.
+    if (!darrayAdd(&stream->kinds, k))
+        return false;
+    if (!darrayAdd(&stream->offsets, offset)) {
+        darrayPop(&stream->kinds, null);
+        return false;
+    }
+    if (!darrayAdd(&stream->lengths, length)) {
+        darrayPop(&stream->kinds, null);
+        darrayPop(&stream->offsets, null);
+        return false;
+    }
+    if (!darrayAdd(&stream->payloads, payload)) {
+        darrayPop(&stream->kinds, null);
+        darrayPop(&stream->offsets, null);
+        darrayPop(&stream->lengths, null);
+        return false;
+    }
+    return true;
+}
+
+bool tokenStreamAddLiteral(TokenStream* stream, Number value, u32* outIndex) {
+    *outIndex = darrayLength(&stream->literals);
+    return darrayAdd(&stream->literals, value);
+}
 
-static darray prebuilt;
+u64 tokenCount(const TokenStream* stream) {
+    return stream->kinds.length;
+}
+
+Identifier tokenKind(const TokenStream* stream, u64 index) {
+    return ((u8*)stream->kinds.a)[index];
+}
+
+u32 tokenOffset(const TokenStream* stream, u64 index) {
+    return ((u32*)stream->offsets.a)[index];
+}
+
+u32 tokenLength(const TokenStream* stream, u64 index) {
+    return ((u32*)stream->lengths.a)[index];
+}
+
+u32 tokenPayload(const TokenStream* stream, u64 index) {
+    return ((u32*)stream->payloads.a)[index];
+}
+
+double tokenNumber(const TokenStream* stream, u64 index) {
+    return tokenLiteral(stream, index).value;
+}
+
+Number tokenLiteral(const TokenStream* stream, u64 index) {
+    return ((Number*)stream->literals.a)[tokenPayload(stream, index)];
+}
+
+const OperatorDesc* tokenOperator(const TokenStream* stream, u64 index) {
+    return getOperator(tokenPayload(stream, index));
+}
 
 const char *getSymbol(Identifier identifier) {
-    if (identifier < LPAREN || identifier == _IDENTIFIER_SIZE)
+    if (identifier < LPAREN || identifier >= _IDENTIFIER_SIZE)
         return null;
-
-    Token t;
-    darrayGet(&prebuilt, identifier - LPAREN, &t);
-    return t.symbol;
+    return symbols[identifier];
 }
 
 Identifier getIdentifier(const char *symbol) {
-    for (u64 i = 0; i < _IDENTIFIER_SIZE - LPAREN; i++) {
-        Token token;
-        darrayGet(&prebuilt, i, &token);
-        const char *s = token.symbol;
-        const char *t = symbol;
-        if (streq(s, t))
-            return token.identifier;
+    for (u64 i = LPAREN; i < _IDENTIFIER_SIZE; i++) {
+        if (streq(symbols[i], symbol))
+            return i;
     }
     return _IDENTIFIER_SIZE;
 }
 
-bool initToken(Token* tok, Identifier identifier, char *symbol, u64 position) {
-    tok->identifier = identifier;
-    tok->symbol = symbol;
-    tok->position = position;
-    switch (identifier) {
-    case _IDENTIFIER_SIZE:
-        return false;
-    case OPERATOR:
-        if (!operatorFromSymbol(symbol, tok)) {
-            return false;
-        }
-        break;
-    case NUMBER:
-        tok->value.number = strtod(symbol, null);
-        break;
-    default:
-        tok->function = NONE;
-        tok->value.number = 0;
-        break;
-    }
-    return true;
+Identifier identifierFromChar(char c) {
+    return charIdentifiers[(u8)c];
 }
 
 bool isGeneric(Identifier identifier) { return identifier >= LPAREN && identifier < _IDENTIFIER_SIZE; }
 
 void initTokens() {
-    darrayInit(&prebuilt, 4, sizeof(Token));
-    Token t;
-    DEF_TOKEN(LPAREN, "(", number = 0, NONE);
-    DEF_TOKEN(RPAREN, ")", number = 0, NONE);
-    DEF_TOKEN(SEMI, ";", number = 0, NONE);
+    for (u64 i = 0; i < 256; i++) {
+        charIdentifiers[i] = _IDENTIFIER_SIZE;
+    }
+    DEF_TOKEN(LPAREN, "(");
+    DEF_TOKEN(RPAREN, ")");
+    DEF_TOKEN(SEMI, ";");
+    DEF_TOKEN(COMMA, ",");
+    DEF_TOKEN(QUESTION, "?");
+    DEF_TOKEN(COLON, ":");
+    DEF_TOKEN(LBRACKET, "[");
+    DEF_TOKEN(RBRACKET, "]");
 }
 
-void shutTokens() { free(prebuilt.a); }
+void shutTokens() {}
@@ -0,0 +1,208 @@
+#include "var-handler.h"
+#include "bignum.h"
+#include "matrix.h"
+#include "memory.h"
+#include "util.h"
+
+#include <math.h>
+#include <string.h>
+
+static VarCtx variables;
+
+void initVariables() {
+    variables.count = 0;
+}
+
+void shutVariables() {
+    for (u32 i = 0; i < variables.count; i++) {
+        memFree(variables.names[i]);
+        matrixDestroy(variables.matrices[i]);
+        memFree(variables.bigs[i]);
+    }
+    variables.count = 0;
+}
+
+bool varFind(const char* name, u64 length, u32* outSlot) {
+    for (u32 i = 0; i < variables.count; i++) {
+        const char* candidate = variables.names[i];
+        u64 j = 0;
+        while (j < length && candidate[j] != '\0' && candidate[j] == name[j])
+            j++;
+        if (j == length && candidate[j] == '\0') {
+            *outSlot = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool varDeclare(const char* name, u64 length, u32* outSlot) {
+    if (varFind(name, length, outSlot))
+        return true;
+    if (variables.count == MAX_VARIABLES)
+        return false;
+    char* copy = memAlloc(MEM_STRING, length + 1);
+    if (copy == null)
+        return false;
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    *outSlot = variables.count;
+    variables.names[*outSlot] = copy;
+    variables.values[*outSlot] = 0;
+    variables.integers[*outSlot] = 0;
+    variables.exact[*outSlot] = true;
+    variables.imaginary[*outSlot] = 0;
+    variables.matrices[*outSlot] = null;
+    variables.bigs[*outSlot] = null;
+    variables.generations[*outSlot] = 0;
+    variables.count++;
+    return true;
+}
+
+u32 varCount() {
+    return variables.count;
+}
+
+const char* varName(u32 slot) {
+    return variables.names[slot];
+}
+
+double varGet(u32 slot) {
+    return variables.values[slot];
+}
+
+void varSet(u32 slot, double value) {
+    varSetNumber(slot, (Number){value, 0, false});
+}
+
+Number varGetNumber(u32 slot) {
+    return (Number){variables.values[slot], variables.integers[slot], variables.exact[slot]};
+}
+
+void varSetNumber(u32 slot, Number value) {
+    matrixDestroy(variables.matrices[slot]);
+    variables.matrices[slot] = null;
+    memFree(variables.bigs[slot]);
+    variables.bigs[slot] = null;
+    variables.values[slot] = value.value;
+    variables.integers[slot] = value.integer;
+    variables.exact[slot] = value.exact;
+    variables.imaginary[slot] = 0;
+}
+
+double varGetImaginary(u32 slot) {
+    return variables.imaginary[slot];
+}
+
+void varSetImaginary(u32 slot, double imaginary) {
+    variables.imaginary[slot] = imaginary;
+    if (imaginary != 0)
+        variables.exact[slot] = false;
+}
+
+Matrix* varMatrix(u32 slot) {
+    return variables.matrices[slot];
+}
+
+void varSetMatrix(u32 slot, Matrix* matrix) {
+    varSetNumber(slot, (Number){NAN, 0, false});
+    variables.matrices[slot] = matrix;
+    variables.generations[slot]++;
+}
+
+const Big* varBig(u32 slot) {
+    return variables.bigs[slot];
+}
+
+void varSetBig(u32 slot, Big* value) {
+    Number number = {bigToDouble(value), 0, false};
+    number.exact = bigToInteger(value, &number.integer);
+    varSetNumber(slot, number);
+    variables.bigs[slot] = value;
+    variables.generations[slot]++;
+}
+
+u64 varGeneration(u32 slot) {
+    return variables.generations[slot];
+}
+
+bool varSnapshot(VarSnapshot* out) {
+    out->count = variables.count;
+    out->values = memAlloc(MEM_GENERAL, (variables.count + 1) * sizeof(VarValue));
+    if (out->values == null) {
+        out->count = 0;
+        return false;
+    }
+    for (u32 slot = 0; slot < variables.count; slot++) {
+        VarValue* value = out->values + slot;
+        *value = (VarValue){varGetNumber(slot), variables.imaginary[slot], null, null};
+        if (variables.matrices[slot] != null)
+            value->matrix = matrixCopy(variables.matrices[slot]);
+        if (variables.bigs[slot] != null)
+            value->big = bigClone(variables.bigs[slot]);
+        if ((variables.matrices[slot] != null && value->matrix == null) ||
+            (variables.bigs[slot] != null && value->big == null)) {
+            out->count = slot + 1;
+            varSnapshotDestroy(out);
+            return false;
+        }
+    }
+    return true;
+}
+
+void varSnapshotDestroy(VarSnapshot* snapshot) {
+    for (u32 slot = 0; slot < snapshot->count; slot++) {
+        matrixDestroy(snapshot->values[slot].matrix);
+        memFree(snapshot->values[slot].big);
+    }
+    memFree(snapshot->values);
+    snapshot->values = null;
+    snapshot->count = 0;
+}
+
+static VarValue snapshotValue(const VarSnapshot* snapshot, u32 slot) {
+    return slot < snapshot->count ? snapshot->values[slot] : (VarValue){{0, 0, true}, 0, null, null};
+}
+
+static bool sameMatrix(const Matrix* a, const Matrix* b) {
+    if (a == null || b == null)
+        return a == b;
+    return a->rows == b->rows && a->columns == b->columns &&
+           memcmp(a->data, b->data, (u64)a->rows * a->columns * sizeof(double)) == 0;
+}
+
+// Values are normalized, equal values have the same limbs.
+static bool sameBig(const Big* a, const Big* b) {
+    if (a == null || b == null)
+        return a == b;
+    return a->length == b->length && a->negative == b->negative && a->exponent == b->exponent &&
+           memcmp(a->limbs, b->limbs, a->length * sizeof(u32)) == 0;
+}
+
+bool varSnapshotSame(const VarSnapshot* a, const VarSnapshot* b, u32 slot) {
+    VarValue x = snapshotValue(a, slot);
+    VarValue y = snapshotValue(b, slot);
+    return memcmp(&x.number.value, &y.number.value, sizeof(double)) == 0 && x.number.exact == y.number.exact &&
+           (!x.number.exact || x.number.integer == y.number.integer) &&
+           memcmp(&x.imaginary, &y.imaginary, sizeof(double)) == 0 && sameMatrix(x.matrix, y.matrix) &&
+           sameBig(x.big, y.big);
+}
+
+bool varRestore(const VarSnapshot* snapshot, u32 slot) {
+    VarValue value = snapshotValue(snapshot, slot);
+    if (value.matrix != null) {
+        Matrix* copy = matrixCopy(value.matrix);
+        if (copy == null)
+            return false;
+        varSetMatrix(slot, copy);
+    } else if (value.big != null) {
+        Big* copy = bigClone(value.big);
+        if (copy == null)
+            return false;
+        varSetBig(slot, copy);
+    } else {
+        varSetNumber(slot, value.number);
+        varSetImaginary(slot, value.imaginary);
+    }
+    return true;
+}
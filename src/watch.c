@@ -0,0 +1,320 @@
+#include "watch.h"
+#include "bytecode.h"
+#include "error.h"
+#include "interpreter.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "var-handler.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Bit sets over variable slots.
+#define SET_WORDS (MAX_VARIABLES / 64)
+
+typedef struct watched_line {
+    u64 hash;
+    // With its line feed, like the lines read by the REPL.
+    char* text;
+    u64 length;
+    // The line compiled on its own. Lines with solvers or errors are evaluated from their text.
+    Module module;
+    bool compiled;
+    bool failed;
+    // Variables named by the line, which it reads or assigns.
+    u64 names[SET_WORDS];
+    // Calls or definitions of user functions. Bodies read variables the calls do not name.
+    bool functions;
+    // Values of the variables before and after the line, when it was last evaluated or skipped.
+    VarSnapshot before;
+    VarSnapshot after;
+} WatchedLine;
+
+// A line of the new version of the file.
+typedef struct line_view {
+    const char* start;
+    u64 length;
+    u64 hash;
+} LineView;
+
+static bool sameLine(const WatchedLine* line, const LineView* view) {
+    return line->hash == view->hash && line->length == view->length &&
+           memcmp(line->text, view->start, view->length) == 0;
+}
+
+static void destroyLine(WatchedLine* line) {
+    moduleDestroy(&line->module);
+    varSnapshotDestroy(&line->before);
+    varSnapshotDestroy(&line->after);
+    memFree(line->text);
+}
+
+static bool createLine(const LineView* view, WatchedLine* outLine) {
+    outLine->text = memAlloc(MEM_STRING, view->length + 2);
+    if (outLine->text == null)
+        return false;
+    memcpy(outLine->text, view->start, view->length);
+    outLine->text[view->length] = '\n';
+    outLine->text[view->length + 1] = '\0';
+    outLine->length = view->length;
+    outLine->hash = view->hash;
+    moduleInit(&outLine->module);
+    outLine->compiled = false;
+    outLine->failed = false;
+    memset(outLine->names, 0, sizeof outLine->names);
+    outLine->functions = false;
+    outLine->before = (VarSnapshot){null, 0};
+    outLine->after = (VarSnapshot){null, 0};
+    return true;
+}
+
+// Compiles LINE if possible.
+static void compileLine(WatchedLine* line) {
+    line->compiled = moduleCompileLine(&line->module, line->text);
+    // The interpreter reports the errors when the line is evaluated.
+    clearErrors();
+}
+
+// Finds the variables LINE names, once it was evaluated: those it declares exist then.
+static void findNames(WatchedLine* line) {
+    TokenStream tokens;
+    tokenStreamInit(&tokens, line->text);
+    tokenize(line->text, &tokens);
+    clearErrors();
+    line->functions = tokensUseFunctions(&tokens);
+    memset(line->names, 0, sizeof line->names);
+    for (u64 t = 0; t < tokenCount(&tokens); t++) {
+        u32 slot;
+        if (tokenKind(&tokens, t) == NAME &&
+            varFind(line->text + tokenOffset(&tokens, t), tokenLength(&tokens, t), &slot))
+            line->names[slot / 64] |= 1ul << (slot % 64);
+    }
+    tokenStreamDestroy(&tokens);
+}
+
+static bool names(const WatchedLine* line, u32 slot) {
+    return (line->names[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void evaluateLine(WatchedLine* line, u64 number, darray* results, FILE* out, FILE* errStream) {
+    if (line->compiled && !moduleReadsMatrices(&line->module, 0))
+        line->failed = !moduleEvaluateLine(&line->module, 0, results);
+    else
+        line->failed = !evaluate(line->text, results);
+    if (darrayLength(results) > 0) {
+        fprintf(out, "\e[2mline %lu\e[0m\n", number);
+        printResults(out, errStream, results);
+    }
+    clearResults(results);
+    findNames(line);
+}
+
+// Sets every variable to its value in SNAPSHOT.
+static bool restoreAll(const VarSnapshot* snapshot) {
+    for (u32 slot = 0; slot < varCount(); slot++) {
+        if (!varRestore(snapshot, slot))
+            return false;
+    }
+    return true;
+}
+
+// Brings the variables from their values before LINE to their values after it: evaluates LINE if it is new,
+// or if what it reads changed since it was last evaluated. Otherwise it would assign the same values again.
+static bool runLine(WatchedLine* line, u64 number, bool fresh, bool functionsChanged, darray* results, FILE* out,
+                    FILE* errStream, u64* evaluated) {
+    VarSnapshot before;
+    if (!varSnapshot(&before))
+        return false;
+    bool inputsChanged = false;
+    bool anyChanged = functionsChanged;
+    for (u32 slot = 0; !fresh && slot < varCount(); slot++) {
+        if (!varSnapshotSame(&before, &line->before, slot)) {
+            anyChanged = true;
+            inputsChanged |= names(line, slot);
+        }
+    }
+    if (fresh || inputsChanged || ((line->failed || line->functions) && anyChanged)) {
+        // Failed lines may compile now that the variables they need exist.
+        if (!line->compiled && (fresh || line->failed))
+            compileLine(line);
+        evaluateLine(line, number, results, out, errStream);
+        (*evaluated)++;
+    } else {
+        for (u32 slot = 0; slot < varCount(); slot++) {
+            if (names(line, slot) && !varRestore(&line->after, slot)) {
+                varSnapshotDestroy(&before);
+                return false;
+            }
+        }
+    }
+    varSnapshotDestroy(&line->before);
+    varSnapshotDestroy(&line->after);
+    line->before = before;
+    return varSnapshot(&line->after);
+}
+
+/*
+ * Lines common to the start and to the end of both versions are kept, the lines in between are replaced.
+ * Then lines are evaluated in order, if they are new or depend on what was evaluated before them.
+ */
+static bool update(darray* lines, const char* content, u64 length, darray* results, FILE* out, FILE* errStream) {
+    darray views;
+    darrayInitIn(&views, 64, sizeof(LineView), MEM_GENERAL);
+    for (u64 start = 0; start < length;) {
+        const char* newline = memchr(content + start, '\n', length - start);
+        u64 end = newline != null ? (u64)(newline - content) : length;
+        LineView view = {content + start, end - start, hashSource(content + start, end - start)};
+        if (!darrayAdd(&views, view)) {
+            darrayEmpty(&views);
+            return false;
+        }
+        start = end + 1;
+    }
+
+    const LineView* next = views.a;
+    WatchedLine* previous = lines->a;
+    u64 newCount = views.length;
+    u64 oldCount = lines->length;
+    u64 prefix = 0;
+    while (prefix < newCount && prefix < oldCount && sameLine(previous + prefix, next + prefix))
+        prefix++;
+    u64 suffix = 0;
+    while (suffix < newCount - prefix && suffix < oldCount - prefix &&
+           sameLine(previous + oldCount - 1 - suffix, next + newCount - 1 - suffix))
+        suffix++;
+
+    darray updated;
+    darrayInitIn(&updated, newCount + 1, sizeof(WatchedLine), MEM_GENERAL);
+    bool ok = true;
+    for (u64 i = 0; ok && i < newCount; i++) {
+        WatchedLine line;
+        if (i < prefix)
+            line = previous[i];
+        else if (i >= newCount - suffix)
+            line = previous[oldCount - newCount + i];
+        else if (!createLine(next + i, &line))
+            ok = false;
+        if (ok && !darrayAdd(&updated, line)) {
+            if (i >= prefix && i < newCount - suffix)
+                destroyLine(&line);
+            ok = false;
+        }
+    }
+    if (!ok) {
+        // Keep the previous version, minus the lines created for the new one.
+        for (u64 i = prefix; i < updated.length; i++) {
+            destroyLine((WatchedLine*)updated.a + i);
+        }
+        darrayEmpty(&updated);
+        darrayEmpty(&views);
+        return false;
+    }
+    for (u64 i = prefix; i < oldCount - suffix; i++) {
+        destroyLine(previous + i);
+    }
+    darrayEmpty(lines);
+    *lines = updated;
+    darrayEmpty(&views);
+
+    // The lines above the first new one are unchanged, the variables get back the values they had after them.
+    VarSnapshot initial = {null, 0};
+    WatchedLine* all = lines->a;
+    if (!restoreAll(prefix > 0 ? &all[prefix - 1].after : &initial))
+        return false;
+    u64 evaluated = 0;
+    // Evaluated definitions add functions, the lines using functions must be parsed again to call them.
+    u32 functions = getUserFunctionCount();
+    for (u64 i = prefix; i < newCount; i++) {
+        bool fresh = i < newCount - suffix;
+        if (!runLine(all + i, i + 1, fresh, functions != getUserFunctionCount(), results, out, errStream, &evaluated))
+            return false;
+    }
+    fprintf(out, "\e[2m%lu of %lu lines evaluated.\e[0m\n\n", evaluated, newCount);
+    fflush(out);
+    return true;
+}
+
+static char* readFile(const char* path, u64* outLength) {
+    FILE* file = fopen(path, "rb");
+    if (file == null)
+        return null;
+    char* content = null;
+    size_t length = 0;
+    FILE* buffer = open_memstream(&content, &length);
+    if (buffer != null) {
+        char chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof chunk, file)) > 0) {
+            fwrite(chunk, 1, n, buffer);
+        }
+        fclose(buffer);
+    }
+    fclose(file);
+    *outLength = length;
+    return content;
+}
+
+static bool reload(const char* path, darray* lines, darray* results, FILE* out, FILE* errStream) {
+    u64 length;
+    char* content = readFile(path, &length);
+    if (content == null) {
+        fprintf(errStream, "Could not read '%s'.\n", path);
+        return false;
+    }
+    bool ok = update(lines, content, length, results, out, errStream);
+    if (!ok)
+        fprintf(errStream, "Out of memory, '%s' was not evaluated again.\n", path);
+    free(content);
+    return ok;
+}
+
+bool watchRun(const char* path, FILE* out, FILE* errStream) {
+    // Editors often save by renaming a new file over the old one: watch the directory, not the file.
+    const char* slash = strrchr(path, '/');
+    const char* name = slash != null ? slash + 1 : path;
+    char directory[slash != null ? slash - path + 2 : 2];
+    if (slash == null)
+        strcpy(directory, ".");
+    else
+        snprintf(directory, sizeof directory, "%.*s", (int)(slash == path ? 1 : slash - path), path);
+
+    int notify = inotify_init1(IN_CLOEXEC);
+    if (notify < 0 || inotify_add_watch(notify, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(errStream, "Could not watch '%s'.\n", path);
+        if (notify >= 0)
+            close(notify);
+        return false;
+    }
+
+    darray lines;
+    darray results;
+    darrayInitIn(&lines, 64, sizeof(WatchedLine), MEM_GENERAL);
+    initResults(&results);
+    bool ok = reload(path, &lines, &results, out, errStream);
+    while (ok) {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t size = read(notify, events, sizeof events);
+        if (size <= 0) {
+            ok = false;
+            break;
+        }
+        bool saved = false;
+        for (char* at = events; at < events + size;) {
+            struct inotify_event* event = (struct inotify_event*)at;
+            saved |= event->len > 0 && strcmp(event->name, name) == 0;
+            at += sizeof *event + event->len;
+        }
+        // A failed reload keeps the previous state, the next save may succeed.
+        if (saved)
+            reload(path, &lines, &results, out, errStream);
+    }
+    for (u64 i = 0; i < lines.length; i++) {
+        destroyLine((WatchedLine*)lines.a + i);
+    }
+    darrayEmpty(&lines);
+    darrayEmpty(&results);
+    close(notify);
+    return ok;
+}